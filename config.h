@@ -7,3 +7,67 @@
 
 #define FS_NUM_INODES (FILE_SYSTEM_SIZE)/(FS_BYTES_PER_INODE)
 
+//Default number of allocation groups the pool is split into, every group has its own free chain and lock
+#define FS_NUM_ALLOC_GROUPS 8
+
+//Number of hash buckets (as a power of 2) used by the content deduplication table
+#define FS_DEDUP_HASH_BITS 14
+
+//Size of the staging buffer used for the sequential reads and writes of a checkpoint file
+#define FS_CHECKPOINT_BUF_SIZE (1024*1024)
+
+//The pool is allocated in physically contiguous segments of 2^FS_POOL_SEGMENT_ORDER blocks
+#define FS_POOL_SEGMENT_ORDER 8
+
+//Default number of free blocks which are never released to the kernel under memory pressure
+#define FS_POOL_RESERVE_BLOCKS 1024
+
+//Released blocks are taken back from the kernel FS_POOL_REFILL_BLOCKS at a time when the free blocks drop below the low watermark
+#define FS_POOL_LOW_WATERMARK 256
+#define FS_POOL_REFILL_BLOCKS 256
+
+//Full block writes are copied with non-temporal stores once an inode has been written sequentially for this many blocks
+#define FS_COPY_STREAM_BLOCKS 16
+
+//Size of the data copied by the copy benchmark and of the cache resident working set it re-reads after every copy
+#define FS_BENCH_COPY_BLOCKS 4096
+#define FS_BENCH_COPY_REPS 8
+#define FS_BENCH_HOT_SIZE (1024*1024)
+
+//Number of inodes (a power of 2) and logical blocks per inode used by the inode lookup benchmark
+#define FS_BENCH_LOOKUP_INODES 4096
+#define FS_BENCH_LOOKUP_BLOCKS 12
+#define FS_BENCH_LOOKUP_REPS 16
+
+//Size of the file written by the range lock benchmark, chunk written per call and maximum number of concurrent writers
+#define FS_BENCH_RANGE_BLOCKS 4096
+#define FS_BENCH_RANGE_CHUNK (16*FS_BLOCK_SIZE)
+#define FS_BENCH_RANGE_REPS 8
+#define FS_BENCH_RANGE_MAX_WRITERS 8
+
+//Interval between two passes of the defrag thread over all the inodes
+#define FS_DEFRAG_INTERVAL_MS 10000
+
+//The fragmentation counts in the stats file are recomputed at most once per interval
+#define FS_FRAG_STATS_INTERVAL_MS 1000
+
+//Default number of pre-zeroed blocks kept over all the allocation groups, 0 disables pre-zeroing
+#define FS_ZERO_POOL_BLOCKS 1024
+
+//Appends are buffered per inode up to this many blocks before pool blocks are allocated for them, 0 disables delayed allocation
+#define FS_DELALLOC_BLOCKS 16
+
+//Largest per inode delayed allocation buffer accepted from the delalloc module parameter
+#define FS_DELALLOC_MAX_BLOCKS 256
+
+//Buffered appends are flushed to pool blocks once they are this old
+#define FS_DELALLOC_FLUSH_MS 1000
+
+//Blocks taken from the free chains per group lock round trip when a file is extended by truncate_inode() or preallocate_inode()
+#define FS_PREALLOC_BATCH_BLOCKS 32
+
+//Disk maps of at least this many blocks are dropped by the reclaim worker when their file is unlinked or truncated to zero
+#define FS_RECLAIM_MIN_BLOCKS 64
+
+//Largest number of operations accepted by one FS_IOC_BATCH ioctl
+#define FS_BATCH_MAX_OPS 4096
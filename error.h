@@ -5,3 +5,8 @@
 #define FS_ENO_FREE_BLOCK 5
 #define FS_E_MAX_LIMIT 6
 
+#define FS_EIO 7
+#define FS_ECHECKPOINT_FORMAT 8
+#define FS_ENO_CHECKPOINT 9
+#define FS_EDAX 10
+#define FS_ENO_FREE_INODE 11
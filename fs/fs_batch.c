@@ -0,0 +1,187 @@
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+
+#include "../include/fs_batch.h"
+
+/*
+Batched metadata operations
+
+An FS_IOC_BATCH ioctl on /sys/kernel/debug/ramfs/batch runs an array of create, unlink, truncate and preallocate operations in one kernel entry
+and writes the result of every operation back into the array, the operations run in order and a failed operation does not stop the batch
+A run of consecutive creates and unlinks takes fs_vfs->vfs_lock twice for the whole run instead of once per inode,
+truncates and preallocations allocate their blocks in batches from one reservation (see truncate_inode())
+*/
+
+static bool is_namespace_op(u32 op)
+{
+	return op == FS_BATCH_CREATE || op == FS_BATCH_UNLINK;
+}
+
+/*
+Returns the allocated inode the operation refers to, sets the result of the operation and returns NULL if there is none
+*/
+static struct fs_inode * batch_op_inode(struct fs_vfs * fs_vfs, struct fs_batch_op * op)
+{
+	if(op->inode_num < 0 || op->inode_num >= FS_NUM_INODES || !READ_ONCE(fs_vfs->inode_table[op->inode_num]->allocated))
+	{
+		op->result = -FS_EINPUT_PARAMETER;
+		return NULL;
+	}
+	
+	return fs_vfs->inode_table[op->inode_num];
+}
+
+/*
+Runs num_ops consecutive FS_BATCH_CREATE and FS_BATCH_UNLINK operations
+The unlinked inodes are moved to a private list under the first vfs_lock round trip, so they can neither be unlinked twice nor reused by a create,
+their blocks are dropped without vfs_lock (trim_inode_disk_map() takes fs_vfs->snapshot_rwsem which is taken before vfs_lock)
+and they are returned to the free list together
+*/
+static void run_namespace_ops(struct fs_vfs * fs_vfs, struct fs_batch_op * ops, int num_ops)
+{
+	LIST_HEAD(unlinked);
+	struct fs_inode * inode, * next;
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	for(int i = 0; i < num_ops; i++)
+	{
+		if(ops[i].op == FS_BATCH_CREATE)
+		{
+			inode = get_inode_locked(fs_vfs);
+			ops[i].inode_num = inode ? inode->inode_num : -1;
+			ops[i].result = inode ? 0 : -FS_ENO_FREE_INODE;
+			continue;
+		}
+		
+		inode = batch_op_inode(fs_vfs, &ops[i]);
+		if(!inode)
+			continue;
+		
+		list_move(&inode->fs_vfs_inode_list, &unlinked);
+		inode->allocated = false;
+	}
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	if(list_empty(&unlinked))
+		return;
+	
+	list_for_each_entry(inode, &unlinked, fs_vfs_inode_list)
+		trim_inode_disk_map(fs_vfs, inode);
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	list_for_each_entry_safe(inode, next, &unlinked, fs_vfs_inode_list)
+		put_inode_locked(fs_vfs, inode);
+	mutex_unlock(&fs_vfs->vfs_lock);
+}
+
+/*
+Runs the operations in order, returns the number of operations which failed
+*/
+static int run_batch(struct fs_vfs * fs_vfs, struct fs_batch_op * ops, int num_ops)
+{
+	int num_failed = 0;
+	int i = 0;
+	
+	for(int j = 0; j < num_ops; j++)
+		ops[j].result = 0;
+	
+	while(i < num_ops)
+	{
+		int run = 0;
+		while(i + run < num_ops && is_namespace_op(ops[i + run].op))
+			run += 1;
+		
+		if(run)
+		{
+			run_namespace_ops(fs_vfs, &ops[i], run);
+			i += run;
+			continue;
+		}
+		
+		struct fs_batch_op * op = &ops[i++];
+		struct fs_inode * inode;
+		
+		switch(op->op)
+		{
+			case FS_BATCH_TRUNCATE:
+				inode = batch_op_inode(fs_vfs, op);
+				if(inode)
+					op->result = truncate_inode(fs_vfs, inode, op->size);
+				break;
+			
+			case FS_BATCH_PREALLOCATE:
+				inode = batch_op_inode(fs_vfs, op);
+				if(inode)
+					op->result = preallocate_inode(fs_vfs, inode, op->size);
+				break;
+			
+			default:
+				op->result = -FS_EINPUT_PARAMETER;
+		}
+	}
+	
+	for(int j = 0; j < num_ops; j++)
+	{
+		if(ops[j].result)
+			num_failed += 1;
+	}
+	
+	atomic64_inc(&fs_vfs->batch_calls);
+	atomic64_add(num_ops, &fs_vfs->batch_ops);
+	
+	return num_failed;
+}
+
+static long batch_ioctl(struct file * file, unsigned int cmd, unsigned long arg)
+{
+	struct fs_vfs * fs_vfs = file->private_data;
+	struct fs_batch __user * ubatch = (struct fs_batch __user *)arg;
+	struct fs_batch batch;
+	long ret = 0;
+	
+	if(cmd != FS_IOC_BATCH)
+		return -ENOTTY;
+	
+	if(copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	
+	if(batch.num_ops == 0 || batch.num_ops > FS_BATCH_MAX_OPS)
+		return -EINVAL;
+	
+	size_t size = (size_t)batch.num_ops * sizeof(struct fs_batch_op);
+	struct fs_batch_op * ops = kvmalloc(size, GFP_KERNEL);
+	if(!ops)
+		return -ENOMEM;
+	
+	if(copy_from_user(ops, u64_to_user_ptr(batch.ops), size))
+	{
+		ret = -EFAULT;
+		goto out;
+	}
+	
+	batch.num_failed = run_batch(fs_vfs, ops, batch.num_ops);
+	
+	if(copy_to_user(u64_to_user_ptr(batch.ops), ops, size) || copy_to_user(ubatch, &batch, sizeof(batch)))
+		ret = -EFAULT;
+	
+out:
+	kvfree(ops);
+	return ret;
+}
+
+static const struct file_operations batch_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.unlocked_ioctl = batch_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+/*
+Creates the batch ioctl file, has to be called after initialise_fs_stats()
+*/
+void initialise_batch(struct fs_vfs * fs_vfs)
+{
+	debugfs_create_file("batch", 0600, fs_vfs->stats_dentry, fs_vfs, &batch_fops);
+}
@@ -0,0 +1,416 @@
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/perf_event.h>
+#include <linux/log2.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+
+#include "../include/fs_bench.h"
+#include "../include/fs_copy.h"
+#include "../include/fs_io.h"
+
+/*
+In module benchmarks, selected with the bench module parameter (see include/fs_bench.h)
+Results are printed to the kernel log
+*/
+
+static u64 bench_bandwidth(u64 bytes, u64 ns)
+{
+	//bytes per ns is GB/s, scale it to MB/s
+	return ns ? div64_u64(bytes * 1000, ns) : 0;
+}
+
+/*
+Counts last level cache misses of the current task, returns NULL when the CPU does not expose the counter (e.g., most VMs)
+*/
+static struct perf_event * create_cache_miss_counter(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.size = sizeof(struct perf_event_attr),
+		.disabled = 0,
+		.exclude_user = 1,
+	};
+	
+	struct perf_event * event = perf_event_create_kernel_counter(&attr, -1, current, NULL, NULL);
+	
+	return IS_ERR(event) ? NULL : event;
+}
+
+static u64 read_cache_misses(struct perf_event * event)
+{
+	u64 enabled, running;
+	
+	return event ? perf_event_read_value(event, &enabled, &running) : 0;
+}
+
+static u64 read_hot_set(u64 * hot, int size)
+{
+	u64 sum = 0;
+	
+	for(int i = 0; i < size / sizeof(u64); i += L1_CACHE_BYTES / sizeof(u64))
+	{
+		sum += READ_ONCE(hot[i]);
+	}
+	
+	return sum;
+}
+
+/*
+Copies FS_BENCH_COPY_BLOCKS blocks into pool blocks with every available copy implementation
+For every implementation it reports the copy bandwidth and the time and cache misses needed to re-read a cache resident working set afterwards
+A copy which pollutes the last level cache makes the re-read slower
+*/
+static void bench_copy(struct fs_vfs * fs_vfs)
+{
+	int num_blocks = 0;
+	struct fs_block ** blocks = kvmalloc_array(FS_BENCH_COPY_BLOCKS, sizeof(struct fs_block *), GFP_KERNEL);
+	void * src = kvmalloc((size_t)FS_BENCH_COPY_BLOCKS * FS_BLOCK_SIZE, GFP_KERNEL);
+	u64 * hot = kvmalloc(FS_BENCH_HOT_SIZE, GFP_KERNEL);
+	
+	if(!blocks || !src || !hot)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : copy benchmark kvmalloc error\n");
+		goto out;
+	}
+	
+	while(num_blocks < FS_BENCH_COPY_BLOCKS)
+	{
+		blocks[num_blocks] = get_free_block(fs_vfs);
+		if(!blocks[num_blocks])
+			break;
+		num_blocks += 1;
+	}
+	
+	memset(src, 0xa5, (size_t)FS_BENCH_COPY_BLOCKS * FS_BLOCK_SIZE);
+	memset(hot, 0x5a, FS_BENCH_HOT_SIZE);
+	
+	struct perf_event * counter = create_cache_miss_counter();
+	u64 bytes = (u64)num_blocks * FS_BLOCK_SIZE * FS_BENCH_COPY_REPS;
+	
+	for(int impl = 0; impl < FS_COPY_NUM_IMPL; impl++)
+	{
+		if(!copy_impl_available(impl))
+			continue;
+		
+		read_hot_set(hot, FS_BENCH_HOT_SIZE);
+		
+		u64 start = ktime_get_ns();
+		for(int rep = 0; rep < FS_BENCH_COPY_REPS; rep++)
+		{
+			for(int i = 0; i < num_blocks; i++)
+			{
+				copy_block_data_impl((void *)blocks[i]->block_addr, src + (size_t)i * FS_BLOCK_SIZE, FS_BLOCK_SIZE, impl);
+			}
+		}
+		u64 copy_ns = ktime_get_ns() - start;
+		
+		u64 misses = read_cache_misses(counter);
+		start = ktime_get_ns();
+		read_hot_set(hot, FS_BENCH_HOT_SIZE);
+		u64 reread_ns = ktime_get_ns() - start;
+		misses = read_cache_misses(counter) - misses;
+		
+		printk("FILE_SYSTEM : bench copy %-7s %6llu MB/s, hot set re-read %llu ns, %llu cache misses%s\n", copy_impl_name(impl),
+		       bench_bandwidth(bytes, copy_ns), reread_ns, misses, counter ? "" : " (no counter)");
+		
+		cond_resched();
+	}
+	
+	if(counter)
+		perf_event_release_kernel(counter);
+	
+	for(int i = 0; i < num_blocks; i++)
+	{
+		fs_block_put(fs_vfs, blocks[i]);
+	}
+	
+out:
+	kvfree(hot);
+	kvfree(src);
+	kvfree(blocks);
+}
+
+/*
+Reports the memory footprint of an inode and the latency of logical to disk block lookups
+FS_BENCH_LOOKUP_INODES inodes map the same block at every direct and at the first single indirect entries,
+they are visited in a scattered order so that most lookups start with a cold inode
+*/
+static void bench_inode(struct fs_vfs * fs_vfs)
+{
+	int num_inodes = 0;
+	int num_lookups = 0;
+	struct fs_inode ** inodes = kvmalloc_array(FS_BENCH_LOOKUP_INODES, sizeof(struct fs_inode *), GFP_KERNEL);
+	struct fs_block * block = get_free_block(fs_vfs);
+	
+	if(!inodes || !block)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : inode benchmark allocation error\n");
+		goto out;
+	}
+	
+	printk("FILE_SYSTEM : bench inode size %zu bytes, disk map %zu bytes, slab object %u bytes\n", sizeof(struct fs_inode),
+	       sizeof(struct fs_disk_map), kmem_cache_size(fs_vfs->inode_cache));
+	
+	while(num_inodes < FS_BENCH_LOOKUP_INODES)
+	{
+		struct fs_inode * inode = get_inode(fs_vfs);
+		if(!inode)
+			break;
+		inodes[num_inodes++] = inode;
+		
+		for(int i = 0; i < FS_BENCH_LOOKUP_BLOCKS; i++)
+		{
+			attach_block_to_inode(fs_vfs, inode, block);
+		}
+	}
+	
+	//An odd stride modulo a power of 2 visits every inode once
+	int num_visited = num_inodes ? rounddown_pow_of_two(num_inodes) : 0;
+	u64 sum = 0;
+	u64 start = ktime_get_ns();
+	for(int rep = 0; rep < FS_BENCH_LOOKUP_REPS; rep++)
+	{
+		for(int i = 0; i < num_visited; i++)
+		{
+			struct fs_inode * inode = inodes[(i * 2654435761u) & (num_visited - 1)];
+			
+			mutex_lock(&inode->inode_mutex);
+			for(int j = 0; j < FS_BENCH_LOOKUP_BLOCKS; j++)
+			{
+				sum += inode_block(fs_vfs, inode, j)->block_num;
+			}
+			mutex_unlock(&inode->inode_mutex);
+			num_lookups += FS_BENCH_LOOKUP_BLOCKS;
+		}
+		cond_resched();
+	}
+	u64 lookup_ns = ktime_get_ns() - start;
+	
+	printk("FILE_SYSTEM : bench inode %d locked lookups over %d inodes, %llu ns per lookup (%llu)\n", num_lookups, num_inodes,
+	       num_lookups ? div_u64(lookup_ns, num_lookups) : 0, sum);
+	
+	//The same lookups through the lockless read path, including taking and dropping the block reference
+	start = ktime_get_ns();
+	for(int rep = 0; rep < FS_BENCH_LOOKUP_REPS; rep++)
+	{
+		for(int i = 0; i < num_visited; i++)
+		{
+			struct fs_inode * inode = inodes[(i * 2654435761u) & (num_visited - 1)];
+			
+			for(int j = 0; j < FS_BENCH_LOOKUP_BLOCKS; j++)
+			{
+				struct fs_block * found = get_inode_block(fs_vfs, inode, j);
+				sum += found->block_num;
+				fs_block_unpin(fs_vfs, found);
+			}
+		}
+		cond_resched();
+	}
+	lookup_ns = ktime_get_ns() - start;
+	
+	printk("FILE_SYSTEM : bench inode %d RCU lookups over %d inodes, %llu ns per lookup (%llu)\n", num_lookups, num_inodes,
+	       num_lookups ? div_u64(lookup_ns, num_lookups) : 0, sum);
+	
+	for(int i = 0; i < num_inodes; i++)
+	{
+		trim_inode_disk_map(fs_vfs, inodes[i]);
+		put_inode(fs_vfs, inodes[i]);
+	}
+	
+out:
+	if(block)
+		fs_block_put(fs_vfs, block);
+	kvfree(inodes);
+}
+
+typedef struct bench_writer
+{
+	struct fs_vfs * fs_vfs;
+	struct fs_inode * inode;
+	void * src; //FS_BENCH_RANGE_CHUNK bytes shared by all the writers
+	loff_t pos;
+	size_t len;
+	ssize_t ret;
+	struct completion done;
+	struct task_struct * task;
+}bench_writer_t;
+
+static ssize_t bench_write_chunk(struct bench_writer * writer, loff_t pos)
+{
+	struct kvec kvec = { .iov_base = writer->src, .iov_len = FS_BENCH_RANGE_CHUNK };
+	struct iov_iter iter;
+	
+	iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, FS_BENCH_RANGE_CHUNK);
+	
+	return write_inode_iter(writer->fs_vfs, writer->inode, &pos, &iter);
+}
+
+//Writes [pos, pos + len) FS_BENCH_RANGE_REPS times, then sleeps until bench_range_writers() stops the thread
+static int bench_writer_thread(void * data)
+{
+	struct bench_writer * writer = data;
+	
+	for(int rep = 0; rep < FS_BENCH_RANGE_REPS && !writer->ret; rep++)
+	{
+		for(size_t off = 0; off < writer->len; off += FS_BENCH_RANGE_CHUNK)
+		{
+			ssize_t written = bench_write_chunk(writer, writer->pos + off);
+			if(written != FS_BENCH_RANGE_CHUNK)
+			{
+				writer->ret = written < 0 ? written : -FS_EADDR;
+				break;
+			}
+		}
+		cond_resched();
+	}
+	
+	complete(&writer->done);
+	
+	for(;;)
+	{
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(kthread_should_stop())
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	
+	return 0;
+}
+
+/*
+Runs num_writers concurrent writers over the inode, each one writes len bytes FS_BENCH_RANGE_REPS times
+The writers write disjoint slices of the file when overlap is false, otherwise they all write the first slice
+Returns the elapsed time in ns, 0 on failure
+*/
+static u64 bench_range_writers(struct fs_vfs * fs_vfs, struct fs_inode * inode, void * src, struct bench_writer * writers, int num_writers, size_t len, bool overlap)
+{
+	int num_started = 0;
+	ssize_t ret = 0;
+	
+	for(int i = 0; i < num_writers; i++)
+	{
+		struct bench_writer * writer = &writers[i];
+		
+		writer->fs_vfs = fs_vfs;
+		writer->inode = inode;
+		writer->src = src;
+		writer->pos = overlap ? 0 : (loff_t)i * len;
+		writer->len = len;
+		writer->ret = 0;
+		init_completion(&writer->done);
+		
+		writer->task = kthread_create(bench_writer_thread, writer, "ramfs_bench%d", i);
+		if(IS_ERR(writer->task))
+		{
+			ret = PTR_ERR(writer->task);
+			break;
+		}
+		num_started += 1;
+	}
+	
+	u64 start = ktime_get_ns();
+	if(!ret)
+	{
+		for(int i = 0; i < num_started; i++)
+		{
+			wake_up_process(writers[i].task);
+		}
+		
+		for(int i = 0; i < num_started; i++)
+		{
+			wait_for_completion(&writers[i].done);
+			if(writers[i].ret)
+				ret = writers[i].ret;
+		}
+	}
+	u64 elapsed_ns = ktime_get_ns() - start;
+	
+	//A thread which was never woken up exits without running bench_writer_thread()
+	for(int i = 0; i < num_started; i++)
+	{
+		kthread_stop(writers[i].task);
+	}
+	
+	return ret ? 0 : elapsed_ns;
+}
+
+/*
+Reports the write bandwidth of 1 to FS_BENCH_RANGE_MAX_WRITERS concurrent writers of a FS_BENCH_RANGE_BLOCKS blocks file
+Writers of disjoint slices only share the inode mutex for the disk map updates and should scale with the number of writers,
+writers of the same slice are serialised by the range lock and give the baseline
+*/
+static void bench_range(struct fs_vfs * fs_vfs)
+{
+	size_t file_size = (size_t)FS_BENCH_RANGE_BLOCKS * FS_BLOCK_SIZE;
+	int max_writers = min_t(int, FS_BENCH_RANGE_MAX_WRITERS, num_online_cpus());
+	struct bench_writer * writers = kcalloc(FS_BENCH_RANGE_MAX_WRITERS, sizeof(struct bench_writer), GFP_KERNEL);
+	void * src = kvmalloc(FS_BENCH_RANGE_CHUNK, GFP_KERNEL);
+	struct fs_inode * inode = get_inode(fs_vfs);
+	
+	if(!writers || !src || !inode)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : range lock benchmark allocation error\n");
+		goto out;
+	}
+	
+	memset(src, 0xa5, FS_BENCH_RANGE_CHUNK);
+	
+	//Allocates the whole file first, the measured writes only overwrite blocks
+	if(!bench_range_writers(fs_vfs, inode, src, writers, 1, file_size, false))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : range lock benchmark could not allocate %d blocks\n", FS_BENCH_RANGE_BLOCKS);
+		goto out;
+	}
+	
+	u64 base_bandwidth = 0;
+	u64 bytes = (u64)file_size * FS_BENCH_RANGE_REPS;
+	
+	for(int num_writers = 1; num_writers <= max_writers; num_writers *= 2)
+	{
+		size_t len = file_size / num_writers;
+		
+		u64 disjoint_ns = bench_range_writers(fs_vfs, inode, src, writers, num_writers, len, false);
+		u64 overlap_ns = bench_range_writers(fs_vfs, inode, src, writers, num_writers, len, true);
+		if(!disjoint_ns || !overlap_ns)
+		{
+			printk(KERN_ERR "FILE_SYSTEM_ERROR : range lock benchmark write error\n");
+			break;
+		}
+		
+		u64 bandwidth = bench_bandwidth(bytes, disjoint_ns);
+		if(num_writers == 1)
+			base_bandwidth = bandwidth;
+		
+		printk("FILE_SYSTEM : bench range %d writers, disjoint %6llu MB/s (x%llu.%02llu), same range %6llu MB/s\n", num_writers,
+		       bandwidth, base_bandwidth ? div64_u64(bandwidth, base_bandwidth) : 0,
+		       base_bandwidth ? div64_u64(bandwidth * 100, base_bandwidth) % 100 : 0, bench_bandwidth(bytes, overlap_ns));
+	}
+	
+out:
+	if(inode)
+	{
+		trim_inode_disk_map(fs_vfs, inode);
+		put_inode(fs_vfs, inode);
+	}
+	kvfree(src);
+	kfree(writers);
+}
+
+void run_benchmarks(struct fs_vfs * fs_vfs, int benchmarks)
+{
+	printk("FILE_SYSTEM : Running benchmarks:%x\n", benchmarks);
+	
+	if(benchmarks & FS_BENCH_COPY)
+		bench_copy(fs_vfs);
+	
+	if(benchmarks & FS_BENCH_INODE)
+		bench_inode(fs_vfs);
+	
+	if(benchmarks & FS_BENCH_RANGE)
+		bench_range(fs_vfs);
+}
@@ -1,26 +1,102 @@
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/smp.h>
+
 #include "../include/fs_block.h"
+#include "../include/fs_dedup.h"
+#include "../include/fs_pool.h"
+#include "../include/fs_copy.h"
+#include "../include/fs_zero.h"
+#include "../include/fs_dax.h"
+#include "../include/fs_reclaim.h"
+
+static void push_free_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct fs_block * block);
 
 /*
-Initialises superblock
-Initialises all the superblock parameters see /include/fs_block.h to get to know about superblock parameters
+Initialises the allocation groups
+The pool is split into fs_vfs->num_groups groups of contiguous blocks, the last group also takes the remaining blocks
+Every group has its own super block chain, free count and lock, see /include/fs_block.h
 */
-void initialise_super_block(struct fs_vfs * fs_vfs)
+int initialise_alloc_groups(struct fs_vfs * fs_vfs)
 {
-	fs_vfs->super_block = kmalloc(sizeof(struct fs_superblock), GFP_KERNEL);
+	int num_groups = clamp(fs_vfs->num_groups, 1, fs_vfs->total_num_disk_blocks / 100);
 	
-	for(int i = 0; i < 100; i++)
+	fs_vfs->groups = kcalloc(num_groups, sizeof(struct fs_superblock), GFP_KERNEL);
+	if(!fs_vfs->groups)
+		return -FS_EMALLOC;
+	
+	if(percpu_counter_init(&fs_vfs->num_free_disk_blocks, 0, GFP_KERNEL))
+	{
+		kfree(fs_vfs->groups);
+		fs_vfs->groups = NULL;
+		return -FS_EMALLOC;
+	}
+	
+	if(percpu_counter_init(&fs_vfs->unreserved_disk_blocks, 0, GFP_KERNEL))
 	{
-		fs_vfs->super_block->blocks[i] = NULL;
+		percpu_counter_destroy(&fs_vfs->num_free_disk_blocks);
+		kfree(fs_vfs->groups);
+		fs_vfs->groups = NULL;
+		return -FS_EMALLOC;
 	}
 	
-	fs_vfs->super_block->fs_block_ind = 0;
+	fs_vfs->num_groups = num_groups;
+	fs_vfs->blocks_per_group = fs_vfs->total_num_disk_blocks / num_groups;
 	
-	mutex_init(&fs_vfs->super_block->superblock_mutex);
+	for(int g = 0; g < num_groups; g++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[g];
+		
+		for(int i = 0; i < 100; i++)
+		{
+			group->blocks[i] = NULL;
+		}
+		
+		//An empty chain, the first pushed block goes to entry 99
+		group->fs_block_ind = 100;
+		
+		group->group_num = g;
+		group->first_block = g * fs_vfs->blocks_per_group;
+		group->num_blocks = (g == num_groups - 1) ? fs_vfs->total_num_disk_blocks - group->first_block : fs_vfs->blocks_per_group;
+		group->num_free_disk_blocks = 0;
+		
+		group->free_map = bitmap_zalloc(group->num_blocks, GFP_KERNEL);
+		if(!group->free_map)
+		{
+			destroy_alloc_groups(fs_vfs);
+			return -FS_EMALLOC;
+		}
+		
+		INIT_LIST_HEAD(&group->free_disk_block_list);
+		INIT_LIST_HEAD(&group->super_block_disk_list);
+		INIT_LIST_HEAD(&group->allocated_disk_block_list);
+		
+		INIT_LIST_HEAD(&group->zero_pending_list);
+		group->num_zero_pending = 0;
+		INIT_LIST_HEAD(&group->zeroed_disk_block_list);
+		group->num_zeroed_blocks = 0;
+		
+		mutex_init(&group->superblock_mutex);
+	}
+	
+	return 0;
 }
 
-inline void deallocate_super_block(struct fs_vfs * fs_vfs)
+void destroy_alloc_groups(struct fs_vfs * fs_vfs)
 {
-	kfree(fs_vfs->super_block);
+	//The counters are only initialised once the groups are allocated
+	if(!fs_vfs->groups)
+		return;
+	
+	for(int g = 0; g < fs_vfs->num_groups; g++)
+	{
+		bitmap_free(fs_vfs->groups[g].free_map);
+	}
+	
+	percpu_counter_destroy(&fs_vfs->unreserved_disk_blocks);
+	percpu_counter_destroy(&fs_vfs->num_free_disk_blocks);
+	kfree(fs_vfs->groups);
+	fs_vfs->groups = NULL;
 }
 
 /*
@@ -30,23 +106,24 @@ struct fs_block * block :- destination disk block to which the data will be writ
 int offset :- Position from the start of the disk block from which the write starts
 void * src :- src memory
 int size :- size of the data that will be written
+int copy_mode :- FS_COPY_CACHED or FS_COPY_NONTEMPORAL (see fs/fs_copy.c)
 */
-int write_to_block(struct fs_block * block, int offset, void * src, int size)
+int copy_to_block(struct fs_block * block, int offset, void * src, int size, int copy_mode)
 {
 	if(offset < 0 || offset > FS_BLOCK_SIZE || block == NULL || src == NULL)
 	{
 		if(offset < 0)
 			printk(KERN_ERR "FILE_SYSTEM_ERROR : offset < 0\n");
-			
+		
 		if(offset > FS_BLOCK_SIZE)
 			printk(KERN_ERR "FILE_SYSTEM_ERROR : offset > FS_BLOCK_SIZE\n");
-			
+		
 		if(block == NULL)
 			printk(KERN_ERR "FILE_SYSTEM_ERROR : block == NULL\n");
-			
+		
 		if(src == NULL)
 			printk(KERN_ERR "FILE_SYSTEM_ERROR : src == NULL\n");
-			
+		
 		printk(KERN_ERR "FILE_SYSTEM_ERROR : Wrong input parameter in write_to_block()\n");
 		return -FS_EINPUT_PARAMETER;
 	}
@@ -61,30 +138,46 @@ int write_to_block(struct fs_block * block, int offset, void * src, int size)
 	
 	mutex_lock(&block->diskblock_mutex);
 	
-	memcpy(dest_addr, src, size);
+	copy_block_data(dest_addr, src, size, copy_mode);
 	
 	mutex_unlock(&block->diskblock_mutex);
 	
 	return 0;
 }
 
+int write_to_block(struct fs_block * block, int offset, void * src, int size)
+{
+	return copy_to_block(block, offset, src, size, FS_COPY_CACHED);
+}
+
 /*
 Allocates disk block and initialises its parameters
 struct fs_vfs * fs_vfs :- filesystem to which the disk block belongs
-void * memory :- starting address of the disk block
-int flag :- flag indicates whether the disk block belongs to free list or super block list
+int block_num :- position of the disk block in the pool
+int flag :- flag indicates whether the disk block belongs to free list, super block list or is allocated
 */
-struct fs_block * initialise_block(struct fs_vfs * fs_vfs, void * start_memory, int flag)
+struct fs_block * initialise_block(struct fs_vfs * fs_vfs, int block_num, int flag)
 {
 	struct fs_block * block = kmalloc(sizeof(struct fs_block), GFP_KERNEL);
-	block->block_addr = (uintptr_t)start_memory;
+	block->block_addr = (uintptr_t)pool_block_addr(fs_vfs, block_num);
+	block->block_num = block_num;
+	fs_vfs->block_table[block->block_num] = block;
+	atomic64_set(&block->ref_count, 0);
+	INIT_HLIST_NODE(&block->dedup_node);
 	mutex_init(&block->diskblock_mutex);
+	
+	struct fs_superblock * group = block_group(fs_vfs, block_num);
+	
 	switch(flag)
 	{
-		case FS_DISK_BLOCK_SUPER_BLOCK: list_add_tail(&block->fs_vfs_list, &fs_vfs->super_block_disk_list);
+		case FS_DISK_BLOCK_SUPER_BLOCK: list_add_tail(&block->fs_vfs_list, &group->super_block_disk_list);
 						break;
 		
-		case FS_DISK_BLOCK_FREE_LIST:   list_add_tail(&block->fs_vfs_list, &fs_vfs->free_disk_block_list);
+		case FS_DISK_BLOCK_FREE_LIST:   list_add_tail(&block->fs_vfs_list, &group->free_disk_block_list);
+						break;
+		
+		case FS_DISK_BLOCK_ALLOCATED:   list_add_tail(&block->fs_vfs_list, &group->allocated_disk_block_list);
+						atomic64_set(&block->ref_count, 1);
 						break;
 		default:			printk(KERN_ERR "FILE_SYSTEM : Wrong switch case in initialise_block()\n");
 	}
@@ -98,192 +191,414 @@ inline void destroy_block(struct fs_vfs * fs_vfs, struct fs_block * block)
 }
 
 /*
-Initialises disk blocks
+Initialises disk blocks, the pool has to be allocated by allocate_pool()
+The free blocks of every allocation group are chained through super blocks, every super block stores the numbers of 100 free blocks and the last of them is the next super block
+The blocks are pushed in descending order so that they are handed out in ascending order
 */
-void initialise_disk_blocks(struct fs_vfs * fs_vfs, void * start_memory)
+int initialise_disk_blocks(struct fs_vfs * fs_vfs)
 {
-	initialise_super_block(fs_vfs);
-	
-	int num_disk_block = FILE_SYSTEM_SIZE/FS_BLOCK_SIZE;
-	int block_count = 0, super_block_count = 0;
+	int num_disk_block = fs_vfs->total_num_disk_blocks;
 	
-	int num_super_block = (num_disk_block / 100) - 1;
+	fs_vfs->block_table = kvcalloc(num_disk_block, sizeof(struct fs_block *), GFP_KERNEL);
+	fs_vfs->dirty_bitmap = bitmap_zalloc(num_disk_block, GFP_KERNEL);
+	if(!fs_vfs->block_table || !fs_vfs->dirty_bitmap)
+	{
+		printk(KERN_ERR "Error allocating block table memory\n");
+		return -FS_EMALLOC;
+	}
 	
-	num_disk_block -= num_super_block;
+	int ret = initialise_alloc_groups(fs_vfs);
+	if(ret)
+	{
+		printk(KERN_ERR "Error allocating allocation groups\n");
+		return ret;
+	}
 	
-	struct fs_block * block, * prev_block = NULL;
+	printk("FILE_SYSTEM : Initialising disk blocks\n");
 	
-	bool first_super_block_flag = true;
+	for(int g = 0; g < fs_vfs->num_groups; g++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[g];
+		
+		mutex_lock(&group->superblock_mutex);
+		for(int i = group->first_block + group->num_blocks - 1; i >= group->first_block; i--)
+		{
+			//Blocks mapped by a file on the DAX device are handed back to their inode by recover_dax_inodes()
+			if(dax_block_mapped(fs_vfs, i))
+				initialise_block(fs_vfs, i, FS_DISK_BLOCK_ALLOCATED);
+			else
+				push_free_block(fs_vfs, group, initialise_block(fs_vfs, i, FS_DISK_BLOCK_FREE_LIST));
+		}
+		percpu_counter_add(&fs_vfs->unreserved_disk_blocks, group->num_free_disk_blocks);
+		mutex_unlock(&group->superblock_mutex);
+	}
 	
-	printk("FILE_SYSTEM : Initialising disk blocks\n");
+	printk("FILE_SYSTEM : Initialised %d disk blocks\n", num_disk_block);
+	printk("FILE_SYSTEM : Initialised %d allocation groups of %d disk blocks\n", fs_vfs->num_groups, fs_vfs->blocks_per_group);
 	
-	while(super_block_count < num_super_block)
+	return 0;
+}
+
+/*
+Frees the disk blocks, the block table and the allocation groups set up by initialise_disk_blocks(), also after it failed half way
+The pool memory itself is freed by destroy_pool()
+*/
+void destroy_disk_blocks(struct fs_vfs * fs_vfs)
+{
+	if(fs_vfs->block_table)
 	{
-		uintptr_t *block_address = kmalloc(100*sizeof(uintptr_t), GFP_KERNEL);
-		if(!block_address)
+		for(int i = 0; i < fs_vfs->total_num_disk_blocks; i++)
 		{
-			printk(KERN_ERR "Error allocating block address memory\n");
-			return;
+			if(fs_vfs->block_table[i])
+				destroy_block(fs_vfs, fs_vfs->block_table[i]);
 		}
-		
-		int num_blocks = 99;
-		if(first_super_block_flag)
+	}
+	
+	kvfree(fs_vfs->block_table);
+	fs_vfs->block_table = NULL;
+	bitmap_free(fs_vfs->dirty_bitmap);
+	fs_vfs->dirty_bitmap = NULL;
+	
+	destroy_alloc_groups(fs_vfs);
+}
+
+/*
+Given a memory address this function returns the disk block containing the memory address or NULL if the address is outside the pool
+*/
+struct fs_block * mem_to_disk_block(struct fs_vfs * fs_vfs, void * mem_addr)
+{
+	return num_to_disk_block(fs_vfs, pool_addr_to_block_num(fs_vfs, mem_addr));
+}
+
+/*
+Removes the next free block from the super block chain of the group and moves it to the dest list
+When the goal block is in the in-core super block it is handed out instead of the next free block
+Note :- This function has to be called while holding the superblock mutex of the group
+*/
+static struct fs_block * pop_free_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest, int goal)
+{
+	if(group->num_free_disk_blocks == 0)
+		return NULL;
+	
+	//Entry 99 is the next super block, it can only be handed out after it has been reloaded
+	if(goal >= 0)
+	{
+		for(int i = group->fs_block_ind; i < 99; i++)
 		{
-			num_blocks = 100;
-			first_super_block_flag = false;
+			if(group->blocks[i]->block_num == goal)
+			{
+				swap(group->blocks[i], group->blocks[group->fs_block_ind]);
+				atomic64_inc(&fs_vfs->alloc_goal_hits);
+				break;
+			}
 		}
+	}
+	
+	struct fs_block * block = group->blocks[group->fs_block_ind];
+	
+	//The last entry is the next super block unless it is the last free block
+	if(group->fs_block_ind == 99 && group->num_free_disk_blocks > 1)
+	{
+		uintptr_t * block_nums = (uintptr_t *)block->block_addr;
 		
-		for(int i = 0; i < num_blocks; i++)
+		for(int i = 0; i < 100; i++)
 		{
-			block = initialise_block(fs_vfs, start_memory + block_count*FS_BLOCK_SIZE, FS_DISK_BLOCK_FREE_LIST);
-			block_address[i] = block->block_addr;
-			if(block_address[i] != block->block_addr)
-				printk("FILE_SYSTEM : Block addr:%lx, %lx\n", block_address[i], block->block_addr);
-			block_count += 1;
+			group->blocks[i] = num_to_disk_block(fs_vfs, block_nums[i]);
+			if(!group->blocks[i])
+			{
+				printk(KERN_ERR "FILE_SYSTEM_ERROR : Copying diskblocks into super block:%lu\n", block_nums[i]);
+				return NULL;
+			}
 		}
-		
-		block = initialise_block(fs_vfs, start_memory + block_count*FS_BLOCK_SIZE, FS_DISK_BLOCK_SUPER_BLOCK);
-		block_count += 1;
-		if(num_blocks == 99)
+		group->fs_block_ind = 0;
+	}
+	else
+	{
+		group->blocks[group->fs_block_ind] = NULL;
+		group->fs_block_ind += 1;
+	}
+	
+	list_move(&block->fs_vfs_list, dest);
+	__clear_bit(block->block_num - group->first_block, group->free_map);
+	group->num_free_disk_blocks -= 1;
+	percpu_counter_dec(&fs_vfs->num_free_disk_blocks);
+	
+	return block;
+}
+
+/*
+Pushes the block on the super block chain of the group, it is the next block handed out by pop_free_block()
+Note :- This function has to be called while holding the superblock mutex of the group
+*/
+static void push_free_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct fs_block * block)
+{
+	if(group->fs_block_ind == 0)
+	{
+		uintptr_t *block_address = kmalloc(100*sizeof(uintptr_t), GFP_KERNEL);
+		for(int i = 0; i < 100; i++)
 		{
-			block_address[99] = prev_block->block_addr;
+			block_address[i] = group->blocks[i]->block_num;
+			group->blocks[i] = NULL;
 		}
-		write_to_block(block, 0, block_address, 100*sizeof(uintptr_t));
+		write_to_block(block, 0, (void *)block_address, 100*sizeof(uintptr_t));
 		kfree(block_address);
-		super_block_count += 1;
-		prev_block = block;
+		group->blocks[99] = block;
+		group->fs_block_ind = 99;
+		list_move(&block->fs_vfs_list, &group->super_block_disk_list);
+	}
+	else
+	{
+		group->fs_block_ind -= 1;
+		group->blocks[group->fs_block_ind] = block;
+		list_move(&block->fs_vfs_list, &group->free_disk_block_list);
 	}
 	
-	for(int i = 0; i < 99; i++)
+	__set_bit(block->block_num - group->first_block, group->free_map);
+	group->num_free_disk_blocks += 1;
+	percpu_counter_inc(&fs_vfs->num_free_disk_blocks);
+}
+
+/*
+Removes the next free block from the super block chain of the group and moves it to the dest list
+Parameters:-
+int goal :- block number to hand out if it is free and close at hand, -1 for no preference
+bool nonblock :- return NULL instead of waiting for the superblock mutex (used under memory reclaim)
+*/
+struct fs_block * take_free_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest, int goal, bool nonblock)
+{
+	if(nonblock)
+	{
+		if(!mutex_trylock(&group->superblock_mutex))
+			return NULL;
+	}
+	else
 	{
-		block = initialise_block(fs_vfs, start_memory + block_count*FS_BLOCK_SIZE, FS_DISK_BLOCK_FREE_LIST);
-		block_count += 1;
-		mutex_lock(&fs_vfs->super_block->superblock_mutex);
-		fs_vfs->super_block->blocks[i] = block;
-		mutex_unlock(&fs_vfs->super_block->superblock_mutex);
+		mutex_lock(&group->superblock_mutex);
 	}
-	mutex_lock(&fs_vfs->super_block->superblock_mutex);
-	fs_vfs->super_block->blocks[99] = prev_block;
-	mutex_unlock(&fs_vfs->super_block->superblock_mutex);
 	
-	printk("FILE_SYSTEM : Initialised %d disk blocks\n", FILE_SYSTEM_SIZE/FS_BLOCK_SIZE);
-	printk("FILE_SYSTEM : Initialised %d super_block disk blocks\n", num_super_block);
-	printk("FILE_SYSTEM : Initialised %d free disk blocks\n", block_count);
+	struct fs_block * block = pop_free_block(fs_vfs, group, dest, goal);
+	
+	mutex_unlock(&group->superblock_mutex);
+	
+	return block;
 }
 
 /*
-Given a memory address this function returns the disk block corresponding to the memory address only if the block is free else returns NULL
+Removes a block from the zeroed pool of the group and moves it to the dest list
+Note :- This function has to be called while holding the superblock mutex of the group
+*/
+static struct fs_block * pop_zeroed_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest)
+{
+	struct fs_block * block = list_first_entry_or_null(&group->zeroed_disk_block_list, struct fs_block, fs_vfs_list);
+	if(!block)
+		return NULL;
+	
+	list_move(&block->fs_vfs_list, dest);
+	group->num_zeroed_blocks -= 1;
+	percpu_counter_dec(&fs_vfs->num_free_disk_blocks);
+	
+	return block;
+}
 
-Note :- This function has to be called while holding the super block mutex struct (i.e., fs_superblock.superblock_mutex)
+/*
+Removes a block waiting for the zeroing worker from the group and moves it to the dest list, the block is not cleared
+Note :- This function has to be called while holding the superblock mutex of the group
 */
-struct fs_block * mem_to_disk_block(struct fs_vfs * fs_vfs, void * mem_addr)
+static struct fs_block * pop_pending_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest)
 {
-	uintptr_t mem = (uintptr_t)mem_addr;
+	struct fs_block * block = list_first_entry_or_null(&group->zero_pending_list, struct fs_block, fs_vfs_list);
+	if(!block)
+		return NULL;
 	
-	struct fs_block * block;
+	list_move(&block->fs_vfs_list, dest);
+	group->num_zero_pending -= 1;
+	percpu_counter_dec(&fs_vfs->num_free_disk_blocks);
 	
-	list_for_each_entry(block, &fs_vfs->super_block_disk_list, fs_vfs_list)
+	return block;
+}
+
+/*
+Removes a pending block, else a zeroed block, from the zero pool of the group and moves it to the dest list
+Used by the pool shrinker once the free chain of the group is empty, the blocks of the zero pool are free blocks as well
+bool nonblock :- return NULL instead of waiting for the superblock mutex (used under memory reclaim)
+*/
+struct fs_block * take_zero_pool_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest, bool nonblock)
+{
+	if(nonblock)
 	{
-		if((block->block_addr <= mem) && (mem < (block->block_addr + FS_BLOCK_SIZE)))
-		{
-			return block;
-		}
+		if(!mutex_trylock(&group->superblock_mutex))
+			return NULL;
 	}
+	else
+	{
+		mutex_lock(&group->superblock_mutex);
+	}
+	
+	struct fs_block * block = pop_pending_block(fs_vfs, group, dest);
+	if(!block)
+		block = pop_zeroed_block(fs_vfs, group, dest);
+	
+	mutex_unlock(&group->superblock_mutex);
 	
-	list_for_each_entry(block, &fs_vfs->allocated_disk_block_list, fs_vfs_list)
+	return block;
+}
+
+/*
+Takes nr_blocks off fs_vfs->unreserved_disk_blocks, fails if fewer than floor unreserved free blocks would be left
+Every allocation which is not covered by a reservation and every reservation claims its blocks here before it touches the free lists,
+the counter is decremented before it is checked so that two concurrent claims can never both take the last free blocks
+*/
+bool claim_free_blocks(struct fs_vfs * fs_vfs, s64 nr_blocks, s64 floor)
+{
+	percpu_counter_sub(&fs_vfs->unreserved_disk_blocks, nr_blocks);
+	
+	if(percpu_counter_compare(&fs_vfs->unreserved_disk_blocks, floor) >= 0)
+		return true;
+	
+	percpu_counter_add(&fs_vfs->unreserved_disk_blocks, nr_blocks);
+	return false;
+}
+
+/*
+Removes a free block from the group and moves it to the allocated list of the group
+bool zeroed :- the zeroed pool is tried before the free chain, else the zeroed pool is only used when the free chain is empty
+The blocks still waiting for the zeroing worker are used last, they are not cleared
+Note :- This function has to be called while holding the superblock mutex of the group
+*/
+static struct fs_block * pop_group_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, int goal, bool zeroed, bool * from_zeroed)
+{
+	struct fs_block * block = NULL;
+	
+	if(zeroed)
+		block = pop_zeroed_block(fs_vfs, group, &group->allocated_disk_block_list);
+	
+	*from_zeroed = (block != NULL);
+	
+	if(!block)
+		block = pop_free_block(fs_vfs, group, &group->allocated_disk_block_list, goal);
+	
+	if(!block && !zeroed)
 	{
-		if((block->block_addr <= mem) && (mem < (block->block_addr + FS_BLOCK_SIZE)))
-		{
-			return block;
-		}
+		block = pop_zeroed_block(fs_vfs, group, &group->allocated_disk_block_list);
+		*from_zeroed = (block != NULL);
 	}
 	
-	list_for_each_entry(block, &fs_vfs->free_disk_block_list, fs_vfs_list)
+	if(!block)
+		block = pop_pending_block(fs_vfs, group, &group->allocated_disk_block_list);
+	
+	return block;
+}
+
+/*
+Returns a block from the group of the goal block, the given group or the group of the current cpu, in that order, falling back to the other groups
+bool zeroed :- see pop_group_block()
+The block is claimed first (see claim_free_blocks()) so that the free blocks reserved for buffered appends are never handed out here
+When no unreserved block is left the disk maps waiting for the reclaim worker are dropped here and the claim is tried again (see fs/fs_reclaim.c)
+*/
+static struct fs_block * alloc_block(struct fs_vfs * fs_vfs, int group_num, int goal, bool zeroed, bool * from_zeroed)
+{
+	struct fs_block * block = NULL;
+	
+	if(percpu_counter_read_positive(&fs_vfs->unreserved_disk_blocks) < fs_vfs->pool_low_watermark && fs_vfs->num_released_disk_blocks)
+		repopulate_pool(fs_vfs, FS_POOL_REFILL_BLOCKS);
+	
+	if(goal >= 0 && goal < fs_vfs->total_num_disk_blocks)
+		group_num = block_group(fs_vfs, goal)->group_num;
+	else if(group_num < 0)
+		group_num = raw_smp_processor_id() % fs_vfs->num_groups;
+	
+	*from_zeroed = false;
+	
+	while(!claim_free_blocks(fs_vfs, 1, 0))
 	{
-		if((block->block_addr <= mem) && (mem < (block->block_addr + FS_BLOCK_SIZE)))
+		if(!reclaim_pending_blocks(fs_vfs))
 		{
-			return block;
+			printk(KERN_ERR "FILE_SYSTEM_ERROR : No free blocks available\n");
+			return NULL;
 		}
 	}
 	
-	return NULL;
+	for(int i = 0; i < fs_vfs->num_groups && !block; i++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[(group_num + i) % fs_vfs->num_groups];
+		
+		if(READ_ONCE(group->num_free_disk_blocks) == 0 && READ_ONCE(group->num_zeroed_blocks) == 0 && READ_ONCE(group->num_zero_pending) == 0)
+			continue;
+		
+		mutex_lock(&group->superblock_mutex);
+		block = pop_group_block(fs_vfs, group, (i == 0) ? goal : -1, zeroed, from_zeroed);
+		mutex_unlock(&group->superblock_mutex);
+	}
+	
+	//Only the block the zeroing worker is clearing right now is out of reach of a claim
+	if(!block)
+	{
+		percpu_counter_inc(&fs_vfs->unreserved_disk_blocks);
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : No free blocks available\n");
+		return NULL;
+	}
+	
+	atomic64_set(&block->ref_count, 1);
+	
+	return block;
 }
 
 /*
 This function returns a free block if its available else returns NULL
-Note : This function uses superblock and struct fs_vfs mutexes
+Parameters:-
+int group_num :- allocation group tried first, -1 for the group of the current cpu
+int goal :- block number preferred so that consecutive logical blocks of a file stay physically contiguous, -1 for no preference
+The group of the goal block is tried first, the other groups are only tried when it has no free blocks
+Memory released to the kernel by the pool shrinker is taken back when the number of free blocks drops below the low watermark
+Note : This function uses the superblock mutexes of the groups
 */
+struct fs_block * get_free_block_near(struct fs_vfs * fs_vfs, int group_num, int goal)
+{
+	bool from_zeroed;
+	
+	return alloc_block(fs_vfs, group_num, goal, false, &from_zeroed);
+}
+
 struct fs_block * get_free_block(struct fs_vfs * fs_vfs)
 {
-	if(fs_vfs->num_free_disk_blocks == 0)
-	{
-		printk(KERN_ERR "FILE_SYSTEM_ERROR : No free blocks available\n");
+	return get_free_block_near(fs_vfs, -1, -1);
+}
+
+/*
+Same as get_free_block_near() but the returned block is filled with zeros
+The zeroed pool of the group is used first, the goal is only honoured when the block has to be cleared here
+*/
+struct fs_block * get_zeroed_block(struct fs_vfs * fs_vfs, int group_num, int goal)
+{
+	bool from_zeroed;
+	
+	struct fs_block * block = alloc_block(fs_vfs, group_num, goal, true, &from_zeroed);
+	if(!block)
 		return NULL;
-	}
-	else if(fs_vfs->num_free_disk_blocks == 1)
+	
+	if(from_zeroed)
 	{
-		struct fs_superblock * superblock = fs_vfs->super_block;
-		struct fs_block * block;
-		mutex_lock(&superblock->superblock_mutex);
-		block = superblock->blocks[superblock->fs_block_ind];
-		superblock->blocks[superblock->fs_block_ind] = NULL;
-		superblock->fs_block_ind += 1;
-		mutex_unlock(&superblock->superblock_mutex);
-		
-		mutex_lock(&fs_vfs->vfs_lock);
-		list_del(&block->fs_vfs_list);
-		list_add(&block->fs_vfs_list, &fs_vfs->allocated_disk_block_list);
-		fs_vfs->num_free_disk_blocks -= 1;
-		mutex_unlock(&fs_vfs->vfs_lock);
-		
-		return block;
+		atomic64_inc(&fs_vfs->zero_pool_hits);
 	}
 	else
 	{
-		struct fs_superblock * superblock = fs_vfs->super_block;
-		struct fs_block * block;
-		
-		mutex_lock(&superblock->superblock_mutex);
-		block = superblock->blocks[superblock->fs_block_ind];
-		
-		if(superblock->fs_block_ind == 99)
-		{
-			uintptr_t * addr = (uintptr_t *)block->block_addr;
-			
-			//printk("FILE_SYSTEM : Copying diskblocks into super block\n");
-			for(int i = 0; i < 100; i++)
-			{
-				//printk("FILE_SYSTEM : Copying diskblocks into super block Addr:%lx, %d\n", addr[i], i);
-				superblock->blocks[i] = mem_to_disk_block(fs_vfs, (void *)addr[i]);
-				if(!superblock->blocks[i])
-				{
-					mutex_unlock(&superblock->superblock_mutex);
-					printk(KERN_ERR "FILE_SYSTEM_ERROR : Copying diskblocks into super block:%lx\n", addr[i]);
-					return NULL;
-				}
-			}
-			superblock->fs_block_ind = 0;
-		}
-		else
-		{
-			superblock->blocks[superblock->fs_block_ind] = NULL;
-			superblock->fs_block_ind += 1;
-		}
-		
-		mutex_unlock(&superblock->superblock_mutex);
-		
-		mutex_lock(&fs_vfs->vfs_lock);
-		list_del(&block->fs_vfs_list);
-		list_add(&block->fs_vfs_list, &fs_vfs->allocated_disk_block_list);
-		fs_vfs->num_free_disk_blocks -= 1;
-		mutex_unlock(&fs_vfs->vfs_lock);
-		
-		return block;
+		clear_page((void *)block->block_addr);
+		dax_persist(fs_vfs, (void *)block->block_addr, FS_BLOCK_SIZE);
+		atomic64_inc(&fs_vfs->zero_pool_misses);
 	}
 	
+	//Refill the zeroed pool once it drops to half of its target
+	struct fs_superblock * group = block_group(fs_vfs, block->block_num);
+	if(READ_ONCE(fs_vfs->zero_worker) && READ_ONCE(group->num_zeroed_blocks) < fs_vfs->zero_pool_target / 2)
+		queue_zeroing(fs_vfs);
+	
+	return block;
 }
 
-
+/*
+Returns the block to the free chain of its allocation group, the block can be claimed again by any allocation or reservation
+While pre-zeroing is enabled and the zeroed pool of the group is below its target the block is queued for the zeroing worker instead
+*/
 void put_free_block(struct fs_vfs * fs_vfs, struct fs_block * block)
 {
 	if(!block)
@@ -297,43 +612,305 @@ void put_free_block(struct fs_vfs * fs_vfs, struct fs_block * block)
 		printk(KERN_ERR "FILE_SYSTEM_ERROR : fs_vfs is NULL in put_free_block()\n");
 		return;
 	}
-	struct fs_superblock * superblock = fs_vfs->super_block;
+	struct fs_superblock * group = block_group(fs_vfs, block->block_num);
+	bool queued = false;
+	
+	mutex_lock(&group->superblock_mutex);
+	if(READ_ONCE(fs_vfs->zero_worker) && group->num_zeroed_blocks + group->num_zero_pending < fs_vfs->zero_pool_target)
+	{
+		list_move_tail(&block->fs_vfs_list, &group->zero_pending_list);
+		group->num_zero_pending += 1;
+		percpu_counter_inc(&fs_vfs->num_free_disk_blocks);
+		queued = true;
+	}
+	else
+	{
+		push_free_block(fs_vfs, group, block);
+	}
+	mutex_unlock(&group->superblock_mutex);
 	
-	mutex_lock(&superblock->superblock_mutex);
+	percpu_counter_inc(&fs_vfs->unreserved_disk_blocks);
 	
-	if(superblock->fs_block_ind == 0)
+	if(queued)
+		queue_zeroing(fs_vfs);
+}
+
+/*
+Rebuilds the super block chain of the group so that its free blocks are handed out in ascending block order
+The blocks are pushed back in descending order of group->free_map, the run [first, first + nr_first) is pushed last so that it is handed out first
+Note :- This function has to be called while holding the superblock mutex of the group
+*/
+static void rebuild_free_chain_locked(struct fs_vfs * fs_vfs, struct fs_superblock * group, int first, int nr_first)
+{
+	int num_blocks = group->num_free_disk_blocks;
+	
+	//free_map is left as it is, pushing the blocks sets their bits again
+	for(int i = 0; i < 100; i++)
+		group->blocks[i] = NULL;
+	group->fs_block_ind = 100;
+	group->num_free_disk_blocks = 0;
+	percpu_counter_sub(&fs_vfs->num_free_disk_blocks, num_blocks);
+	
+	for(int i = group->num_blocks - 1; i >= 0; i--)
 	{
-		uintptr_t *block_address = kmalloc(100*sizeof(uintptr_t), GFP_KERNEL);
-		for(int i = 0; i < 100; i++)
+		int block_num = group->first_block + i;
+		
+		if(test_bit(i, group->free_map) && (block_num < first || block_num >= first + nr_first))
+			push_free_block(fs_vfs, group, fs_vfs->block_table[block_num]);
+	}
+	
+	for(int i = first + nr_first - 1; i >= first && nr_first > 0; i--)
+		push_free_block(fs_vfs, group, fs_vfs->block_table[i]);
+}
+
+/*
+Sorts the free blocks of every group so that blocks allocated one after the other are physically contiguous
+*/
+void rebuild_free_chain(struct fs_vfs * fs_vfs)
+{
+	for(int g = 0; g < fs_vfs->num_groups; g++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[g];
+		
+		mutex_lock(&group->superblock_mutex);
+		rebuild_free_chain_locked(fs_vfs, group, 0, 0);
+		mutex_unlock(&group->superblock_mutex);
+	}
+}
+
+/*
+Looks for nr_blocks physically contiguous free blocks in the group and allocates them into blocks[], in block order
+The run is found in group->free_map, the super block chain is only rebuilt when the group has one
+Note :- This function has to be called while holding the superblock mutex of the group
+*/
+static int get_free_run_locked(struct fs_vfs * fs_vfs, struct fs_superblock * group, int nr_blocks, struct fs_block ** blocks)
+{
+	if(nr_blocks > group->num_free_disk_blocks)
+		return -FS_ENO_FREE_BLOCK;
+	
+	unsigned long first = find_next_bit(group->free_map, group->num_blocks, 0);
+	while(first < group->num_blocks)
+	{
+		unsigned long end = find_next_zero_bit(group->free_map, group->num_blocks, first);
+		if(end - first >= nr_blocks)
+			break;
+		first = find_next_bit(group->free_map, group->num_blocks, end);
+	}
+	
+	if(first >= group->num_blocks)
+		return -FS_ENO_FREE_BLOCK;
+	
+	rebuild_free_chain_locked(fs_vfs, group, group->first_block + first, nr_blocks);
+	
+	for(int i = 0; i < nr_blocks; i++)
+	{
+		blocks[i] = pop_free_block(fs_vfs, group, &group->allocated_disk_block_list, -1);
+		atomic64_set(&blocks[i]->ref_count, 1);
+	}
+	
+	return 0;
+}
+
+/*
+Allocates nr_blocks physically contiguous free blocks into blocks[], in block order
+A run never crosses allocation groups, group group_num is tried first
+Returns -FS_ENO_FREE_BLOCK if no group has a free run long enough
+*/
+int get_free_run(struct fs_vfs * fs_vfs, int group_num, int nr_blocks, struct fs_block ** blocks)
+{
+	int ret = -FS_ENO_FREE_BLOCK;
+	
+	if(!claim_free_blocks(fs_vfs, nr_blocks, 0))
+		return -FS_ENO_FREE_BLOCK;
+	
+	for(int i = 0; i < fs_vfs->num_groups && ret == -FS_ENO_FREE_BLOCK; i++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[(group_num + i) % fs_vfs->num_groups];
+		
+		mutex_lock(&group->superblock_mutex);
+		ret = get_free_run_locked(fs_vfs, group, nr_blocks, blocks);
+		mutex_unlock(&group->superblock_mutex);
+	}
+	
+	if(ret)
+		percpu_counter_add(&fs_vfs->unreserved_disk_blocks, nr_blocks);
+	
+	return ret;
+}
+
+/*
+Reserves nr_blocks free blocks for a later get_reserved_blocks(), the reserved blocks are claimed (see claim_free_blocks()) so that
+no other allocation and not the pool shrinker can take them
+Memory released to the kernel is taken back first when the free blocks do not cover the reservation
+Returns -FS_ENO_FREE_BLOCK if fewer than nr_blocks unreserved free blocks are left
+*/
+int reserve_disk_blocks(struct fs_vfs * fs_vfs, int nr_blocks)
+{
+	bool claimed = claim_free_blocks(fs_vfs, nr_blocks, 0);
+	
+	if(!claimed && fs_vfs->num_released_disk_blocks)
+	{
+		repopulate_pool(fs_vfs, max(nr_blocks, FS_POOL_REFILL_BLOCKS));
+		claimed = claim_free_blocks(fs_vfs, nr_blocks, 0);
+	}
+	
+	//Blocks of unlinked files may still be on their way back to the free chains (see fs/fs_reclaim.c)
+	if(!claimed && reclaim_pending_blocks(fs_vfs))
+		claimed = claim_free_blocks(fs_vfs, nr_blocks, 0);
+	
+	if(!claimed)
+		return -FS_ENO_FREE_BLOCK;
+	
+	atomic64_add(nr_blocks, &fs_vfs->reserved_disk_blocks);
+	
+	return 0;
+}
+
+/*
+Gives back nr_blocks reserved blocks which were not allocated
+*/
+void unreserve_disk_blocks(struct fs_vfs * fs_vfs, int nr_blocks)
+{
+	atomic64_sub(nr_blocks, &fs_vfs->reserved_disk_blocks);
+	percpu_counter_add(&fs_vfs->unreserved_disk_blocks, nr_blocks);
+}
+
+/*
+Allocates nr_blocks blocks covered by a reservation into blocks[], the reservation of the blocks is used up
+The blocks are taken with one lock round trip per group, from the free chain first and then from the zero pool of the group,
+every block is the goal of the next one so that the batch stays physically contiguous when the free chain allows it
+Returns -FS_ENO_FREE_BLOCK and frees the blocks already taken if fewer than nr_blocks blocks could be allocated, the reservation is kept then
+*/
+int get_reserved_blocks(struct fs_vfs * fs_vfs, int group_num, int goal, int nr_blocks, struct fs_block ** blocks)
+{
+	int num_blocks = 0;
+	bool from_zeroed;
+	
+	if(goal >= 0 && goal < fs_vfs->total_num_disk_blocks)
+		group_num = block_group(fs_vfs, goal)->group_num;
+	
+	for(int i = 0; i < fs_vfs->num_groups && num_blocks < nr_blocks; i++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[(group_num + i) % fs_vfs->num_groups];
+		
+		mutex_lock(&group->superblock_mutex);
+		while(num_blocks < nr_blocks)
 		{
-			block_address[i] = superblock->blocks[i]->block_addr;
-			superblock->blocks[i] = NULL;
+			struct fs_block * block = pop_group_block(fs_vfs, group, goal, false, &from_zeroed);
+			if(!block)
+				break;
+			
+			atomic64_set(&block->ref_count, 1);
+			blocks[num_blocks++] = block;
+			goal = block->block_num + 1;
 		}
-		write_to_block(block, 0, (void *)block_address, 100*sizeof(uintptr_t));
-		kfree(block_address);
-		superblock->blocks[99] = block;
-		superblock->fs_block_ind = 99;
-		mutex_lock(&fs_vfs->vfs_lock);
-		list_del(&block->fs_vfs_list);
-		list_add(&block->fs_vfs_list, &fs_vfs->super_block_disk_list);
-		fs_vfs->num_free_disk_blocks += 1;
-		mutex_unlock(&fs_vfs->vfs_lock);
+		mutex_unlock(&group->superblock_mutex);
 	}
-	else
+	
+	if(num_blocks < nr_blocks)
 	{
-		superblock->fs_block_ind -= 1;
-		superblock->blocks[superblock->fs_block_ind] = block;
-		mutex_lock(&fs_vfs->vfs_lock);
-		if(!block)
-			printk("block is null\n");
-		list_del(&block->fs_vfs_list);
-		list_add(&block->fs_vfs_list, &fs_vfs->free_disk_block_list);
-		fs_vfs->num_free_disk_blocks += 1;
-		mutex_unlock(&fs_vfs->vfs_lock);
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Reserved blocks not available, %d of %d allocated\n", num_blocks, nr_blocks);
+		
+		//The reservation is kept, the blocks are claimed before they are freed so that no other allocation can take them meanwhile
+		percpu_counter_sub(&fs_vfs->unreserved_disk_blocks, num_blocks);
+		while(num_blocks)
+			fs_block_put(fs_vfs, blocks[--num_blocks]);
+		return -FS_ENO_FREE_BLOCK;
 	}
 	
-	mutex_unlock(&superblock->superblock_mutex);
+	atomic64_sub(nr_blocks, &fs_vfs->reserved_disk_blocks);
 	
+	return 0;
 }
 
+/*
+Frees nr_blocks blocks allocated by get_reserved_blocks() and not used, they are reserved again for the next get_reserved_blocks()
+*/
+void put_reserved_blocks(struct fs_vfs * fs_vfs, struct fs_block ** blocks, int nr_blocks)
+{
+	//The blocks are claimed before they are freed so that no other allocation can take them meanwhile
+	percpu_counter_sub(&fs_vfs->unreserved_disk_blocks, nr_blocks);
+	atomic64_add(nr_blocks, &fs_vfs->reserved_disk_blocks);
+	
+	for(int i = 0; i < nr_blocks; i++)
+	{
+		fs_block_put(fs_vfs, blocks[i]);
+	}
+}
+
+/*
+Takes an additional reference to a block which is already mapped by some disk map
+*/
+void fs_block_get(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	atomic64_inc(&block->ref_count);
+	percpu_counter_inc(&fs_vfs->shared_blocks_saved);
+}
+
+/*
+Takes an additional disk map reference to a block found without holding the lock of its disk map (e.g., in the dedup table)
+Fails if no disk map references the block any more, a block which is only pinned by readers is being freed
+*/
+bool fs_block_tryget(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	s64 ref_count = atomic64_read(&block->ref_count);
+	
+	do
+	{
+		if(!fs_block_refs(ref_count))
+			return false;
+	}while(!atomic64_try_cmpxchg(&block->ref_count, &ref_count, ref_count + 1));
+	
+	percpu_counter_inc(&fs_vfs->shared_blocks_saved);
+	return true;
+}
+
+/*
+Returns the block to the free list once neither a disk map nor a reader refers to it
+*/
+static void release_block(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	dedup_unhash_block(fs_vfs, block);
+	dax_unmap_block(fs_vfs, block);
+	put_free_block(fs_vfs, block);
+}
 
+/*
+Drops a disk map reference to the block, the block is returned to the free list when the last reference is dropped
+A block still pinned by readers is returned by the last fs_block_unpin()
+*/
+void fs_block_put(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	if(!block)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : block is NULL in fs_block_put()\n");
+		return;
+	}
+	
+	s64 ref_count = atomic64_dec_return(&block->ref_count);
+	
+	if(fs_block_refs(ref_count))
+	{
+		percpu_counter_dec(&fs_vfs->shared_blocks_saved);
+		return;
+	}
+	
+	if(!ref_count)
+		release_block(fs_vfs, block);
+}
+
+/*
+Pins a block found without holding the lock of its disk map so that it is not freed while a reader copies from it, fails if the block is free
+Pins are not disk map references, they neither count as sharing nor make writers copy the block
+fs_block structures are never freed so the block can be dereferenced even if it has been freed since it was found
+*/
+bool fs_block_pin(struct fs_block * block)
+{
+	return atomic64_add_unless(&block->ref_count, FS_BLOCK_PIN, 0);
+}
+
+void fs_block_unpin(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	if(!atomic64_sub_return(FS_BLOCK_PIN, &block->ref_count))
+		release_block(fs_vfs, block);
+}
@@ -0,0 +1,672 @@
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/random.h>
+
+#include "../include/fs_checkpoint.h"
+#include "../include/fs_dax.h"
+#include "../include/fs_delalloc.h"
+
+/*
+Checkpoint and restore of the whole file system to a file
+
+A checkpoint holds fs_vfs->snapshot_rwsem for writing so no disk map or disk block is modified while it is written
+Only the disk blocks mapped by allocated inodes are written, every shared block is written once
+All reads and writes go through a FS_CHECKPOINT_BUF_SIZE staging buffer so the file is accessed with large sequential requests
+A full checkpoint is written to checkpoint_path.tmp and renamed over checkpoint_path, so a failed checkpoint leaves the previous one intact
+*/
+
+typedef struct fs_checkpoint_stream
+{
+	struct file * file;
+	loff_t pos;
+	
+	char * buf;
+	size_t len; //Bytes held in buf
+	size_t ind; //Next byte of buf to be read
+}fs_checkpoint_stream_t;
+
+static int open_checkpoint_stream(struct fs_checkpoint_stream * stream, char * path, bool write)
+{
+	int flags = write ? (O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE) : (O_RDONLY | O_LARGEFILE);
+	
+	stream->file = filp_open(path, flags, 0600);
+	if(IS_ERR(stream->file))
+	{
+		int err = PTR_ERR(stream->file);
+		stream->file = NULL;
+		return (err == -ENOENT) ? -FS_ENO_CHECKPOINT : -FS_EIO;
+	}
+	
+	stream->buf = kvmalloc(FS_CHECKPOINT_BUF_SIZE, GFP_KERNEL);
+	if(!stream->buf)
+	{
+		filp_close(stream->file, NULL);
+		return -FS_EMALLOC;
+	}
+	
+	stream->pos = 0;
+	stream->len = 0;
+	stream->ind = 0;
+	
+	return 0;
+}
+
+static int flush_checkpoint_stream(struct fs_checkpoint_stream * stream)
+{
+	if(!stream->len)
+		return 0;
+	
+	ssize_t ret = kernel_write(stream->file, stream->buf, stream->len, &stream->pos);
+	if(ret != stream->len)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Checkpoint write failed:%ld\n", (long)ret);
+		return -FS_EIO;
+	}
+	
+	stream->len = 0;
+	return 0;
+}
+
+static void close_checkpoint_stream(struct fs_checkpoint_stream * stream)
+{
+	kvfree(stream->buf);
+	filp_close(stream->file, NULL);
+}
+
+/*
+Renames the file written through stream to path, path has to be in the same directory as the file
+*/
+static int rename_checkpoint_stream(struct fs_checkpoint_stream * stream, char * path)
+{
+	struct path * file_path = &stream->file->f_path;
+	struct dentry * dir = dget_parent(file_path->dentry);
+	const char * name = kbasename(path);
+	
+	int ret = vfs_fsync(stream->file, 0);
+	if(!ret)
+		ret = mnt_want_write(file_path->mnt);
+	if(ret)
+		goto out;
+	
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	
+	struct dentry * target = lookup_one_len(name, dir, strlen(name));
+	if(IS_ERR(target))
+	{
+		ret = PTR_ERR(target);
+	}
+	else
+	{
+		struct renamedata rd = {
+			.old_mnt_idmap = file_mnt_idmap(stream->file),
+			.old_dir = d_inode(dir),
+			.old_dentry = file_path->dentry,
+			.new_mnt_idmap = file_mnt_idmap(stream->file),
+			.new_dir = d_inode(dir),
+			.new_dentry = target,
+		};
+		
+		ret = (file_path->dentry->d_parent == dir) ? vfs_rename(&rd) : -ENOENT;
+		dput(target);
+	}
+	
+	inode_unlock(d_inode(dir));
+	mnt_drop_write(file_path->mnt);
+
+out:
+	dput(dir);
+	
+	if(ret)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Renaming checkpoint to %s failed:%d\n", path, ret);
+		return -FS_EIO;
+	}
+	return 0;
+}
+
+/*
+Removes the file at path, returns -ENOENT if there is no such file
+*/
+static int unlink_checkpoint_file(char * path)
+{
+	struct path file_path;
+	
+	int ret = kern_path(path, 0, &file_path);
+	if(ret)
+		return ret;
+	
+	struct dentry * dir = dget_parent(file_path.dentry);
+	
+	ret = mnt_want_write(file_path.mnt);
+	if(!ret)
+	{
+		inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+		if(file_path.dentry->d_parent == dir)
+			ret = vfs_unlink(mnt_idmap(file_path.mnt), d_inode(dir), file_path.dentry, NULL);
+		inode_unlock(d_inode(dir));
+		mnt_drop_write(file_path.mnt);
+	}
+	
+	dput(dir);
+	path_put(&file_path);
+	
+	return ret;
+}
+
+/*
+Removes the incremental checkpoints path.1, path.2, ... left over from the previous full checkpoint
+*/
+static void unlink_incremental_checkpoints(char * path)
+{
+	for(int sequence = 1; ; sequence++)
+	{
+		char * incremental_path = kasprintf(GFP_KERNEL, "%s.%d", path, sequence);
+		if(!incremental_path)
+			return;
+		
+		int ret = unlink_checkpoint_file(incremental_path);
+		if(ret && ret != -ENOENT)
+			printk(KERN_ERR "FILE_SYSTEM_ERROR : Unable to remove stale checkpoint %s:%d\n", incremental_path, ret);
+		
+		kfree(incremental_path);
+		if(ret)
+			return;
+	}
+}
+
+static int checkpoint_write(struct fs_checkpoint_stream * stream, void * src, size_t size)
+{
+	while(size)
+	{
+		size_t len = min(size, (size_t)FS_CHECKPOINT_BUF_SIZE - stream->len);
+		
+		memcpy(stream->buf + stream->len, src, len);
+		stream->len += len;
+		src += len;
+		size -= len;
+		
+		if(stream->len == FS_CHECKPOINT_BUF_SIZE)
+		{
+			int ret = flush_checkpoint_stream(stream);
+			if(ret)
+				return ret;
+		}
+	}
+	
+	return 0;
+}
+
+static int checkpoint_read(struct fs_checkpoint_stream * stream, void * dest, size_t size)
+{
+	while(size)
+	{
+		if(stream->ind == stream->len)
+		{
+			ssize_t ret = kernel_read(stream->file, stream->buf, FS_CHECKPOINT_BUF_SIZE, &stream->pos);
+			if(ret <= 0)
+			{
+				printk(KERN_ERR "FILE_SYSTEM_ERROR : Checkpoint read failed:%ld\n", (long)ret);
+				return ret ? -FS_EIO : -FS_ECHECKPOINT_FORMAT;
+			}
+			stream->len = ret;
+			stream->ind = 0;
+		}
+		
+		size_t len = min(size, stream->len - stream->ind);
+		
+		memcpy(dest, stream->buf + stream->ind, len);
+		stream->ind += len;
+		dest += len;
+		size -= len;
+	}
+	
+	return 0;
+}
+
+/*
+Returns an array holding the allocated inodes, the inodes stay valid because inodes are never freed
+*/
+static struct fs_inode ** collect_allocated_inodes(struct fs_vfs * fs_vfs, int * num_inodes)
+{
+	struct fs_inode ** inodes = kvmalloc_array(FS_NUM_INODES, sizeof(struct fs_inode *), GFP_KERNEL);
+	if(!inodes)
+		return NULL;
+	
+	struct fs_inode * inode;
+	*num_inodes = 0;
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	list_for_each_entry(inode, &fs_vfs->allocated_inode_list, fs_vfs_inode_list)
+	{
+		inodes[(*num_inodes)++] = inode;
+	}
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	return inodes;
+}
+
+static int write_checkpoint(struct fs_vfs * fs_vfs, struct fs_checkpoint_stream * stream, struct fs_checkpoint_header * header,
+			    struct fs_inode ** inodes, unsigned long * to_write)
+{
+	int ret = checkpoint_write(stream, header, sizeof(struct fs_checkpoint_header));
+	if(ret)
+		return ret;
+	
+	unsigned int block_num;
+	for_each_set_bit(block_num, to_write, fs_vfs->total_num_disk_blocks)
+	{
+		u32 num = block_num;
+		
+		ret = checkpoint_write(stream, &num, sizeof(u32));
+		if(!ret)
+			ret = checkpoint_write(stream, (void *)fs_vfs->block_table[block_num]->block_addr, FS_BLOCK_SIZE);
+		if(ret)
+			return ret;
+	}
+	
+	for(int i = 0; i < header->num_inodes; i++)
+	{
+		struct fs_checkpoint_inode record;
+		
+		record.inode_num = inodes[i]->inode_num;
+		record.file_size = inodes[i]->file_size;
+		record.num_blocks = inode_num_blocks(inodes[i]);
+		record.reserved = 0;
+		
+		ret = checkpoint_write(stream, &record, sizeof(struct fs_checkpoint_inode));
+		
+		for(int j = 0; j < record.num_blocks && !ret; j++)
+		{
+			u32 num = inode_block(fs_vfs, inodes[i], j)->block_num;
+			ret = checkpoint_write(stream, &num, sizeof(u32));
+		}
+		if(ret)
+			return ret;
+	}
+	
+	return flush_checkpoint_stream(stream);
+}
+
+/*
+Writes a checkpoint of the file system to fs_vfs->checkpoint_path
+Parameters:-
+bool incremental :- write only the blocks modified since the previous checkpoint to fs_vfs->checkpoint_path.<n>, needs a full checkpoint written or restored since the module was loaded
+*/
+int checkpoint_file_system(struct fs_vfs * fs_vfs, bool incremental)
+{
+	int ret, num_inodes;
+	
+	if(!fs_vfs->checkpoint_path)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : No checkpoint path set\n");
+		return -FS_EINPUT_PARAMETER;
+	}
+	
+	mutex_lock(&fs_vfs->checkpoint_lock);
+	
+	//dirty_bitmap only tracks the writes since this load, without a full checkpoint of this load it is not a delta of anything on disk
+	if(incremental && !fs_vfs->checkpoint_chain)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Incremental checkpoint needs a full checkpoint first\n");
+		mutex_unlock(&fs_vfs->checkpoint_lock);
+		return -FS_ENO_CHECKPOINT;
+	}
+	
+	int sequence = incremental ? fs_vfs->checkpoint_seq + 1 : 0;
+	u64 chain_id = fs_vfs->checkpoint_chain;
+	
+	while(!incremental && (!chain_id || chain_id == fs_vfs->checkpoint_chain))
+		chain_id = get_random_u64();
+	
+	char * path = incremental ? kasprintf(GFP_KERNEL, "%s.%d", fs_vfs->checkpoint_path, sequence) : kasprintf(GFP_KERNEL, "%s.tmp", fs_vfs->checkpoint_path);
+	struct fs_inode ** inodes = NULL;
+	unsigned long * to_write = bitmap_zalloc(fs_vfs->total_num_disk_blocks, GFP_KERNEL);
+	
+	if(!path || !to_write)
+	{
+		ret = -FS_EMALLOC;
+		goto out_free;
+	}
+	
+	struct fs_checkpoint_stream stream;
+	ret = open_checkpoint_stream(&stream, path, true);
+	if(ret)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Unable to open checkpoint file %s\n", path);
+		goto out_free;
+	}
+	
+	down_write(&fs_vfs->snapshot_rwsem);
+	
+	//Only the disk maps are checkpointed, buffered appends need their blocks first
+	ret = flush_delalloc_inodes_locked(fs_vfs);
+	if(ret)
+		goto out_unlock;
+	
+	//Collected under snapshot_rwsem so that the inodes and their disk maps are taken at the same point in time
+	inodes = collect_allocated_inodes(fs_vfs, &num_inodes);
+	if(!inodes)
+	{
+		ret = -FS_EMALLOC;
+		goto out_unlock;
+	}
+	
+	for(int i = 0; i < num_inodes; i++)
+	{
+		for(int j = 0; j < inode_num_blocks(inodes[i]); j++)
+		{
+			set_bit(inode_block(fs_vfs, inodes[i], j)->block_num, to_write);
+		}
+	}
+	
+	if(incremental)
+		bitmap_and(to_write, to_write, fs_vfs->dirty_bitmap, fs_vfs->total_num_disk_blocks);
+	
+	struct fs_checkpoint_header header = {
+		.magic = FS_CHECKPOINT_MAGIC,
+		.version = FS_CHECKPOINT_VERSION,
+		.flags = incremental ? FS_CHECKPOINT_INCREMENTAL : FS_CHECKPOINT_FULL,
+		.block_size = FS_BLOCK_SIZE,
+		.sequence = sequence,
+		.num_blocks = bitmap_weight(to_write, fs_vfs->total_num_disk_blocks),
+		.num_inodes = num_inodes,
+		.reserved = 0,
+		.chain_id = chain_id,
+	};
+	
+	ret = write_checkpoint(fs_vfs, &stream, &header, inodes, to_write);
+	
+	//The previous full checkpoint is only replaced once the new one is complete
+	if(!ret && !incremental)
+		ret = rename_checkpoint_stream(&stream, fs_vfs->checkpoint_path);
+	
+	if(!ret)
+	{
+		bitmap_zero(fs_vfs->dirty_bitmap, fs_vfs->total_num_disk_blocks);
+		fs_vfs->checkpoint_seq = sequence;
+		fs_vfs->checkpoint_chain = chain_id;
+	}
+	
+out_unlock:
+	up_write(&fs_vfs->snapshot_rwsem);
+	
+	close_checkpoint_stream(&stream);
+	
+	if(ret)
+	{
+		unlink_checkpoint_file(path);
+	}
+	else
+	{
+		//Restore stops at the first chain_id mismatch, removing the old incremental checkpoints keeps them from piling up
+		if(!incremental)
+			unlink_incremental_checkpoints(fs_vfs->checkpoint_path);
+		
+		printk("FILE_SYSTEM : Checkpoint %s written, %u blocks %u inodes\n", incremental ? path : fs_vfs->checkpoint_path, header.num_blocks, header.num_inodes);
+	}
+
+out_free:
+	bitmap_free(to_write);
+	kvfree(inodes);
+	kfree(path);
+	
+	mutex_unlock(&fs_vfs->checkpoint_lock);
+	
+	return ret;
+}
+
+/*
+Returns the block restored for the checkpointed block number, allocating one if the block has not been restored yet
+restored[] holds one reference to every block it points to
+*/
+static struct fs_block * get_restored_block(struct fs_vfs * fs_vfs, struct fs_block ** restored, u32 block_num)
+{
+	if(block_num >= fs_vfs->total_num_disk_blocks)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Wrong block number %u in checkpoint\n", block_num);
+		return NULL;
+	}
+	
+	if(!restored[block_num])
+		restored[block_num] = get_free_block(fs_vfs);
+	
+	return restored[block_num];
+}
+
+/*
+Restores one checkpoint file, *chain_id is set from the full checkpoint and has to match for an incremental checkpoint
+Returns -FS_ENO_CHECKPOINT for a missing file or an incremental checkpoint of another chain
+*/
+static int restore_checkpoint_file(struct fs_vfs * fs_vfs, char * path, int sequence, u64 * chain_id, struct fs_block ** restored)
+{
+	struct fs_checkpoint_stream stream;
+	struct fs_checkpoint_header header;
+	
+	int ret = open_checkpoint_stream(&stream, path, false);
+	if(ret)
+		return ret;
+	
+	unsigned long * seen_inodes = bitmap_zalloc(FS_NUM_INODES, GFP_KERNEL);
+	if(!seen_inodes)
+	{
+		ret = -FS_EMALLOC;
+		goto out;
+	}
+	
+	ret = checkpoint_read(&stream, &header, sizeof(struct fs_checkpoint_header));
+	if(ret)
+		goto out;
+	
+	if(header.magic != FS_CHECKPOINT_MAGIC || header.version != FS_CHECKPOINT_VERSION || header.block_size != FS_BLOCK_SIZE ||
+	   header.sequence != sequence || header.flags != (sequence ? FS_CHECKPOINT_INCREMENTAL : FS_CHECKPOINT_FULL))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : %s is not checkpoint %d of this file system\n", path, sequence);
+		ret = -FS_ECHECKPOINT_FORMAT;
+		goto out;
+	}
+	
+	if(!sequence)
+	{
+		*chain_id = header.chain_id;
+	}
+	else if(header.chain_id != *chain_id)
+	{
+		printk("FILE_SYSTEM : Ignoring %s, it belongs to an older full checkpoint\n", path);
+		ret = -FS_ENO_CHECKPOINT;
+		goto out;
+	}
+	
+	for(u32 i = 0; i < header.num_blocks; i++)
+	{
+		u32 block_num;
+		
+		ret = checkpoint_read(&stream, &block_num, sizeof(u32));
+		if(ret)
+			goto out;
+		
+		struct fs_block * block = get_restored_block(fs_vfs, restored, block_num);
+		if(!block)
+		{
+			ret = -FS_ENO_FREE_BLOCK;
+			goto out;
+		}
+		
+		ret = checkpoint_read(&stream, (void *)block->block_addr, FS_BLOCK_SIZE);
+		if(ret)
+			goto out;
+	}
+	
+	for(u32 i = 0; i < header.num_inodes; i++)
+	{
+		struct fs_checkpoint_inode record;
+		
+		ret = checkpoint_read(&stream, &record, sizeof(struct fs_checkpoint_inode));
+		if(ret)
+			goto out;
+		
+		struct fs_inode * inode = get_inode_num(fs_vfs, record.inode_num);
+		if(!inode)
+		{
+			ret = -FS_ECHECKPOINT_FORMAT;
+			goto out;
+		}
+		set_bit(record.inode_num, seen_inodes);
+		
+		trim_inode_disk_map(fs_vfs, inode);
+		
+		for(u32 j = 0; j < record.num_blocks; j++)
+		{
+			u32 block_num;
+			
+			ret = checkpoint_read(&stream, &block_num, sizeof(u32));
+			if(ret)
+				goto out;
+			
+			struct fs_block * block = get_restored_block(fs_vfs, restored, block_num);
+			if(!block)
+			{
+				ret = -FS_ENO_FREE_BLOCK;
+				goto out;
+			}
+			
+			ret = attach_block_to_inode(fs_vfs, inode, block);
+			if(ret)
+				goto out;
+		}
+		
+		inode->file_size = record.file_size;
+	}
+	
+	//Inodes which are not part of the checkpoint were deleted after the previous checkpoint
+	for(int i = 0; i < FS_NUM_INODES; i++)
+	{
+		struct fs_inode * inode = fs_vfs->inode_table[i];
+		if(inode->allocated && !test_bit(i, seen_inodes))
+		{
+			trim_inode_disk_map(fs_vfs, inode);
+			put_inode(fs_vfs, inode);
+		}
+	}
+	
+	printk("FILE_SYSTEM : Restored %s, %u blocks %u inodes\n", path, header.num_blocks, header.num_inodes);
+
+out:
+	bitmap_free(seen_inodes);
+	close_checkpoint_stream(&stream);
+	return ret;
+}
+
+/*
+Restores the full checkpoint stored in path followed by the incremental checkpoints path.1, path.2, ... in order
+The restore stops at the first missing incremental checkpoint or the first one written after a different full checkpoint
+*/
+int restore_file_system(struct fs_vfs * fs_vfs, char * path)
+{
+	//Checkpoints may share blocks between inodes, which the reverse map of a DAX device cannot record
+	if(fs_dax_enabled(fs_vfs))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Checkpoints cannot be restored to a DAX device\n");
+		return -FS_EDAX;
+	}
+	
+	struct fs_block ** restored = kvcalloc(fs_vfs->total_num_disk_blocks, sizeof(struct fs_block *), GFP_KERNEL);
+	if(!restored)
+		return -FS_EMALLOC;
+	
+	mutex_lock(&fs_vfs->checkpoint_lock);
+	
+	int sequence = 0;
+	u64 chain_id = 0;
+	int ret = restore_checkpoint_file(fs_vfs, path, sequence, &chain_id, restored);
+	
+	while(!ret)
+	{
+		char * incremental_path = kasprintf(GFP_KERNEL, "%s.%d", path, sequence + 1);
+		if(!incremental_path)
+		{
+			ret = -FS_EMALLOC;
+			break;
+		}
+		
+		ret = restore_checkpoint_file(fs_vfs, incremental_path, sequence + 1, &chain_id, restored);
+		kfree(incremental_path);
+		
+		if(ret == -FS_ENO_CHECKPOINT)
+		{
+			ret = 0;
+			break;
+		}
+		if(!ret)
+			sequence += 1;
+	}
+	
+	//The inodes hold their own references, blocks which are not mapped by any inode go back to the free list
+	for(int i = 0; i < fs_vfs->total_num_disk_blocks; i++)
+	{
+		if(restored[i])
+			fs_block_put(fs_vfs, restored[i]);
+	}
+	kvfree(restored);
+	
+	if(!ret)
+	{
+		fs_vfs->checkpoint_seq = sequence;
+		fs_vfs->checkpoint_chain = chain_id;
+		bitmap_zero(fs_vfs->dirty_bitmap, fs_vfs->total_num_disk_blocks);
+	}
+	
+	mutex_unlock(&fs_vfs->checkpoint_lock);
+	
+	return ret;
+}
+
+/*
+Writing "full" or "incremental" to /sys/kernel/debug/ramfs/checkpoint writes a checkpoint
+*/
+static ssize_t checkpoint_control_write(struct file * file, const char __user * ubuf, size_t count, loff_t * ppos)
+{
+	struct fs_vfs * fs_vfs = file->private_data;
+	char buf[16];
+	int ret;
+	
+	if(count >= sizeof(buf))
+		return -EINVAL;
+	
+	if(copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	
+	if(sysfs_streq(buf, "full"))
+		ret = checkpoint_file_system(fs_vfs, false);
+	else if(sysfs_streq(buf, "incremental"))
+		ret = checkpoint_file_system(fs_vfs, true);
+	else
+		return -EINVAL;
+	
+	return ret ? -EIO : count;
+}
+
+static const struct file_operations checkpoint_control_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = checkpoint_control_write,
+	.llseek = noop_llseek,
+};
+
+/*
+Sets the checkpoint file, has to be called after initialise_fs_stats()
+*/
+void initialise_checkpoint(struct fs_vfs * fs_vfs, char * path)
+{
+	fs_vfs->checkpoint_path = path;
+	fs_vfs->checkpoint_seq = 0;
+	fs_vfs->checkpoint_chain = 0;
+	
+	debugfs_create_file("checkpoint", 0200, fs_vfs->stats_dentry, fs_vfs, &checkpoint_control_fops);
+}
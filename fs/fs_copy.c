@@ -0,0 +1,168 @@
+#include <linux/string.h>
+#include <linux/kernel.h>
+
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include <asm/fpu/xstate.h>
+#endif
+
+#include "../include/fs_copy.h"
+
+/*
+Data copy into disk blocks
+
+FS_COPY_CACHED uses memcpy()
+FS_COPY_NONTEMPORAL uses streaming stores so large sequential writes do not evict the rest of the last level cache
+The fastest streaming copy supported by the CPU is selected once by initialise_copy()
+- AVX-512 and AVX2 kernels copy 256 and 128 bytes per iteration with vmovntdq, they need a 64 byte aligned destination
+- memcpy_flushcache() (movnti on x86, plain memcpy elsewhere) is used for everything else
+*/
+
+static int nontemporal_impl = FS_COPY_IMPL_MEMCPY;
+
+static const char * const copy_impl_names[FS_COPY_NUM_IMPL] = {
+	[FS_COPY_IMPL_MEMCPY] = "memcpy",
+	[FS_COPY_IMPL_MOVNTI] = "movnti",
+	[FS_COPY_IMPL_AVX2] = "avx2",
+	[FS_COPY_IMPL_AVX512] = "avx512",
+};
+
+#ifdef CONFIG_X86_64
+static void copy_avx2_nontemporal(void * dest, void * src, int size)
+{
+	kernel_fpu_begin();
+	
+	for(int i = 0; i < size; i += 128)
+	{
+		asm volatile(
+			"vmovdqu 0(%1), %%ymm0\n\t"
+			"vmovdqu 32(%1), %%ymm1\n\t"
+			"vmovdqu 64(%1), %%ymm2\n\t"
+			"vmovdqu 96(%1), %%ymm3\n\t"
+			"vmovntdq %%ymm0, 0(%0)\n\t"
+			"vmovntdq %%ymm1, 32(%0)\n\t"
+			"vmovntdq %%ymm2, 64(%0)\n\t"
+			"vmovntdq %%ymm3, 96(%0)\n\t"
+			: : "r" (dest + i), "r" (src + i) : "memory");
+	}
+	
+	//Streaming stores are weakly ordered, make them visible before the block is used
+	asm volatile("sfence" : : : "memory");
+	
+	kernel_fpu_end();
+}
+
+static void copy_avx512_nontemporal(void * dest, void * src, int size)
+{
+	kernel_fpu_begin();
+	
+	for(int i = 0; i < size; i += 256)
+	{
+		asm volatile(
+			"vmovdqu64 0(%1), %%zmm0\n\t"
+			"vmovdqu64 64(%1), %%zmm1\n\t"
+			"vmovdqu64 128(%1), %%zmm2\n\t"
+			"vmovdqu64 192(%1), %%zmm3\n\t"
+			"vmovntdq %%zmm0, 0(%0)\n\t"
+			"vmovntdq %%zmm1, 64(%0)\n\t"
+			"vmovntdq %%zmm2, 128(%0)\n\t"
+			"vmovntdq %%zmm3, 192(%0)\n\t"
+			: : "r" (dest + i), "r" (src + i) : "memory");
+	}
+	
+	asm volatile("sfence" : : : "memory");
+	
+	kernel_fpu_end();
+}
+#endif
+
+bool copy_impl_available(int impl)
+{
+	switch(impl)
+	{
+		case FS_COPY_IMPL_MEMCPY:
+		case FS_COPY_IMPL_MOVNTI:	return true;
+#ifdef CONFIG_X86_64
+		//The CPUID bit alone is not enough, the OS also has to have enabled the register state the copy kernels use in XCR0
+		case FS_COPY_IMPL_AVX2:		return boot_cpu_has(X86_FEATURE_AVX2) &&
+						       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+		case FS_COPY_IMPL_AVX512:	return boot_cpu_has(X86_FEATURE_AVX512F) &&
+						       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM | XFEATURE_MASK_AVX512, NULL);
+#endif
+		default:			return false;
+	}
+}
+
+const char * copy_impl_name(int impl)
+{
+	if(impl < 0 || impl >= FS_COPY_NUM_IMPL)
+		return "unknown";
+	return copy_impl_names[impl];
+}
+
+int copy_nontemporal_impl(void)
+{
+	return nontemporal_impl;
+}
+
+/*
+Copies size bytes with the given implementation
+The SIMD kernels are only used when the destination is 64 byte aligned and size is a multiple of their stride
+*/
+void copy_block_data_impl(void * dest, void * src, int size, int impl)
+{
+	bool aligned = IS_ALIGNED((unsigned long)dest, 64);
+	
+	switch(impl)
+	{
+#ifdef CONFIG_X86_64
+		case FS_COPY_IMPL_AVX512:	if(aligned && IS_ALIGNED(size, 256) && irq_fpu_usable())
+						{
+							copy_avx512_nontemporal(dest, src, size);
+							return;
+						}
+						fallthrough;
+		
+		case FS_COPY_IMPL_AVX2:		if(aligned && IS_ALIGNED(size, 128) && irq_fpu_usable())
+						{
+							copy_avx2_nontemporal(dest, src, size);
+							return;
+						}
+						fallthrough;
+#endif
+		case FS_COPY_IMPL_MOVNTI:	memcpy_flushcache(dest, src, size);
+						return;
+		
+		default:			memcpy(dest, src, size);
+	}
+}
+
+void copy_block_data(void * dest, void * src, int size, int copy_mode)
+{
+	if(copy_mode == FS_COPY_NONTEMPORAL)
+		copy_block_data_impl(dest, src, size, nontemporal_impl);
+	else
+		memcpy(dest, src, size);
+}
+
+/*
+Selects the streaming copy implementation
+Parameters:-
+bool nontemporal :- if false FS_COPY_NONTEMPORAL copies fall back to memcpy()
+*/
+void initialise_copy(bool nontemporal)
+{
+	nontemporal_impl = FS_COPY_IMPL_MEMCPY;
+	
+	if(nontemporal)
+	{
+		for(int impl = FS_COPY_IMPL_MOVNTI; impl < FS_COPY_NUM_IMPL; impl++)
+		{
+			if(copy_impl_available(impl))
+				nontemporal_impl = impl;
+		}
+	}
+	
+	printk("FILE_SYSTEM : Using %s for streaming block copies\n", copy_impl_name(nontemporal_impl));
+}
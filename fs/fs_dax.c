@@ -0,0 +1,383 @@
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/dax.h>
+#include <linux/libnvdimm.h>
+#include <linux/sort.h>
+
+#include "../include/fs_dax.h"
+#include "../include/fs_inode.h"
+
+/*
+Persistent memory backend
+
+With the dax_path module parameter the pool is placed on a pmem/DAX block device (e.g. /dev/pmem0, the memmap=4G!12G boot option emulates one)
+instead of kernel pages, the device is mapped once with dax_direct_access() and the blocks are addressed directly
+Besides the data blocks the device holds a record per inode and a reverse map with the owner of every block (see include/fs_dax.h)
+so mounting the device again only scans the metadata, the data blocks are never read
+
+Every update is written back with arch_wb_cache_pmem() and ordered by wmb() before the update which depends on it
+1. the data of a write and newly zeroed blocks are persisted before the file size or the reverse map entry which exposes them
+2. a block is recorded in the reverse map when an inode maps it and cleared before it goes back on the free chain
+The in-pool super block chains are not persistent, initialise_disk_blocks() rebuilds them from the reverse map
+A crash can leave blocks recorded behind a hole of the map or owned by a free inode, the recovery frees them
+
+A block is owned by one inode at a time, so dedup, snapshots, reflink copies and the pool shrinker are not available in DAX mode
+*/
+
+typedef struct fs_dax_extent
+{
+	u32 owner;
+	u32 block_ind;
+	u32 block_num;
+}fs_dax_extent_t;
+
+/*
+Writes back the cachelines of [addr, addr + size) to the DAX device, a no-op for the page backed pool
+*/
+void dax_persist(struct fs_vfs * fs_vfs, void * addr, size_t size)
+{
+	if(!fs_dax_enabled(fs_vfs))
+		return;
+	
+	arch_wb_cache_pmem(addr, size);
+	wmb();
+}
+
+void * dax_block_addr(struct fs_vfs * fs_vfs, int block_num)
+{
+	return fs_vfs->dax_data + (size_t)block_num * FS_BLOCK_SIZE;
+}
+
+/*
+Returns the block number of the data block containing addr or -1 if addr is not a data block of the device
+*/
+int dax_addr_to_block_num(struct fs_vfs * fs_vfs, void * addr)
+{
+	if(addr < fs_vfs->dax_data || addr >= fs_vfs->dax_data + (size_t)fs_vfs->total_num_disk_blocks * FS_BLOCK_SIZE)
+		return -1;
+	
+	return (addr - fs_vfs->dax_data) / FS_BLOCK_SIZE;
+}
+
+/*
+Persists the allocated flag and the file size of the inode
+The data below the file size has to be persisted first
+*/
+void dax_persist_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	if(!fs_dax_enabled(fs_vfs))
+		return;
+	
+	struct fs_dax_inode * record = &fs_vfs->dax_inodes[inode->inode_num];
+	
+	record->flags = inode->allocated ? FS_DAX_INODE_ALLOCATED : 0;
+	record->file_size = READ_ONCE(inode->file_size);
+	dax_persist(fs_vfs, record, sizeof(struct fs_dax_inode));
+}
+
+/*
+Records that the logical block block_ind of the inode is mapped to the block
+The entry is 8 byte aligned and written with a single store so it is never torn
+Note :- This function has to be called while holding the inode mutex, before the block replaces an other block in the map
+*/
+void dax_map_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, struct fs_block * block)
+{
+	if(!fs_dax_enabled(fs_vfs))
+		return;
+	
+	struct fs_dax_rmap * rmap = &fs_vfs->dax_rmap[block->block_num];
+	
+	//Recovery maps the blocks at their recorded position again
+	if(rmap->owner == inode->inode_num + 1 && rmap->block_ind == block_ind)
+		return;
+	
+	*rmap = (struct fs_dax_rmap){ .owner = inode->inode_num + 1, .block_ind = block_ind };
+	dax_persist(fs_vfs, rmap, sizeof(struct fs_dax_rmap));
+}
+
+/*
+Clears the reverse map entry of a block which is going back on the free chain
+*/
+void dax_unmap_block(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	if(!fs_dax_enabled(fs_vfs))
+		return;
+	
+	struct fs_dax_rmap * rmap = &fs_vfs->dax_rmap[block->block_num];
+	if(!rmap->owner)
+		return;
+	
+	*rmap = (struct fs_dax_rmap){ .owner = 0, .block_ind = 0 };
+	dax_persist(fs_vfs, rmap, sizeof(struct fs_dax_rmap));
+}
+
+/*
+Computes the layout of a device of nr_pages blocks, every data block costs a block and a reverse map entry
+*/
+static void dax_layout(u64 nr_pages, struct fs_dax_super * layout)
+{
+	u64 inode_table_blocks = DIV_ROUND_UP((u64)FS_NUM_INODES * sizeof(struct fs_dax_inode), FS_BLOCK_SIZE);
+	u64 rmap_per_block = FS_BLOCK_SIZE / sizeof(struct fs_dax_rmap);
+	u64 num_blocks = 0;
+	
+	if(nr_pages > 1 + inode_table_blocks)
+		num_blocks = min_t(u64, (nr_pages - 1 - inode_table_blocks) * rmap_per_block / (rmap_per_block + 1), INT_MAX);
+	
+	layout->magic = FS_DAX_MAGIC;
+	layout->version = FS_DAX_VERSION;
+	layout->block_size = FS_BLOCK_SIZE;
+	layout->num_blocks = num_blocks;
+	layout->num_inodes = FS_NUM_INODES;
+	layout->inode_table_offset = FS_BLOCK_SIZE;
+	layout->rmap_offset = (1 + inode_table_blocks) * FS_BLOCK_SIZE;
+	layout->data_offset = layout->rmap_offset + DIV_ROUND_UP(num_blocks, rmap_per_block) * FS_BLOCK_SIZE;
+}
+
+/*
+Writes an empty file system to the device
+The super block is written last so that an interrupted format is never mounted
+*/
+static void format_dax_device(struct fs_vfs * fs_vfs, struct fs_dax_super * layout)
+{
+	printk("FILE_SYSTEM : Formatting the DAX device, %u blocks\n", layout->num_blocks);
+	
+	fs_vfs->dax_super->magic = 0;
+	dax_persist(fs_vfs, fs_vfs->dax_super, sizeof(struct fs_dax_super));
+	
+	memset(fs_vfs->dax_inodes, 0, (size_t)layout->num_inodes * sizeof(struct fs_dax_inode));
+	dax_persist(fs_vfs, fs_vfs->dax_inodes, (size_t)layout->num_inodes * sizeof(struct fs_dax_inode));
+	
+	memset(fs_vfs->dax_rmap, 0, (size_t)layout->num_blocks * sizeof(struct fs_dax_rmap));
+	dax_persist(fs_vfs, fs_vfs->dax_rmap, (size_t)layout->num_blocks * sizeof(struct fs_dax_rmap));
+	
+	*fs_vfs->dax_super = *layout;
+	dax_persist(fs_vfs, fs_vfs->dax_super, sizeof(struct fs_dax_super));
+}
+
+/*
+Frees the blocks whose owner is not an allocated inode, they were being freed when the file system went down
+*/
+static void scrub_dax_rmap(struct fs_vfs * fs_vfs)
+{
+	int scrubbed = 0;
+	
+	for(int i = 0; i < fs_vfs->total_num_disk_blocks; i++)
+	{
+		struct fs_dax_rmap * rmap = &fs_vfs->dax_rmap[i];
+		if(!rmap->owner)
+			continue;
+		
+		if(rmap->owner > FS_NUM_INODES || !(fs_vfs->dax_inodes[rmap->owner - 1].flags & FS_DAX_INODE_ALLOCATED))
+		{
+			*rmap = (struct fs_dax_rmap){ .owner = 0, .block_ind = 0 };
+			dax_persist(fs_vfs, rmap, sizeof(struct fs_dax_rmap));
+			scrubbed += 1;
+		}
+	}
+	
+	if(scrubbed)
+		printk("FILE_SYSTEM : Freed %d orphaned blocks on the DAX device\n", scrubbed);
+}
+
+/*
+Places the pool on the DAX device at path instead of allocate_pool()
+The file system on the device is mounted unless format is set, fs_vfs->total_num_disk_blocks is set from the size of the device
+Parameters:-
+char * path :- path of a pmem/DAX capable block device
+bool format :- write an empty file system to the device, required the first time a device is used
+*/
+int allocate_dax_pool(struct fs_vfs * fs_vfs, char * path, bool format)
+{
+	struct fs_dax_super layout;
+	u64 start_off = 0;
+	void * kaddr;
+	int ret;
+	
+	struct file * bdev_file = bdev_file_open_by_path(path, BLK_OPEN_READ | BLK_OPEN_WRITE, fs_vfs, NULL);
+	if(IS_ERR(bdev_file))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Error opening the DAX device %s:%ld\n", path, PTR_ERR(bdev_file));
+		return -FS_EIO;
+	}
+	
+	struct block_device * bdev = file_bdev(bdev_file);
+	
+	struct dax_device * dax_dev = fs_dax_get_by_bdev(bdev, &start_off, fs_vfs, NULL);
+	if(!dax_dev)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : %s does not support DAX\n", path);
+		fput(bdev_file);
+		return -FS_EDAX;
+	}
+	
+	long nr_pages = bdev_nr_bytes(bdev) >> PAGE_SHIFT;
+	
+	int id = dax_read_lock();
+	long mapped = dax_direct_access(dax_dev, PHYS_PFN(start_off), nr_pages, DAX_ACCESS, &kaddr, NULL);
+	dax_read_unlock(id);
+	
+	if(mapped < nr_pages)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Mapped %ld of %ld pages of the DAX device %s\n", mapped, nr_pages, path);
+		ret = -FS_EDAX;
+		goto err;
+	}
+	
+	dax_layout(nr_pages, &layout);
+	if(layout.num_blocks < 100)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : The DAX device %s is too small\n", path);
+		ret = -FS_EDAX;
+		goto err;
+	}
+	
+	fs_vfs->dax_bdev_file = bdev_file;
+	fs_vfs->dax_dev = dax_dev;
+	fs_vfs->dax_base = kaddr;
+	fs_vfs->dax_super = kaddr;
+	fs_vfs->dax_inodes = kaddr + layout.inode_table_offset;
+	fs_vfs->dax_rmap = kaddr + layout.rmap_offset;
+	fs_vfs->dax_data = kaddr + layout.data_offset;
+	fs_vfs->total_num_disk_blocks = layout.num_blocks;
+	
+	struct fs_dax_super * super = fs_vfs->dax_super;
+	
+	if(format)
+	{
+		format_dax_device(fs_vfs, &layout);
+	}
+	else if(super->magic != FS_DAX_MAGIC)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : %s does not hold a file system, load with dax_format to create one\n", path);
+		ret = -FS_EDAX;
+		goto err_reset;
+	}
+	else if(memcmp(super, &layout, sizeof(struct fs_dax_super)))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : The file system on %s has a different layout, load with dax_format to discard it\n", path);
+		ret = -FS_EDAX;
+		goto err_reset;
+	}
+	else
+	{
+		scrub_dax_rmap(fs_vfs);
+	}
+	
+	printk("FILE_SYSTEM : Using the DAX device %s, %d blocks\n", path, fs_vfs->total_num_disk_blocks);
+	
+	return 0;
+	
+err_reset:
+	fs_vfs->dax_bdev_file = NULL;
+	fs_vfs->dax_dev = NULL;
+	fs_vfs->dax_base = NULL;
+	fs_vfs->dax_super = NULL;
+	fs_vfs->dax_inodes = NULL;
+	fs_vfs->dax_rmap = NULL;
+	fs_vfs->dax_data = NULL;
+err:
+	fs_put_dax(dax_dev, fs_vfs);
+	fput(bdev_file);
+	return ret;
+}
+
+void destroy_dax_pool(struct fs_vfs * fs_vfs)
+{
+	if(!fs_dax_enabled(fs_vfs))
+		return;
+	
+	fs_put_dax(fs_vfs->dax_dev, fs_vfs);
+	fput(fs_vfs->dax_bdev_file);
+	
+	fs_vfs->dax_bdev_file = NULL;
+	fs_vfs->dax_dev = NULL;
+	fs_vfs->dax_base = NULL;
+	fs_vfs->dax_super = NULL;
+	fs_vfs->dax_inodes = NULL;
+	fs_vfs->dax_rmap = NULL;
+	fs_vfs->dax_data = NULL;
+}
+
+static int cmp_dax_extent(const void * a, const void * b)
+{
+	const struct fs_dax_extent * x = a;
+	const struct fs_dax_extent * y = b;
+	
+	if(x->owner != y->owner)
+		return (x->owner < y->owner) ? -1 : 1;
+	if(x->block_ind != y->block_ind)
+		return (x->block_ind < y->block_ind) ? -1 : 1;
+	return 0;
+}
+
+/*
+Rebuilds the inodes and their disk maps from the inode records and the reverse map of the device
+The blocks recorded in the reverse map are allocated by initialise_disk_blocks() with one reference which the inode takes over
+Blocks behind a hole of a map are freed
+Note :- Has to be called after allocate_inodes() and before the file system is used
+*/
+int recover_dax_inodes(struct fs_vfs * fs_vfs)
+{
+	int num_extents = 0;
+	
+	if(!fs_dax_enabled(fs_vfs))
+		return 0;
+	
+	for(int i = 0; i < fs_vfs->total_num_disk_blocks; i++)
+	{
+		if(dax_block_mapped(fs_vfs, i))
+			num_extents += 1;
+	}
+	
+	struct fs_dax_extent * extents = kvmalloc_array(max(num_extents, 1), sizeof(struct fs_dax_extent), GFP_KERNEL);
+	if(!extents)
+		return -FS_EMALLOC;
+	
+	num_extents = 0;
+	for(int i = 0; i < fs_vfs->total_num_disk_blocks; i++)
+	{
+		if(!dax_block_mapped(fs_vfs, i))
+			continue;
+		
+		extents[num_extents].owner = fs_vfs->dax_rmap[i].owner;
+		extents[num_extents].block_ind = fs_vfs->dax_rmap[i].block_ind;
+		extents[num_extents].block_num = i;
+		num_extents += 1;
+	}
+	
+	sort(extents, num_extents, sizeof(struct fs_dax_extent), cmp_dax_extent, NULL);
+	
+	for(int i = 0; i < FS_NUM_INODES; i++)
+	{
+		if(!(fs_vfs->dax_inodes[i].flags & FS_DAX_INODE_ALLOCATED))
+			continue;
+		
+		//Set before get_inode_num() persists the record again
+		fs_vfs->inode_table[i]->file_size = fs_vfs->dax_inodes[i].file_size;
+		get_inode_num(fs_vfs, i);
+		fs_vfs->dax_recovered_inodes += 1;
+	}
+	
+	for(int i = 0; i < num_extents; i++)
+	{
+		struct fs_inode * inode = fs_vfs->inode_table[extents[i].owner - 1];
+		struct fs_block * block = num_to_disk_block(fs_vfs, extents[i].block_num);
+		int ret = -FS_EINPUT_PARAMETER;
+		
+		mutex_lock(&inode->inode_mutex);
+		if(extents[i].block_ind == inode_num_blocks(inode))
+			ret = append_block_to_inode(fs_vfs, inode, block);
+		mutex_unlock(&inode->inode_mutex);
+		
+		if(ret)
+			fs_block_put(fs_vfs, block);
+		else
+			fs_vfs->dax_recovered_blocks += 1;
+	}
+	
+	kvfree(extents);
+	
+	printk("FILE_SYSTEM : Recovered %d inodes and %d blocks from the DAX device\n", fs_vfs->dax_recovered_inodes, fs_vfs->dax_recovered_blocks);
+	
+	return 0;
+}
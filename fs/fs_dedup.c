@@ -0,0 +1,110 @@
+#include <linux/jhash.h>
+#include <linux/string.h>
+
+#include "../include/fs_dedup.h"
+
+/*
+Content deduplication
+
+When fs_vfs->dedup_enabled is set every block written through write_to_inode_block() is passed to dedup_block()
+- An all-zero block is replaced by fs_vfs->zero_block
+- A block whose contents match a block already present in fs_vfs->dedup_table is replaced by that block
+- Otherwise the block is added to fs_vfs->dedup_table
+
+Replaced blocks are shared through fs_block.ref_count, write_to_inode_block() copies a shared block before modifying it (copy on write)
+A block is only present in the dedup table while nobody is writing to it, writers call dedup_unhash_block() before modifying a block
+*/
+
+/*
+Takes a block from the pool which is shared by every all-zero logical block
+The zero block holds one reference of its own so its ref_count never drops to 0 while it is mapped
+*/
+int initialise_dedup(struct fs_vfs * fs_vfs)
+{
+	fs_vfs->zero_block = get_free_block(fs_vfs);
+	if(!fs_vfs->zero_block)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Unable to allocate zero block\n");
+		return -FS_ENO_FREE_BLOCK;
+	}
+	
+	memset((void *)fs_vfs->zero_block->block_addr, 0, FS_BLOCK_SIZE);
+	
+	return 0;
+}
+
+void destroy_dedup(struct fs_vfs * fs_vfs)
+{
+	if(!fs_vfs->zero_block)
+		return;
+	
+	fs_block_put(fs_vfs, fs_vfs->zero_block);
+	fs_vfs->zero_block = NULL;
+}
+
+static inline u32 dedup_hash(struct fs_block * block)
+{
+	return jhash2((u32 *)block->block_addr, FS_BLOCK_SIZE/sizeof(u32), 0);
+}
+
+/*
+Removes the block from the dedup table, has to be called before the contents of the block are modified
+*/
+void dedup_unhash_block(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	mutex_lock(&fs_vfs->dedup_lock);
+	if(!hlist_unhashed(&block->dedup_node))
+		hash_del(&block->dedup_node);
+	mutex_unlock(&fs_vfs->dedup_lock);
+}
+
+/*
+Returns the block which has to be mapped in place of the given block
+Parameters:-
+struct fs_block * block :- block which has just been written, the caller has to hold its only reference
+
+If an identical block is found the reference to the given block is dropped and a reference to the identical block is returned
+*/
+struct fs_block * dedup_block(struct fs_vfs * fs_vfs, struct fs_block * block)
+{
+	void * addr = (void *)block->block_addr;
+	struct fs_block * candidate;
+	
+	if(!memchr_inv(addr, 0, FS_BLOCK_SIZE))
+	{
+		fs_block_get(fs_vfs, fs_vfs->zero_block);
+		fs_block_put(fs_vfs, block);
+		atomic64_inc(&fs_vfs->zero_block_hits);
+		return fs_vfs->zero_block;
+	}
+	
+	u32 hash = dedup_hash(block);
+	
+	mutex_lock(&fs_vfs->dedup_lock);
+	
+	hash_for_each_possible(fs_vfs->dedup_table, candidate, dedup_node, hash)
+	{
+		if(candidate->hash != hash || candidate == block)
+			continue;
+		
+		if(memcmp((void *)candidate->block_addr, addr, FS_BLOCK_SIZE))
+			continue;
+		
+		//A candidate whose last reference is being dropped cannot be shared
+		if(!fs_block_tryget(fs_vfs, candidate))
+			continue;
+		
+		mutex_unlock(&fs_vfs->dedup_lock);
+		
+		fs_block_put(fs_vfs, block);
+		atomic64_inc(&fs_vfs->dedup_hits);
+		return candidate;
+	}
+	
+	block->hash = hash;
+	hash_add(fs_vfs->dedup_table, &block->dedup_node, hash);
+	
+	mutex_unlock(&fs_vfs->dedup_lock);
+	
+	return block;
+}
@@ -0,0 +1,216 @@
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+
+#include "../include/fs_defrag.h"
+#include "../include/fs_dedup.h"
+#include "../include/fs_copy.h"
+#include "../include/fs_dax.h"
+
+/*
+Defragmentation
+
+New blocks are allocated next to the previous block of the file when that block is still free (see get_free_block_near())
+After some churn the free blocks are scattered, the defrag thread then
+1. sorts the free chain so that new allocations are handed out in ascending contiguous runs (rebuild_free_chain())
+2. migrates every fragmented file into a contiguous run of free blocks (defrag_inode())
+It runs at the lowest priority every FS_DEFRAG_INTERVAL_MS
+*/
+
+/*
+Returns the number of runs of physically contiguous blocks mapped by the inode
+Logical blocks mapped to the shared zero block (see fs/fs_dedup.c) are holes, they neither start nor break a run
+Note :- This function has to be called while holding the inode mutex
+*/
+int inode_extents(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	int extents = 0;
+	int prev_block_num = -2;
+	
+	for(int i = 0; i < inode_num_blocks(inode); i++)
+	{
+		struct fs_block * block = inode_block(fs_vfs, inode, i);
+		if(block == fs_vfs->zero_block)
+			continue;
+		
+		int block_num = block->block_num;
+		if(block_num != prev_block_num + 1)
+			extents += 1;
+		prev_block_num = block_num;
+	}
+	
+	return extents;
+}
+
+/*
+Returns the fragmentation counts of the allocated inodes
+Counting walks every mapped block of every file, so the counts are cached and recomputed at most once every FS_FRAG_STATS_INTERVAL_MS
+*/
+void get_frag_stats(struct fs_vfs * fs_vfs, struct fs_frag_stats * stats)
+{
+	mutex_lock(&fs_vfs->frag_stats_lock);
+	
+	if(!fs_vfs->frag_stats_time || time_after(jiffies, fs_vfs->frag_stats_time + msecs_to_jiffies(FS_FRAG_STATS_INTERVAL_MS)))
+	{
+		fs_vfs->frag_mapped_blocks = 0;
+		fs_vfs->frag_extents = 0;
+		fs_vfs->frag_fragmented_files = 0;
+		
+		for(int i = 0; i < FS_NUM_INODES; i++)
+		{
+			struct fs_inode * inode = fs_vfs->inode_table[i];
+			if(!inode->allocated)
+				continue;
+			
+			mutex_lock(&inode->inode_mutex);
+			int extents = inode_extents(fs_vfs, inode);
+			fs_vfs->frag_mapped_blocks += inode_num_blocks(inode);
+			mutex_unlock(&inode->inode_mutex);
+			
+			fs_vfs->frag_extents += extents;
+			if(extents > 1)
+				fs_vfs->frag_fragmented_files += 1;
+			
+			cond_resched();
+		}
+		
+		fs_vfs->frag_stats_time = jiffies;
+	}
+	
+	stats->mapped_blocks = fs_vfs->frag_mapped_blocks;
+	stats->extents = fs_vfs->frag_extents;
+	stats->fragmented_files = fs_vfs->frag_fragmented_files;
+	
+	mutex_unlock(&fs_vfs->frag_stats_lock);
+}
+
+/*
+Moves the blocks of the inode into a contiguous run of free blocks
+Inodes which share blocks with other disk maps are skipped, migrating them would undo the sharing
+Logical blocks mapped to the shared zero block are holes which stay mapped to it, only the other blocks are moved
+The run must leave pool_low_watermark unreserved blocks free so that the defrag thread does not compete with allocations
+The whole file is write range locked, writers copy into the blocks without the inode mutex
+*/
+int defrag_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	int ret = 0;
+	struct fs_block ** blocks = NULL;
+	struct fs_range_lock range;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks(inode, &range, 0, FS_RANGE_LOCK_FULL, true);
+	mutex_lock(&inode->inode_mutex);
+	
+	int num_blocks = inode_num_blocks(inode);
+	if(num_blocks < 2 || inode_extents(fs_vfs, inode) <= 1)
+		goto out;
+	
+	int nr_data = 0;
+	for(int i = 0; i < num_blocks; i++)
+	{
+		struct fs_block * block = inode_block(fs_vfs, inode, i);
+		if(block == fs_vfs->zero_block)
+			continue;
+		
+		if(fs_block_sharers(block) > 1)
+			goto out;
+		nr_data += 1;
+	}
+	
+	if(nr_data > percpu_counter_read_positive(&fs_vfs->unreserved_disk_blocks) - fs_vfs->pool_low_watermark)
+		goto out;
+	
+	blocks = kvmalloc_array(nr_data, sizeof(struct fs_block *), GFP_KERNEL);
+	if(!blocks)
+	{
+		ret = -FS_EMALLOC;
+		goto out;
+	}
+	
+	ret = get_free_run(fs_vfs, inode_home_group(fs_vfs, inode), nr_data, blocks);
+	if(ret)
+		goto out;
+	
+	for(int i = 0, j = 0; i < num_blocks; i++)
+	{
+		struct fs_block * old_block = inode_block(fs_vfs, inode, i);
+		if(old_block == fs_vfs->zero_block)
+			continue;
+		
+		struct fs_block * new_block = blocks[j++];
+		
+		//The file is cold, its data does not need to stay in the cache
+		copy_block_data((void *)new_block->block_addr, (void *)old_block->block_addr, FS_BLOCK_SIZE, FS_COPY_NONTEMPORAL);
+		set_bit(new_block->block_num, fs_vfs->dirty_bitmap);
+		
+		//A crash before the old block is unmapped leaves both blocks recorded at i, recovery keeps one of the identical copies
+		dax_persist(fs_vfs, (void *)new_block->block_addr, FS_BLOCK_SIZE);
+		dax_map_block(fs_vfs, inode, i, new_block);
+		
+		set_inode_block(fs_vfs, inode, i, new_block);
+		fs_block_put(fs_vfs, old_block);
+		
+		if(fs_vfs->dedup_enabled)
+			set_inode_block(fs_vfs, inode, i, dedup_block(fs_vfs, new_block));
+	}
+	
+	atomic64_add(nr_data, &fs_vfs->defrag_migrated_blocks);
+	
+out:
+	mutex_unlock(&inode->inode_mutex);
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	kvfree(blocks);
+	
+	return ret;
+}
+
+static int defrag_thread(void * data)
+{
+	struct fs_vfs * fs_vfs = data;
+	
+	set_user_nice(current, MAX_NICE);
+	
+	while(!kthread_should_stop())
+	{
+		rebuild_free_chain(fs_vfs);
+		
+		for(int i = 0; i < FS_NUM_INODES && !kthread_should_stop(); i++)
+		{
+			struct fs_inode * inode = fs_vfs->inode_table[i];
+			if(!inode->allocated)
+				continue;
+			
+			defrag_inode(fs_vfs, inode);
+			cond_resched();
+		}
+		
+		schedule_timeout_interruptible(msecs_to_jiffies(FS_DEFRAG_INTERVAL_MS));
+	}
+	
+	return 0;
+}
+
+int initialise_defrag(struct fs_vfs * fs_vfs)
+{
+	struct task_struct * task = kthread_run(defrag_thread, fs_vfs, "ramfs_defrag");
+	if(IS_ERR(task))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Error starting the defrag thread\n");
+		return -FS_EMALLOC;
+	}
+	
+	fs_vfs->defrag_task = task;
+	printk("FILE_SYSTEM : Started the defrag thread\n");
+	
+	return 0;
+}
+
+void destroy_defrag(struct fs_vfs * fs_vfs)
+{
+	if(!fs_vfs->defrag_task)
+		return;
+	
+	kthread_stop(fs_vfs->defrag_task);
+	fs_vfs->defrag_task = NULL;
+}
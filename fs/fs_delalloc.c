@@ -0,0 +1,348 @@
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+
+#include "../include/fs_delalloc.h"
+#include "../include/fs_copy.h"
+
+/*
+Delayed allocation
+
+An append which starts right at the end of the file and past the last mapped block is copied into a per inode buffer instead of pool blocks
+Only a reservation of free blocks is taken for the buffered data (see reserve_disk_blocks()), so the append cannot fail later for lack of space
+The buffer is flushed when it is full, when the file is synced (flush_inode_delalloc()), before any other access to the buffered blocks and by a
+worker once the oldest buffered data is FS_DELALLOC_FLUSH_MS old
+A flush allocates all the blocks of the buffer in one batch which is physically contiguous whenever the free chain allows it
+
+The buffered data belongs to the logical blocks past the end of the disk map, it is protected like these blocks would be:
+writers append to it under a write range lock which reaches FS_RANGE_LOCK_FULL (see lock_inode_blocks_tail()), a flush needs a range lock
+over the same blocks and takes the inode mutex to map the new blocks
+The lockless readers flush the buffer first when there is one, buffered data is never read from the buffer itself
+
+Delayed allocation is not used on a DAX device where every write is persisted before it returns
+*/
+
+static void queue_delalloc_flush(struct fs_vfs * fs_vfs)
+{
+	struct kthread_worker * worker = READ_ONCE(fs_vfs->delalloc_worker);
+	
+	if(worker)
+		kthread_queue_delayed_work(worker, &fs_vfs->delalloc_work, msecs_to_jiffies(FS_DELALLOC_FLUSH_MS));
+}
+
+/*
+Returns true if a write of count bytes at pos is buffered, the write has to start at the end of the file right after the data already buffered
+A write of a whole buffer or more goes straight to the pool blocks when nothing is buffered yet, buffering it would only add a copy
+The buffer of the inode is allocated here, the write is not buffered if that fails
+Note :- This function has to be called while holding a write range lock taken with lock_inode_blocks_tail() which reaches the end of the file
+*/
+bool delalloc_can_append(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t pos, size_t count)
+{
+	if(!fs_vfs->delalloc_blocks)
+		return false;
+	
+	if(pos != READ_ONCE(inode->file_size) || pos != (loff_t)inode_num_blocks(inode) * FS_BLOCK_SIZE + inode->delalloc_len)
+		return false;
+	
+	if(!inode->delalloc_len && count >= (size_t)fs_vfs->delalloc_blocks * FS_BLOCK_SIZE)
+		return false;
+	
+	if(!inode->delalloc_buf)
+	{
+		inode->delalloc_buf = kvmalloc((size_t)fs_vfs->delalloc_blocks * FS_BLOCK_SIZE, GFP_KERNEL);
+		if(!inode->delalloc_buf)
+			return false;
+	}
+	
+	return true;
+}
+
+/*
+Allocates the blocks for the buffered data of the inode in one batch and maps them after the last block of the inode
+The tail of a partially filled last block is zeroed, later appends write it in place
+An emptied buffer is freed unless keep_buf is set, so idle files do not keep fs_vfs->delalloc_blocks blocks of memory each
+Note :- Same locking as flush_inode_delalloc_locked()
+*/
+static int flush_delalloc_buf(struct fs_vfs * fs_vfs, struct fs_inode * inode, bool keep_buf)
+{
+	struct fs_block ** blocks = NULL;
+	int ret = 0;
+	
+	if(!READ_ONCE(inode->delalloc_len) && !READ_ONCE(inode->delalloc_buf))
+		return 0;
+	
+	mutex_lock(&inode->inode_mutex);
+	
+	//Another holder of a read range lock flushed the buffer first
+	int len = inode->delalloc_len;
+	if(!len)
+		goto out;
+	
+	int nr_blocks = DIV_ROUND_UP(len, FS_BLOCK_SIZE);
+	blocks = kmalloc_array(nr_blocks, sizeof(struct fs_block *), GFP_KERNEL);
+	if(!blocks)
+	{
+		ret = -FS_EMALLOC;
+		goto out;
+	}
+	
+	int first = inode_num_blocks(inode);
+	ret = get_reserved_blocks(fs_vfs, inode_home_group(fs_vfs, inode), inode_goal_block(fs_vfs, inode, first), nr_blocks, blocks);
+	if(ret)
+		goto out;
+	
+	//The rest of the reservation covers the indirect tables of the new blocks, append_block_to_inode() takes them from inode->table_reserved
+	int nr_tables = disk_map_tables(first + nr_blocks) - disk_map_tables(first);
+	inode->table_reserved = nr_tables;
+	
+	int mapped;
+	for(mapped = 0; mapped < nr_blocks; mapped++)
+	{
+		void * dest_addr = (void *)blocks[mapped]->block_addr;
+		int size = min(len - mapped * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+		
+		copy_block_data(dest_addr, inode->delalloc_buf + mapped * FS_BLOCK_SIZE, size, inode_write_copy_mode(fs_vfs, inode, first + mapped, size));
+		if(size != FS_BLOCK_SIZE)
+			memset(dest_addr + size, 0, FS_BLOCK_SIZE - size);
+		
+		ret = append_block_to_inode(fs_vfs, inode, blocks[mapped]);
+		if(ret)
+			break;
+		
+		finish_inode_block_write(fs_vfs, inode, first + mapped);
+	}
+	
+	//The blocks which could not be mapped go back to the free chains, their data stays buffered and reserved
+	put_reserved_blocks(fs_vfs, blocks + mapped, nr_blocks - mapped);
+	
+	int flushed = min(mapped * FS_BLOCK_SIZE, len);
+	if(flushed < len)
+		memmove(inode->delalloc_buf, inode->delalloc_buf + flushed, len - flushed);
+	inode->delalloc_len = len - flushed;
+	inode->delalloc_reserved -= mapped + nr_tables - inode->table_reserved;
+	inode->table_reserved = 0;
+	
+	atomic64_inc(&fs_vfs->delalloc_flushes);
+	atomic64_add(mapped, &fs_vfs->delalloc_flushed_blocks);
+	
+out:
+	if(!inode->delalloc_len && !keep_buf)
+	{
+		kvfree(inode->delalloc_buf);
+		inode->delalloc_buf = NULL;
+	}
+	mutex_unlock(&inode->inode_mutex);
+	kfree(blocks);
+	
+	return ret;
+}
+
+/*
+Flushes the buffered data of the inode and frees the buffer once it is empty, see flush_delalloc_buf()
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem and a range lock of the inode which reaches from the end of the disk map
+to FS_RANGE_LOCK_FULL (see lock_inode_blocks_tail()), or fs_vfs->snapshot_rwsem for writing. It takes the inode mutex
+*/
+int flush_inode_delalloc_locked(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	return flush_delalloc_buf(fs_vfs, inode, false);
+}
+
+/*
+Appends the iov_iter to the buffered data of the inode at *pos, a free block is reserved for every block the buffer grows into and for every indirect table those blocks need
+The buffer is flushed whenever it fills up
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read) and a write range lock taken with lock_inode_blocks_tail()
+which reaches the end of the file, delalloc_can_append() has to be true for *pos
+Returns the number of bytes written and advances *pos
+*/
+ssize_t append_delalloc_iter(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct iov_iter * from)
+{
+	int capacity = fs_vfs->delalloc_blocks * FS_BLOCK_SIZE;
+	ssize_t done = 0;
+	int ret = 0;
+	
+	while(iov_iter_count(from))
+	{
+		//The rest of the append refills the buffer right away
+		if(inode->delalloc_len == capacity)
+		{
+			ret = flush_delalloc_buf(fs_vfs, inode, true);
+			if(ret)
+				break;
+		}
+		
+		int len = inode->delalloc_len;
+		size_t size = min_t(size_t, capacity - len, iov_iter_count(from));
+		int num_blocks = READ_ONCE(inode->disk_map.num_blocks);
+		int nr_blocks = DIV_ROUND_UP(len + (int)size, FS_BLOCK_SIZE);
+		
+		//The indirect tables which the buffered blocks will need once they are mapped are reserved with them
+		int needed = nr_blocks + disk_map_tables(num_blocks + nr_blocks) - disk_map_tables(num_blocks) - inode->delalloc_reserved;
+		
+		if(needed > 0)
+		{
+			ret = reserve_disk_blocks(fs_vfs, needed);
+			if(ret)
+				break;
+		}
+		
+		//The range lock keeps the flushers out, the copy does not need the inode mutex
+		size_t copied = copy_from_iter(inode->delalloc_buf + len, size, from);
+		
+		mutex_lock(&inode->inode_mutex);
+		if(needed > 0)
+			inode->delalloc_reserved += needed;
+		if(!len)
+			inode->delalloc_time = jiffies;
+		inode->delalloc_len = len + copied;
+		*pos += copied;
+		smp_store_release(&inode->file_size, *pos);
+		mutex_unlock(&inode->inode_mutex);
+		
+		if(!len && copied)
+			queue_delalloc_flush(fs_vfs);
+		
+		done += copied;
+		if(copied != size)
+		{
+			ret = -FS_EADDR;
+			break;
+		}
+	}
+	
+	if(!ret && inode->delalloc_len == capacity)
+		ret = flush_inode_delalloc_locked(fs_vfs, inode);
+	
+	atomic64_inc(&fs_vfs->delalloc_buffered_writes);
+	
+	return done ? done : ret;
+}
+
+/*
+Flushes the buffered data of the inode to pool blocks, this is the fsync and close path of the inode
+Returns 0 when nothing is buffered
+*/
+int flush_inode_delalloc(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	struct fs_range_lock range;
+	
+	if(!READ_ONCE(inode->delalloc_len))
+		return 0;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks_tail(fs_vfs, inode, &range, FS_RANGE_LOCK_FULL, FS_RANGE_LOCK_FULL, true);
+	
+	int ret = flush_inode_delalloc_locked(fs_vfs, inode);
+	
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return ret;
+}
+
+/*
+Flushes the buffered data of every inode
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem for writing, no writer holds a range lock then
+*/
+int flush_delalloc_inodes_locked(struct fs_vfs * fs_vfs)
+{
+	int ret = 0;
+	
+	for(int i = 0; i < FS_NUM_INODES && !ret; i++)
+	{
+		ret = flush_inode_delalloc_locked(fs_vfs, fs_vfs->inode_table[i]);
+	}
+	
+	return ret;
+}
+
+/*
+Drops the buffered data of the inode and its reservation
+Note :- This function has to be called while holding a write range lock over the whole inode and the inode mutex
+*/
+void discard_inode_delalloc(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	unreserve_disk_blocks(fs_vfs, inode->delalloc_reserved);
+	inode->delalloc_reserved = 0;
+	inode->delalloc_len = 0;
+	
+	kvfree(inode->delalloc_buf);
+	inode->delalloc_buf = NULL;
+}
+
+static void delalloc_work(struct kthread_work * work)
+{
+	struct fs_vfs * fs_vfs = container_of(work, struct fs_vfs, delalloc_work.work);
+	unsigned long interval = msecs_to_jiffies(FS_DELALLOC_FLUSH_MS);
+	bool pending = false;
+	
+	for(int i = 0; i < FS_NUM_INODES; i++)
+	{
+		struct fs_inode * inode = fs_vfs->inode_table[i];
+		if(!READ_ONCE(inode->delalloc_len))
+			continue;
+		
+		//Younger buffers and the ones which could not be flushed are looked at again on the next run
+		if(time_before(jiffies, READ_ONCE(inode->delalloc_time) + interval) || flush_inode_delalloc(fs_vfs, inode))
+			pending = true;
+		
+		cond_resched();
+	}
+	
+	if(pending)
+		queue_delalloc_flush(fs_vfs);
+}
+
+/*
+Enables delayed allocation and starts the flush worker
+Parameters:-
+int num_blocks :- size of the per inode buffers in blocks, 0 disables delayed allocation
+*/
+int initialise_delalloc(struct fs_vfs * fs_vfs, int num_blocks)
+{
+	if(num_blocks <= 0)
+		return 0;
+	
+	if(num_blocks > FS_DELALLOC_MAX_BLOCKS)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : delalloc=%d is too large, using %d blocks\n", num_blocks, FS_DELALLOC_MAX_BLOCKS);
+		num_blocks = FS_DELALLOC_MAX_BLOCKS;
+	}
+	
+	struct kthread_worker * worker = kthread_create_worker(0, "ramfs_delalloc");
+	if(IS_ERR(worker))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Error starting the delayed allocation worker\n");
+		return -FS_EMALLOC;
+	}
+	
+	kthread_init_delayed_work(&fs_vfs->delalloc_work, delalloc_work);
+	WRITE_ONCE(fs_vfs->delalloc_worker, worker);
+	fs_vfs->delalloc_blocks = num_blocks;
+	
+	printk("FILE_SYSTEM : Delayed allocation enabled, %d blocks per inode\n", num_blocks);
+	
+	return 0;
+}
+
+/*
+Stops the flush worker and flushes the buffered data of every inode
+*/
+void destroy_delalloc(struct fs_vfs * fs_vfs)
+{
+	struct kthread_worker * worker = fs_vfs->delalloc_worker;
+	if(!worker)
+		return;
+	
+	//The worker does not queue itself again once delalloc_worker is cleared
+	WRITE_ONCE(fs_vfs->delalloc_worker, NULL);
+	kthread_cancel_delayed_work_sync(&fs_vfs->delalloc_work);
+	kthread_destroy_worker(worker);
+	
+	for(int i = 0; i < FS_NUM_INODES; i++)
+	{
+		int ret = flush_inode_delalloc(fs_vfs, fs_vfs->inode_table[i]);
+		if(ret)
+			printk(KERN_ERR "FILE_SYSTEM_ERROR : Flushing the buffered data of inode %d failed:%d\n", i, ret);
+	}
+}
@@ -1,8 +1,13 @@
 #include "../include/fs_inode.h"
+#include "../include/fs_dedup.h"
+#include "../include/fs_copy.h"
+#include "../include/fs_dax.h"
+#include "../include/fs_delalloc.h"
+#include "../include/fs_reclaim.h"
 
 int alloc_inode(struct fs_vfs * fs_vfs)
 {
-	struct fs_inode * inode = kmalloc(sizeof(struct fs_inode), GFP_KERNEL);
+	struct fs_inode * inode = kmem_cache_alloc(fs_vfs->inode_cache, GFP_KERNEL);
 	
 	if(!inode)
 	{
@@ -11,360 +16,1220 @@ int alloc_inode(struct fs_vfs * fs_vfs)
 	}
 	
 	inode->inode_num = fs_vfs->num_free_inodes;
+	fs_vfs->inode_table[inode->inode_num] = inode;
 	inode->ref_count = 0;
 	inode->file_size = 0;
 	inode->file_offset = 0;
+	inode->allocated = false;
+	inode->generation = 0;
+	inode->last_written_block = -1;
+	inode->sequential_writes = 0;
+	inode->delalloc_buf = NULL;
+	inode->delalloc_len = 0;
+	inode->delalloc_reserved = 0;
+	inode->delalloc_time = 0;
+	inode->table_reserved = 0;
 	
 	mutex_init(&inode->inode_mutex);
+	fs_range_lock_tree_init(&inode->range_locks);
 	
 	fs_vfs->num_free_inodes += 1;
 	
-	inode->disk_map = kmalloc(sizeof(struct fs_disk_map), GFP_KERNEL);
-	
-	inode->disk_map->disk_map_flag = 0x0;
+	inode->disk_map.disk_map_flag = 0x0;
 	
 	for(int i = 0; i < 10; i++)
 	{
-		inode->disk_map->blocks[i] = NULL;
+		inode->disk_map.blocks[i] = NULL;
 	}
 	
-	inode->disk_map->direct_pointer_ind = 0;
-	inode->disk_map->single_indirect = NULL;
-	inode->disk_map->double_indirect = NULL;
+	inode->disk_map.direct_pointer_ind = 0;
+	inode->disk_map.num_blocks = 0;
+	inode->disk_map.single_indirect = NULL;
+	inode->disk_map.double_indirect = NULL;
 	
 	list_add_tail(&inode->fs_vfs_inode_list, &fs_vfs->free_inode_list);
 	
 	return 0;
 }
 
-void destroy_inode(struct fs_inode * inode)
+void destroy_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
 {
 	list_del(&inode->fs_vfs_inode_list);
-	kfree(inode->disk_map);
-	kfree(inode);
+	fs_vfs->inode_table[inode->inode_num] = NULL;
+	kvfree(inode->delalloc_buf);
+	kmem_cache_free(fs_vfs->inode_cache, inode);
 }
 
-int intialise_inodes(struct fs_vfs * fs_vfs)
+/*
+Inodes are allocated from a dedicated slab cache, SLAB_HWCACHE_ALIGN keeps the hot fields of an inode in its first cacheline
+*/
+int allocate_inodes(struct fs_vfs * fs_vfs)
 {
 	int ret;
 	printk("FILE_SYSTEM : Initialising inodes\n");
 	
+	fs_vfs->inode_cache = kmem_cache_create("ramfs_inode", sizeof(struct fs_inode), 0, SLAB_HWCACHE_ALIGN, NULL);
+	fs_vfs->inode_table = kvcalloc(FS_NUM_INODES, sizeof(struct fs_inode *), GFP_KERNEL);
+	if(!fs_vfs->inode_cache || !fs_vfs->inode_table)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Error allocating inode table\n");
+		return -FS_EMALLOC;
+	}
+	
 	for(int i = 0; i < FS_NUM_INODES; i++)
 	{
 		ret = alloc_inode(fs_vfs);
 		if(ret)
 			return ret;
 	}
-	printk("FILE_SYSTEM : Initialised %d inodes\n", fs_vfs->num_free_inodes);
+	printk("FILE_SYSTEM : Initialised %d inodes of %u bytes\n", fs_vfs->num_free_inodes, kmem_cache_size(fs_vfs->inode_cache));
 	return 0;
 }
 
+/*
+Drops the disk blocks of every inode and frees the inodes, the allocation groups must still be present
+The disk maps on a DAX device stay intact, only their in-memory copies are freed, their indirect tables go away with the pool
+*/
+void destroy_inodes(struct fs_vfs * fs_vfs)
+{
+	for(int i = 0; i < FS_NUM_INODES && fs_vfs->inode_table; i++)
+	{
+		struct fs_inode * inode = fs_vfs->inode_table[i];
+		if(!inode)
+			continue;
+		
+		if(!fs_dax_enabled(fs_vfs))
+			trim_inode_disk_map(fs_vfs, inode);
+		destroy_inode(fs_vfs, inode);
+	}
+	
+	kvfree(fs_vfs->inode_table);
+	fs_vfs->inode_table = NULL;
+	kmem_cache_destroy(fs_vfs->inode_cache);
+	fs_vfs->inode_cache = NULL;
+}
 
-struct fs_inode * get_inode(struct fs_vfs * fs_vfs)
+
+/*
+Takes the first inode of the free list, returns NULL if there are no free inodes
+Note :- This function has to be called while holding fs_vfs->vfs_lock
+*/
+struct fs_inode * get_inode_locked(struct fs_vfs * fs_vfs)
 {
-	mutex_lock(&fs_vfs->vfs_lock);
 	if(fs_vfs->num_free_inodes == 0)
-	{
-		mutex_unlock(&fs_vfs->vfs_lock);
-		printk(KERN_ERR "FILE_SYSTEM_ERROR : Zero inodes in the system\n");
 		return NULL;
-	}
 	
 	struct fs_inode * inode = list_first_entry(&fs_vfs->free_inode_list, struct fs_inode, fs_vfs_inode_list);
 	
-	list_del(&inode->fs_vfs_inode_list);
-	list_add(&inode->fs_vfs_inode_list, &fs_vfs->allocated_inode_list);
+	list_move(&inode->fs_vfs_inode_list, &fs_vfs->allocated_inode_list);
 	fs_vfs->num_free_inodes -= 1;
+	inode->allocated = true;
+	inode->generation += 1;
+	dax_persist_inode(fs_vfs, inode);
 	
+	return inode;
+}
+
+struct fs_inode * get_inode(struct fs_vfs * fs_vfs)
+{
+	mutex_lock(&fs_vfs->vfs_lock);
+	struct fs_inode * inode = get_inode_locked(fs_vfs);
 	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	if(!inode)
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Zero inodes in the system\n");
+	
 	return inode;
 }
 
-void put_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+/*
+Allocates the inode with the given inode number, used when the inode numbers have to be preserved (e.g., restoring a checkpoint)
+Returns the inode if it is already allocated
+*/
+struct fs_inode * get_inode_num(struct fs_vfs * fs_vfs, int inode_num)
 {
+	if(inode_num < 0 || inode_num >= FS_NUM_INODES)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Wrong inode number %d in get_inode_num()\n", inode_num);
+		return NULL;
+	}
+	
+	struct fs_inode * inode = fs_vfs->inode_table[inode_num];
+	
 	mutex_lock(&fs_vfs->vfs_lock);
-	list_del(&inode->fs_vfs_inode_list);
-	list_add(&inode->fs_vfs_inode_list, &fs_vfs->free_inode_list);
+	if(!inode->allocated)
+	{
+		list_del(&inode->fs_vfs_inode_list);
+		list_add(&inode->fs_vfs_inode_list, &fs_vfs->allocated_inode_list);
+		fs_vfs->num_free_inodes -= 1;
+		inode->allocated = true;
+		inode->generation += 1;
+		dax_persist_inode(fs_vfs, inode);
+	}
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	return inode;
+}
+
+/*
+Returns the inode to the free list, the inode may be on any list (e.g., a private list of inodes being freed)
+Note :- This function has to be called while holding fs_vfs->vfs_lock
+*/
+void put_inode_locked(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	list_move(&inode->fs_vfs_inode_list, &fs_vfs->free_inode_list);
 	fs_vfs->num_free_inodes += 1;
+	inode->allocated = false;
+	dax_persist_inode(fs_vfs, inode);
+}
+
+void put_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	mutex_lock(&fs_vfs->vfs_lock);
+	put_inode_locked(fs_vfs, inode);
 	mutex_unlock(&fs_vfs->vfs_lock);
 }
 
 
 
-struct fs_single_indirect_block * allocate_fs_single_indirect_block(void)
+/*
+Indirect tables
+A table is a pool block holding FS_INDIRECT_ENTRIES block numbers, the 1 level table maps the logical blocks 10 onwards
+and entry i of the 2 level table holds the 1 level table of the logical blocks 10 + FS_INDIRECT_ENTRIES * (i + 1) onwards
+*/
+
+static inline u32 * table_entries(struct fs_block * table)
 {
-	struct fs_single_indirect_block * single_indirect = kmalloc(sizeof(struct fs_single_indirect_block), GFP_KERNEL);
-	if(!single_indirect)
-		return NULL;
+	return (u32 *)table->block_addr;
+}
+
+/*
+Returns the number of indirect tables a disk map of num_blocks logical blocks holds
+*/
+int disk_map_tables(int num_blocks)
+{
+	if(num_blocks <= 10)
+		return 0;
 	
-	single_indirect->pointer_ind = 0;
+	if(num_blocks <= 10 + FS_INDIRECT_ENTRIES)
+		return 1;
+	
+	return 2 + DIV_ROUND_UP(num_blocks - 10 - FS_INDIRECT_ENTRIES, FS_INDIRECT_ENTRIES);
+}
+
+/*
+Returns a pool block for an indirect table of the inode with every entry set to FS_NO_BLOCK, NULL if the pool is empty
+The block is taken out of inode->table_reserved while the caller holds a reservation for the tables (see reserve_disk_blocks())
+Note :- This function has to be called while holding the inode mutex
+*/
+static struct fs_block * alloc_table_block(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	struct fs_block * table = NULL;
 	
-	for(int i = 0; i < 256; i++)
+	if(inode->table_reserved)
+	{
+		if(!get_reserved_blocks(fs_vfs, inode_home_group(fs_vfs, inode), -1, 1, &table))
+			inode->table_reserved -= 1;
+	}
+	else
 	{
-		single_indirect->blocks[i] = NULL;
+		table = get_free_block_near(fs_vfs, inode_home_group(fs_vfs, inode), -1);
 	}
 	
-	return single_indirect;
+	if(!table)
+		return NULL;
+	
+	memset((void *)table->block_addr, 0xff, FS_BLOCK_SIZE);
+	atomic64_inc(&fs_vfs->table_blocks);
+	
+	return table;
 }
 
-inline void destroy_fs_single_indirect_block(struct fs_single_indirect_block * single_indirect)
+/*
+Returns an indirect table to the pool once the lockless readers which may still walk it are done
+*/
+static void put_table_block(struct fs_vfs * fs_vfs, struct fs_block * table)
 {
-	if(single_indirect)
-		kfree(single_indirect);
-	else
-		printk(KERN_ERR"FILE_SYSTEM_ERROR : destroy_fs_single_indirect_block passed NULL");
+	atomic64_dec(&fs_vfs->table_blocks);
+	retire_table_block(fs_vfs, table);
 }
 
+/*
+Returns the table entry of the logical block block_ind of the disk map, block_ind has to be 10 or above and its tables have to be present
+Note :- This function has to be called while holding the inode mutex
+*/
+static u32 * disk_map_table_entry(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map, int block_ind)
+{
+	block_ind -= 10;
+	
+	if(block_ind < FS_INDIRECT_ENTRIES)
+		return &table_entries(disk_map->single_indirect)[block_ind];
+	
+	block_ind -= FS_INDIRECT_ENTRIES;
+	
+	struct fs_block * table = num_to_disk_block(fs_vfs, table_entries(disk_map->double_indirect)[block_ind / FS_INDIRECT_ENTRIES]);
+	
+	return &table_entries(table)[block_ind % FS_INDIRECT_ENTRIES];
+}
 
-struct fs_double_indirect_block * allocate_fs_double_indirect_block(void)
+/*
+Returns the block at the logical block block_ind of the disk map without checking it against num_blocks
+Note :- This function has to be called while holding the inode mutex or on a detached disk map
+*/
+static struct fs_block * disk_map_block(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map, int block_ind)
 {
-	struct fs_double_indirect_block * double_indirect = kmalloc(sizeof(struct fs_double_indirect_block), GFP_KERNEL);
-	if(!double_indirect)
-		return NULL;
+	if(block_ind < 10)
+		return disk_map->blocks[block_ind];
+	
+	return num_to_disk_block(fs_vfs, *disk_map_table_entry(fs_vfs, disk_map, block_ind));
+}
+
+/*
+Returns to the pool the indirect tables which a disk map of old_num_blocks logical blocks no longer needs once it maps num_blocks logical blocks
+Note :- This function has to be called while holding the inode mutex or on a detached disk map
+*/
+static void put_unused_tables(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map, int old_num_blocks, int num_blocks)
+{
+	int old_tables = DIV_ROUND_UP(max(old_num_blocks - 10 - FS_INDIRECT_ENTRIES, 0), FS_INDIRECT_ENTRIES);
+	int tables = DIV_ROUND_UP(max(num_blocks - 10 - FS_INDIRECT_ENTRIES, 0), FS_INDIRECT_ENTRIES);
 	
-	double_indirect->pointer_ind = 0;
+	for(int i = tables; i < old_tables; i++)
+	{
+		u32 * entry = &table_entries(disk_map->double_indirect)[i];
+		struct fs_block * table = num_to_disk_block(fs_vfs, *entry);
+		
+		WRITE_ONCE(*entry, FS_NO_BLOCK);
+		put_table_block(fs_vfs, table);
+	}
 	
-	for(int i = 0; i < 256; i++)
+	if(old_tables && !tables)
 	{
-		double_indirect->blocks[i] = NULL;
+		struct fs_block * table = disk_map->double_indirect;
+		WRITE_ONCE(disk_map->double_indirect, NULL);
+		put_table_block(fs_vfs, table);
 	}
 	
-	return double_indirect;
+	if(old_num_blocks > 10 && num_blocks <= 10)
+	{
+		struct fs_block * table = disk_map->single_indirect;
+		WRITE_ONCE(disk_map->single_indirect, NULL);
+		put_table_block(fs_vfs, table);
+	}
 }
 
-inline void destroy_fs_double_indirect_block(struct fs_double_indirect_block * double_indirect)
+/*
+Sets the direct pointer count and the completion flags of a disk map which maps num_blocks logical blocks
+*/
+static void set_disk_map_counters(struct fs_disk_map * disk_map, int num_blocks)
 {
-	if(double_indirect)
-		kfree(double_indirect);
-	else
-		printk(KERN_ERR"FILE_SYSTEM_ERROR : destroy_fs_single_indirect_block passed NULL");
+	disk_map->direct_pointer_ind = min(num_blocks, 10);
+	disk_map->disk_map_flag = 0x0;
+	if(num_blocks >= 10)
+		disk_map->disk_map_flag |= 0x01;
+	if(num_blocks >= 10 + FS_INDIRECT_ENTRIES)
+		disk_map->disk_map_flag |= 0x02;
 }
 
 
+/*
+Returns the block number following the physical block of the logical block block_ind - 1 of the inode, -1 if there is none
+Used as allocation goal so that consecutive logical blocks stay physically contiguous
+Note :- This function has to be called while holding the inode mutex
+*/
+int inode_goal_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind)
+{
+	struct fs_block * block = inode_block(fs_vfs, inode, block_ind - 1);
+	
+	return block ? block->block_num + 1 : -1;
+}
 
-int alloc_disk_to_inode(struct fs_vfs *fs_vfs, struct fs_inode *inode)
+/*
+Returns a block for a newly allocated logical block of an inode
+In dedup mode new logical blocks map the shared zero block and consume a pool block only when they are first written
+bool zeroed :- the block has to read back as zeros, it is taken from the pre-zeroed pool when possible (see fs/fs_zero.c)
+Note :- This function has to be called while holding the inode mutex
+*/
+static struct fs_block * get_new_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, bool zeroed)
 {
-	mutex_lock(&inode->inode_mutex);
+	if(fs_vfs->dedup_enabled)
+	{
+		fs_block_get(fs_vfs, fs_vfs->zero_block);
+		atomic64_inc(&fs_vfs->zero_block_hits);
+		return fs_vfs->zero_block;
+	}
+	
+	int group_num = inode_home_group(fs_vfs, inode);
+	int goal = inode_goal_block(fs_vfs, inode, inode->disk_map.num_blocks);
+	
+	if(zeroed)
+		return get_zeroed_block(fs_vfs, group_num, goal);
+	
+	return get_free_block_near(fs_vfs, group_num, goal);
+}
+
+/*
+Appends the block to the end of the disk map of the inode
+The indirect tables are allocated from the pool when the block is the first one they map
+In DAX mode the block is recorded in the reverse map of the device first (see fs/fs_dax.c)
+Note :- This function has to be called while holding the inode mutex
+*/
+int append_block_to_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_block * block)
+{
+	struct fs_disk_map * disk_map = &inode->disk_map;
+	int block_ind = disk_map->num_blocks;
 	
-	struct fs_disk_map * disk_map = inode->disk_map;
+	if(block_ind >= FS_MAX_INODE_BLOCKS)
+	{
+		disk_map->disk_map_flag |= 0x04;
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Cannot allocate more memory to the inode. MAX LIMIT reached\n");
+		return -FS_E_MAX_LIMIT;
+	}
 	
-	if( !(disk_map->disk_map_flag & 0x01) )
+	if(block_ind == 10)
 	{
-		struct fs_block * block = get_free_block(fs_vfs);
-		if(!block)
-		{
-			mutex_unlock(&inode->inode_mutex);
+		struct fs_block * table = alloc_table_block(fs_vfs, inode);
+		if(!table)
 			return -FS_ENO_FREE_BLOCK;
-		}
+		rcu_assign_pointer(disk_map->single_indirect, table);
+	}
+	else if(block_ind >= 10 + FS_INDIRECT_ENTRIES && (block_ind - 10) % FS_INDIRECT_ENTRIES == 0)
+	{
+		int table_ind = (block_ind - 10) / FS_INDIRECT_ENTRIES - 1;
 		
-		disk_map->blocks[inode->disk_map->direct_pointer_ind] = block;
-		disk_map->direct_pointer_ind += 1;
-		if(disk_map->direct_pointer_ind == 10)
+		if(!table_ind)
 		{
-			disk_map->disk_map_flag = disk_map->disk_map_flag | 0x01;
+			struct fs_block * table = alloc_table_block(fs_vfs, inode);
+			if(!table)
+				return -FS_ENO_FREE_BLOCK;
+			rcu_assign_pointer(disk_map->double_indirect, table);
 		}
-	}
-	else if( !(disk_map->disk_map_flag & 0x02) )
-	{
-		if(!disk_map->single_indirect)
+		
+		struct fs_block * table = alloc_table_block(fs_vfs, inode);
+		if(!table)
 		{
-			disk_map->single_indirect = allocate_fs_single_indirect_block();
-			if(!disk_map->single_indirect)
+			if(!table_ind)
 			{
-				mutex_unlock(&inode->inode_mutex);
-				return -FS_EMALLOC;
+				table = disk_map->double_indirect;
+				WRITE_ONCE(disk_map->double_indirect, NULL);
+				put_table_block(fs_vfs, table);
 			}
+			return -FS_ENO_FREE_BLOCK;
 		}
-		
-		struct fs_block * block = get_free_block(fs_vfs);
+		smp_store_release(&table_entries(disk_map->double_indirect)[table_ind], (u32)table->block_num);
+	}
+	
+	dax_map_block(fs_vfs, inode, block_ind, block);
+	
+	//An incremental checkpoint has to save the block, the previous checkpoint may hold other data at its block number
+	set_bit(block->block_num, fs_vfs->dirty_bitmap);
+	
+	if(block_ind < 10)
+		rcu_assign_pointer(disk_map->blocks[block_ind], block);
+	else
+		smp_store_release(disk_map_table_entry(fs_vfs, disk_map, block_ind), (u32)block->block_num);
+	
+	set_disk_map_counters(disk_map, block_ind + 1);
+	
+	//Readers bound their lookups by num_blocks, the entry has to be visible first
+	smp_store_release(&disk_map->num_blocks, block_ind + 1);
+	
+	return 0;
+}
+
+/*
+Appends new blocks to the inode until it maps num_blocks logical blocks
+The new blocks are zeroed so that holes and the unwritten parts of partially written blocks read back as zeros
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read) and the inode mutex
+*/
+int extend_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode, int num_blocks)
+{
+	while(inode->disk_map.num_blocks < num_blocks)
+	{
+		struct fs_block * block = get_new_inode_block(fs_vfs, inode, true);
 		if(!block)
-		{
-			mutex_unlock(&inode->inode_mutex);
 			return -FS_ENO_FREE_BLOCK;
-		}
 		
-		disk_map->single_indirect->blocks[disk_map->single_indirect->pointer_ind] = block;
-		disk_map->single_indirect->pointer_ind += 1;
-		if(disk_map->single_indirect->pointer_ind == 256)
+		int ret = append_block_to_inode(fs_vfs, inode, block);
+		if(ret)
 		{
-			disk_map->disk_map_flag = disk_map->disk_map_flag | 0x02;
+			fs_block_put(fs_vfs, block);
+			return ret;
 		}
 	}
-	else if( !(disk_map->disk_map_flag & 0x04) )
+	
+	return 0;
+}
+
+/*
+Appends a new zeroed block to the inode, the buffered appends of the inode are flushed first so that they keep their place in the file
+The block lies past the end of the file until it is written, a later truncate_inode() exposes it without clearing it
+*/
+int alloc_disk_to_inode(struct fs_vfs *fs_vfs, struct fs_inode *inode)
+{
+	struct fs_range_lock range;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks_tail(fs_vfs, inode, &range, FS_RANGE_LOCK_FULL, FS_RANGE_LOCK_FULL, true);
+	
+	int ret = flush_inode_delalloc_locked(fs_vfs, inode);
+	if(ret)
+		goto out;
+	
+	mutex_lock(&inode->inode_mutex);
+	
+	struct fs_block * block = get_new_inode_block(fs_vfs, inode, true);
+	if(!block)
 	{
-		if(!disk_map->double_indirect)
-		{
-			disk_map->double_indirect = allocate_fs_double_indirect_block();
-			if(!disk_map->double_indirect)
-			{
-				mutex_unlock(&inode->inode_mutex);
-				return -FS_EMALLOC;
-			}
-		}
+		ret = -FS_ENO_FREE_BLOCK;
+	}
+	else
+	{
+		ret = append_block_to_inode(fs_vfs, inode, block);
+		if(ret)
+			fs_block_put(fs_vfs, block);
+	}
+	
+	mutex_unlock(&inode->inode_mutex);
+	
+out:
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return ret;
+}
+
+/*
+Appends an existing block to the end of the disk map of the inode, the inode takes its own reference to the block
+The buffered appends of the inode are flushed first
+*/
+int attach_block_to_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_block * block)
+{
+	struct fs_range_lock range;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks_tail(fs_vfs, inode, &range, FS_RANGE_LOCK_FULL, FS_RANGE_LOCK_FULL, true);
+	
+	int ret = flush_inode_delalloc_locked(fs_vfs, inode);
+	if(!ret)
+	{
+		mutex_lock(&inode->inode_mutex);
 		
-		struct fs_double_indirect_block * double_indirect = disk_map->double_indirect;
+		fs_block_get(fs_vfs, block);
+		ret = append_block_to_inode(fs_vfs, inode, block);
+		if(ret)
+			fs_block_put(fs_vfs, block);
 		
-		if(!double_indirect->blocks[double_indirect->pointer_ind])
-		{
-			double_indirect->blocks[double_indirect->pointer_ind] = allocate_fs_single_indirect_block();
-			
-			if(!double_indirect->blocks[double_indirect->pointer_ind])
-			{
-				mutex_unlock(&inode->inode_mutex);
-				return -FS_EMALLOC;
-			}
-		}
+		mutex_unlock(&inode->inode_mutex);
+	}
+	
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return ret;
+}
+
+/*
+Locks the logical blocks [first_block, last_block] of the inode, FS_RANGE_LOCK_FULL as last_block locks the whole file
+A write lock keeps the blocks private to the caller, they can be written without the inode mutex once get_writable_inode_block() has returned them
+Note :- This function has to be called after taking fs_vfs->snapshot_rwsem and before taking the inode mutex
+*/
+void lock_inode_blocks(struct fs_inode * inode, struct fs_range_lock * lock, u64 first_block, u64 last_block, bool write)
+{
+	fs_range_lock_init(lock, first_block, last_block);
+	
+	if(write)
+		fs_range_write_lock(&inode->range_locks, lock);
+	else
+		fs_range_read_lock(&inode->range_locks, lock);
+}
+
+void unlock_inode_blocks(struct fs_inode * inode, struct fs_range_lock * lock)
+{
+	fs_range_unlock(&inode->range_locks, lock);
+}
+
+/*
+Same as lock_inode_blocks() for a range which may reach past the last mapped block of the inode
+While delayed allocation is enabled the blocks past the end of the disk map belong to the buffered appends (see fs/fs_delalloc.c),
+a range reaching them is extended to [min(first_block, end of the disk map), FS_RANGE_LOCK_FULL] so that its holder may flush or append to the buffer
+Returns true if the range was extended
+Note :- same as lock_inode_blocks()
+*/
+bool lock_inode_blocks_tail(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_range_lock * lock, u64 first_block, u64 last_block, bool write)
+{
+	if(!fs_vfs->delalloc_blocks)
+	{
+		lock_inode_blocks(inode, lock, first_block, last_block, write);
+		return false;
+	}
+	
+	for(;;)
+	{
+		//The end of the disk map only moves under a range reaching FS_RANGE_LOCK_FULL, so it is stable once such a range is held
+		u64 end = smp_load_acquire(&inode->disk_map.num_blocks);
+		bool tail = last_block >= end;
+		u64 start = tail ? min(first_block, end) : first_block;
+		
+		lock_inode_blocks(inode, lock, start, tail ? FS_RANGE_LOCK_FULL : last_block, write);
+		
+		//The disk map has been trimmed in the meantime
+		end = inode_num_blocks(inode);
+		if(tail ? start <= end : last_block < end)
+			return tail;
 		
-		if(double_indirect->blocks[double_indirect->pointer_ind]->pointer_ind == 256)
+		unlock_inode_blocks(inode, lock);
+	}
+}
+
+/*
+Drops the references to the disk blocks of a disk map which no inode publishes any more and returns its indirect tables to the pool
+The tables are returned after an RCU grace period, lockless readers which found them before the map was detached may still walk them
+*/
+void free_disk_map(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map)
+{
+	for(int i = 0; i < disk_map->num_blocks; i++)
+	{
+		fs_block_put(fs_vfs, disk_map_block(fs_vfs, disk_map, i));
+	}
+	
+	put_unused_tables(fs_vfs, disk_map, disk_map->num_blocks, 0);
+}
+
+/*
+Empties the disk map of the inode in O(1) and moves its contents to detached, the caller releases them with release_disk_map()
+num_blocks is cleared first so that lockless readers stop finding the blocks, the entries they looked up before are checked again (see get_inode_block())
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read), a write range lock over the whole file and the inode mutex
+*/
+static void detach_inode_disk_map(struct fs_inode * inode, struct fs_disk_map * detached)
+{
+	struct fs_disk_map * disk_map = &inode->disk_map;
+	
+	*detached = *disk_map;
+	
+	WRITE_ONCE(disk_map->num_blocks, 0);
+	RCU_INIT_POINTER(disk_map->double_indirect, NULL);
+	RCU_INIT_POINTER(disk_map->single_indirect, NULL);
+	for(int i = 0; i < disk_map->direct_pointer_ind; i++)
+	{
+		WRITE_ONCE(disk_map->blocks[i], NULL);
+	}
+	
+	disk_map->disk_map_flag = 0x0;
+	disk_map->direct_pointer_ind = 0;
+}
+
+/*
+Releases a disk map detached with detach_inode_disk_map(), large maps are handed to the reclaim worker (see fs/fs_reclaim.c)
+so that the caller does not walk all their blocks
+*/
+static void release_disk_map(struct fs_vfs * fs_vfs, struct fs_disk_map * detached)
+{
+	if(!defer_disk_map_release(fs_vfs, detached))
+		free_disk_map(fs_vfs, detached);
+}
+
+/*
+Publishes a disk map detached with detach_inode_disk_map() in an empty inode, the entries are published before num_blocks (see inode_block_lookup_rcu())
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read), a write range lock over the whole file and the inode mutex
+*/
+static void attach_inode_disk_map(struct fs_inode * inode, struct fs_disk_map * detached)
+{
+	struct fs_disk_map * disk_map = &inode->disk_map;
+	
+	for(int i = 0; i < detached->direct_pointer_ind; i++)
+	{
+		rcu_assign_pointer(disk_map->blocks[i], detached->blocks[i]);
+	}
+	rcu_assign_pointer(disk_map->single_indirect, detached->single_indirect);
+	rcu_assign_pointer(disk_map->double_indirect, detached->double_indirect);
+	
+	disk_map->direct_pointer_ind = detached->direct_pointer_ind;
+	disk_map->disk_map_flag = detached->disk_map_flag;
+	smp_store_release(&disk_map->num_blocks, detached->num_blocks);
+}
+
+/*
+Drops the references to all the disk blocks of the inode and returns its indirect tables to the pool
+The map is detached in O(1) under the locks of the inode, its blocks are dropped once the locks are released
+Waits for the writers of the inode to finish, the buffered appends of the inode are dropped
+*/
+void trim_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	struct fs_range_lock range;
+	struct fs_disk_map detached;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks(inode, &range, 0, FS_RANGE_LOCK_FULL, true);
+	mutex_lock(&inode->inode_mutex);
+	
+	detach_inode_disk_map(inode, &detached);
+	WRITE_ONCE(inode->file_size, 0);
+	dax_persist_inode(fs_vfs, inode);
+	discard_inode_delalloc(fs_vfs, inode);
+	
+	mutex_unlock(&inode->inode_mutex);
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	release_disk_map(fs_vfs, &detached);
+}
+
+/*
+Drops the logical blocks num_blocks and above of the inode
+num_blocks is published first so that lockless readers stop finding the dropped blocks, the emptied tables are returned to the pool after an RCU grace period
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read), a write range lock over [num_blocks, FS_RANGE_LOCK_FULL]
+and the inode mutex
+*/
+static void shrink_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode, int num_blocks)
+{
+	struct fs_disk_map * disk_map = &inode->disk_map;
+	int old_num_blocks = disk_map->num_blocks;
+	
+	if(num_blocks >= old_num_blocks)
+		return;
+	
+	smp_store_release(&disk_map->num_blocks, num_blocks);
+	
+	for(int i = num_blocks; i < old_num_blocks; i++)
+	{
+		struct fs_block * block = disk_map_block(fs_vfs, disk_map, i);
+		
+		if(i < 10)
+			RCU_INIT_POINTER(disk_map->blocks[i], NULL);
+		else
+			WRITE_ONCE(*disk_map_table_entry(fs_vfs, disk_map, i), FS_NO_BLOCK);
+		fs_block_put(fs_vfs, block);
+	}
+	
+	put_unused_tables(fs_vfs, disk_map, old_num_blocks, num_blocks);
+	set_disk_map_counters(disk_map, num_blocks);
+}
+
+/*
+Appends zeroed blocks to the inode until it maps num_blocks logical blocks, nothing is appended if that many free blocks are not available
+The blocks and the indirect tables they need are reserved up front, the blocks are taken from the free chains FS_PREALLOC_BATCH_BLOCKS at a time (see get_reserved_blocks()),
+so a large extension costs one allocator refill and one group lock round trip per batch instead of one per block
+In dedup mode the new blocks map the shared zero block (see extend_inode_disk_map())
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read) and the inode mutex
+*/
+static int extend_inode_disk_map_batch(struct fs_vfs * fs_vfs, struct fs_inode * inode, int num_blocks)
+{
+	struct fs_block * blocks[FS_PREALLOC_BATCH_BLOCKS];
+	int nr_reserved = num_blocks - inode->disk_map.num_blocks;
+	int ret = 0;
+	
+	if(nr_reserved <= 0)
+		return 0;
+	
+	if(fs_vfs->dedup_enabled)
+		return extend_inode_disk_map(fs_vfs, inode, num_blocks);
+	
+	//The indirect tables the new blocks need are reserved with them, append_block_to_inode() takes them out of inode->table_reserved
+	int nr_tables = disk_map_tables(num_blocks) - disk_map_tables(inode->disk_map.num_blocks);
+	
+	ret = reserve_disk_blocks(fs_vfs, nr_reserved + nr_tables);
+	if(ret)
+		return ret;
+	
+	inode->table_reserved = nr_tables;
+	
+	while(!ret && inode->disk_map.num_blocks < num_blocks)
+	{
+		int nr_blocks = min(num_blocks - inode->disk_map.num_blocks, FS_PREALLOC_BATCH_BLOCKS);
+		int goal = inode_goal_block(fs_vfs, inode, inode->disk_map.num_blocks);
+		
+		ret = get_reserved_blocks(fs_vfs, inode_home_group(fs_vfs, inode), goal, nr_blocks, blocks);
+		if(ret)
+			break;
+		
+		nr_reserved -= nr_blocks;
+		
+		for(int i = 0; i < nr_blocks; i++)
 		{
-			double_indirect->pointer_ind += 1;
-			
-			if(double_indirect->pointer_ind == 256)
+			if(!ret)
 			{
-				disk_map->disk_map_flag = disk_map->disk_map_flag | 0x04;
-				mutex_unlock(&inode->inode_mutex);
-				printk(KERN_ERR "FILE_SYSTEM_ERROR : Cannot allocate more memory to the inode. MAX LIMIT reached\n");
-				return -FS_E_MAX_LIMIT;
+				clear_page((void *)blocks[i]->block_addr);
+				dax_persist(fs_vfs, (void *)blocks[i]->block_addr, FS_BLOCK_SIZE);
+				ret = append_block_to_inode(fs_vfs, inode, blocks[i]);
 			}
 			
-			if(!double_indirect->blocks[double_indirect->pointer_ind])
-			{
-				double_indirect->blocks[double_indirect->pointer_ind] = allocate_fs_single_indirect_block();
-				
-				if(!double_indirect->blocks[double_indirect->pointer_ind])
-				{
-					mutex_unlock(&inode->inode_mutex);
-					return -FS_EMALLOC;
-				}
-			}
+			if(ret)
+				fs_block_put(fs_vfs, blocks[i]);
 		}
-		
-		struct fs_single_indirect_block * single_indirect = double_indirect->blocks[double_indirect->pointer_ind];
-		
-		struct fs_block * block = get_free_block(fs_vfs);
-		if(!block)
+	}
+	
+	unreserve_disk_blocks(fs_vfs, nr_reserved + inode->table_reserved);
+	inode->table_reserved = 0;
+	
+	return ret;
+}
+
+/*
+Sets the file size of the inode to size bytes
+A shrinking file drops the blocks past the new end and zeroes the rest of its new last block, so that a later extension reads back zeros
+A growing file gets zeroed blocks up to the new end, blocks already mapped past the old end (see preallocate_inode()) are kept
+The bytes mapped past the end of a file always read back as zeros, every block is mapped zeroed (see alloc_disk_to_inode() and fs/fs_delalloc.c)
+and a shrinking file zeroes the rest of its new last block, so the range exposed by a growing file is not cleared here
+A truncate to zero detaches the whole disk map like trim_inode_disk_map() and drops the buffered appends, any other truncate flushes them first
+*/
+int truncate_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t size)
+{
+	struct fs_range_lock range;
+	struct fs_disk_map detached;
+	bool detach = false;
+	int ret;
+	
+	if(size < 0 || size > (loff_t)FS_MAX_INODE_BLOCKS * FS_BLOCK_SIZE)
+		return -FS_EINPUT_PARAMETER;
+	
+	int block_ind = size / FS_BLOCK_SIZE;
+	int offset = size % FS_BLOCK_SIZE;
+	
+	//The blocks before the new last block are not touched, their writers keep running
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks_tail(fs_vfs, inode, &range, block_ind, FS_RANGE_LOCK_FULL, true);
+	
+	ret = size ? flush_inode_delalloc_locked(fs_vfs, inode) : 0;
+	if(ret)
+		goto out;
+	
+	mutex_lock(&inode->inode_mutex);
+	
+	if(!size)
+	{
+		detach_inode_disk_map(inode, &detached);
+		discard_inode_delalloc(fs_vfs, inode);
+		detach = true;
+	}
+	else if(size < inode->file_size)
+	{
+		if(offset && block_ind < inode->disk_map.num_blocks)
 		{
-			mutex_unlock(&inode->inode_mutex);
-			return -FS_ENO_FREE_BLOCK;
+			struct fs_block * block = get_writable_inode_block(fs_vfs, inode, block_ind, true, &ret);
+			if(!block)
+				goto out_unlock;
+			
+			mutex_lock(&block->diskblock_mutex);
+			memset((void *)block->block_addr + offset, 0, FS_BLOCK_SIZE - offset);
+			mutex_unlock(&block->diskblock_mutex);
+			
+			dax_persist(fs_vfs, (void *)block->block_addr + offset, FS_BLOCK_SIZE - offset);
+			finish_inode_block_write(fs_vfs, inode, block_ind);
 		}
 		
-		single_indirect->blocks[single_indirect->pointer_ind] = block;
-		single_indirect->pointer_ind += 1;
+		shrink_inode_disk_map(fs_vfs, inode, DIV_ROUND_UP(size, FS_BLOCK_SIZE));
 	}
 	else
 	{
-		mutex_unlock(&inode->inode_mutex);
-		printk(KERN_ERR "FILE_SYSTEM_ERROR : Cannot allocate more memory to the inode. MAX LIMIT reached\n");
-		return -FS_E_MAX_LIMIT;
+		ret = extend_inode_disk_map_batch(fs_vfs, inode, DIV_ROUND_UP(size, FS_BLOCK_SIZE));
+		if(ret)
+			goto out_unlock;
 	}
 	
+	smp_store_release(&inode->file_size, (int)size);
+	dax_persist_inode(fs_vfs, inode);
+	
+out_unlock:
 	mutex_unlock(&inode->inode_mutex);
+out:
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
 	
-	return 0;
+	if(detach)
+		release_disk_map(fs_vfs, &detached);
+	
+	return ret;
 }
 
-void destroy_inode_disk_map_single_indirect(struct fs_vfs * fs_vfs, struct fs_single_indirect_block * single_indirect)
+/*
+Maps zeroed blocks to the inode up to size bytes without changing its file size, later writes up to size do not allocate
+Nothing is mapped if the blocks are not available, the buffered appends of the inode are flushed first
+*/
+int preallocate_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t size)
 {
-	while(single_indirect->pointer_ind >= 0)
+	struct fs_range_lock range;
+	
+	if(size < 0 || size > (loff_t)FS_MAX_INODE_BLOCKS * FS_BLOCK_SIZE)
+		return -FS_EINPUT_PARAMETER;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks_tail(fs_vfs, inode, &range, FS_RANGE_LOCK_FULL, FS_RANGE_LOCK_FULL, true);
+	
+	int ret = flush_inode_delalloc_locked(fs_vfs, inode);
+	if(!ret)
 	{
-		put_free_block(fs_vfs, single_indirect->blocks[single_indirect->pointer_ind]);
-		single_indirect->blocks[single_indirect->pointer_ind] = NULL;
-		single_indirect->pointer_ind -= 1;
-		
+		mutex_lock(&inode->inode_mutex);
+		ret = extend_inode_disk_map_batch(fs_vfs, inode, DIV_ROUND_UP(size, FS_BLOCK_SIZE));
+		mutex_unlock(&inode->inode_mutex);
 	}
-	destroy_fs_single_indirect_block(single_indirect);
+	
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return ret;
 }
 
-void trim_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+/*
+Returns the block mapped at the logical block block_ind of the inode or NULL if the block is not allocated
+Note :- This function has to be called while holding the inode mutex
+*/
+struct fs_block * inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind)
 {
-	mutex_lock(&inode->inode_mutex);
+	if(block_ind < 0 || block_ind >= inode->disk_map.num_blocks)
+		return NULL;
 	
-	struct fs_disk_map * disk_map = inode->disk_map;
+	return disk_map_block(fs_vfs, &inode->disk_map, block_ind);
+}
+
+/*
+Maps the logical block block_ind of the inode, which has to be allocated, to block
+The reference held by the entry moves to block, the caller drops the reference to the block mapped before
+Note :- This function has to be called while holding the inode mutex
+*/
+void set_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, struct fs_block * block)
+{
+	if(block_ind < 10)
+		rcu_assign_pointer(inode->disk_map.blocks[block_ind], block);
+	else
+		smp_store_release(disk_map_table_entry(fs_vfs, &inode->disk_map, block_ind), (u32)block->block_num);
+}
+
+/*
+Lockless version of inode_block(), returns the block or NULL
+The lookup is bounded by num_blocks which is published after the entry, a concurrent trim makes it return NULL
+A table found through a stale num_blocks is either still in the pool or holds FS_NO_BLOCK in the entries dropped since
+Note :- This function has to be called inside an RCU read side critical section
+*/
+static struct fs_block * inode_block_lookup_rcu(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind)
+{
+	struct fs_disk_map * disk_map = &inode->disk_map;
 	
-	if(disk_map->double_indirect)
+	if(block_ind < 0 || block_ind >= smp_load_acquire(&disk_map->num_blocks))
+		return NULL;
+	
+	if(block_ind < 10)
+		return rcu_dereference(disk_map->blocks[block_ind]);
+	
+	block_ind -= 10;
+	
+	if(block_ind < FS_INDIRECT_ENTRIES)
 	{
-		struct fs_double_indirect_block * double_indirect = disk_map->double_indirect;
-		if(double_indirect->pointer_ind == 256)
+		struct fs_block * table = rcu_dereference(disk_map->single_indirect);
+		return table ? num_to_disk_block(fs_vfs, READ_ONCE(table_entries(table)[block_ind])) : NULL;
+	}
+	
+	block_ind -= FS_INDIRECT_ENTRIES;
+	
+	struct fs_block * table = rcu_dereference(disk_map->double_indirect);
+	if(!table)
+		return NULL;
+	
+	table = num_to_disk_block(fs_vfs, READ_ONCE(table_entries(table)[block_ind / FS_INDIRECT_ENTRIES]));
+	
+	return table ? num_to_disk_block(fs_vfs, READ_ONCE(table_entries(table)[block_ind % FS_INDIRECT_ENTRIES])) : NULL;
+}
+
+/*
+Returns the block mapped at the logical block block_ind of the inode pinned (see fs_block_pin()), NULL if it is not mapped
+The lookup does not take the inode mutex, the caller drops the pin with fs_block_unpin()
+A block can be freed and reused by another file between the lookup and taking the pin, the entry is checked again once the pin is held
+*/
+struct fs_block * get_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind)
+{
+	struct fs_block * block;
+	
+	for(;;)
+	{
+		rcu_read_lock();
+		block = inode_block_lookup_rcu(fs_vfs, inode, block_ind);
+		if(block && !fs_block_pin(block))
 		{
-			double_indirect->pointer_ind -= 1;
+			rcu_read_unlock();
+			cpu_relax();
+			continue;
 		}
+		rcu_read_unlock();
 		
-		struct fs_single_indirect_block * single_indirect = double_indirect->blocks[double_indirect->pointer_ind];
-		single_indirect->pointer_ind -= 1;
-		if(single_indirect->pointer_ind < 0)
+		if(!block)
+			return NULL;
+		
+		rcu_read_lock();
+		bool unchanged = (inode_block_lookup_rcu(fs_vfs, inode, block_ind) == block);
+		rcu_read_unlock();
+		
+		if(unchanged)
+			return block;
+		
+		fs_block_unpin(fs_vfs, block);
+	}
+}
+
+/*
+Returns the number of disk blocks mapped by the inode
+Note :- This function has to be called while holding the inode mutex
+*/
+int inode_num_blocks(struct fs_inode * inode)
+{
+	return inode->disk_map.num_blocks;
+}
+
+/*
+Returns the block mapped at the logical block block_ind of the inode, private to the inode so that it can be modified in place
+A block shared with other disk maps is copied first (copy on write), keep_data is false when the caller overwrites the whole block
+In dedup mode the block is taken out of the dedup table, finish_inode_block_write() hashes it again
+While the caller holds a write range lock over block_ind (see lock_inode_blocks()) the block stays in the map and private to the inode,
+so the data can be copied after the inode mutex has been dropped
+Returns NULL and sets *err on failure
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read) and the inode mutex
+*/
+struct fs_block * get_writable_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, bool keep_data, int * err)
+{
+	struct fs_block * block = inode_block(fs_vfs, inode, block_ind);
+	if(!block)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Logical block %d not allocated in get_writable_inode_block()\n", block_ind);
+		*err = -FS_EINPUT_PARAMETER;
+		return NULL;
+	}
+	
+	//Once unhashed the block cannot gain new sharers through the dedup table
+	if(fs_vfs->dedup_enabled)
+		dedup_unhash_block(fs_vfs, block);
+	
+	if(fs_block_sharers(block) > 1)
+	{
+		struct fs_block * new_block = get_free_block_near(fs_vfs, inode_home_group(fs_vfs, inode), inode_goal_block(fs_vfs, inode, block_ind));
+		if(!new_block)
 		{
-			destroy_fs_single_indirect_block(single_indirect);
-			double_indirect->blocks[double_indirect->pointer_ind] = NULL;
-			double_indirect->pointer_ind -= 1;
-			if(double_indirect->pointer_ind < 0)
-			{
-				destroy_fs_double_indirect_block(double_indirect);
-				disk_map->double_indirect = NULL;
-			}
-			single_indirect = double_indirect->blocks[double_indirect->pointer_ind];
-			single_indirect->pointer_ind = 255;
+			*err = -FS_ENO_FREE_BLOCK;
+			return NULL;
 		}
 		
-		while(disk_map->double_indirect)
+		if(keep_data)
+			memcpy((void *)new_block->block_addr, (void *)block->block_addr, FS_BLOCK_SIZE);
+		
+		set_inode_block(fs_vfs, inode, block_ind, new_block);
+		fs_block_put(fs_vfs, block);
+		block = new_block;
+	}
+	
+	return block;
+}
+
+/*
+Returns the copy mode for a write of size bytes to the logical block block_ind and tracks the sequential writes of the inode
+Full block writes which are part of a long sequential stream bypass the cache, the data is unlikely to be read back soon
+Dedup mode reads the block back for hashing so it keeps the data cached
+Note :- This function has to be called while holding the inode mutex
+*/
+int inode_write_copy_mode(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, int size)
+{
+	if(block_ind == inode->last_written_block + 1)
+		inode->sequential_writes += 1;
+	else if(block_ind != inode->last_written_block)
+		inode->sequential_writes = 0;
+	inode->last_written_block = block_ind;
+	
+	if(size == FS_BLOCK_SIZE && inode->sequential_writes >= FS_COPY_STREAM_BLOCKS && !fs_vfs->dedup_enabled)
+		return FS_COPY_NONTEMPORAL;
+	
+	return FS_COPY_CACHED;
+}
+
+/*
+Completes a write to the block returned by get_writable_inode_block(), deduplicates it in dedup mode and marks it dirty
+Note :- This function has to be called while holding fs_vfs->snapshot_rwsem (read) and the inode mutex
+*/
+void finish_inode_block_write(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind)
+{
+	struct fs_block * block = inode_block(fs_vfs, inode, block_ind);
+	
+	if(fs_vfs->dedup_enabled)
+	{
+		block = dedup_block(fs_vfs, block);
+		set_inode_block(fs_vfs, inode, block_ind, block);
+	}
+	
+	set_bit(block->block_num, fs_vfs->dirty_bitmap);
+}
+
+/*
+Writes data to the logical block block_ind of the inode
+A block shared with other disk maps is copied before it is modified (copy on write)
+In dedup mode the written block is deduplicated against the rest of the file system
+Parameters:-
+int block_ind :- logical block of the inode, has to be allocated by alloc_disk_to_inode()
+int offset, void * src, int size :- same as write_to_block()
+*/
+int write_to_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, int offset, void * src, int size)
+{
+	struct fs_range_lock range;
+	int ret = 0;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	lock_inode_blocks(inode, &range, block_ind, block_ind, true);
+	
+	mutex_lock(&inode->inode_mutex);
+	struct fs_block * block = get_writable_inode_block(fs_vfs, inode, block_ind, offset != 0 || size != FS_BLOCK_SIZE, &ret);
+	int copy_mode = inode_write_copy_mode(fs_vfs, inode, block_ind, size);
+	mutex_unlock(&inode->inode_mutex);
+	
+	if(block)
+	{
+		ret = copy_to_block(block, offset, src, size, copy_mode);
+		if(!ret)
 		{
-			struct fs_block * block = single_indirect->blocks[single_indirect->pointer_ind];
-			put_free_block(fs_vfs, block);
-			single_indirect->blocks[single_indirect->pointer_ind] = NULL;
-			single_indirect->pointer_ind -= 1;
+			dax_persist(fs_vfs, (void *)block->block_addr + offset, size);
 			
-			if(single_indirect->pointer_ind < 0)
-			{
-				destroy_fs_single_indirect_block(single_indirect);
-				double_indirect->blocks[double_indirect->pointer_ind] = NULL;
-				double_indirect->pointer_ind -= 1;
-				if(double_indirect->pointer_ind < 0)
-				{
-					destroy_fs_double_indirect_block(double_indirect);
-					disk_map->double_indirect = NULL;
-					break;
-				}
-				single_indirect = double_indirect->blocks[double_indirect->pointer_ind];
-				single_indirect->pointer_ind = 255;
-			}
+			mutex_lock(&inode->inode_mutex);
+			finish_inode_block_write(fs_vfs, inode, block_ind);
+			mutex_unlock(&inode->inode_mutex);
 		}
 	}
 	
-	if(disk_map->single_indirect)
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return ret;
+}
+
+/*
+Makes dst a copy of src which shares all the disk blocks of src (reflink clone)
+dst gets its own indirect tables, the disk blocks are only copied when either inode writes to them (see write_to_inode_block())
+Parameters:-
+struct fs_inode * src :- inode to be cloned
+struct fs_inode * dst :- inode which receives the clone, must not have any disk blocks
+Not available in DAX mode
+
+Note :- The caller has to hold fs_vfs->snapshot_rwsem (read or write)
+*/
+int clone_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * src, struct fs_inode * dst)
+{
+	int ret = 0;
+	
+	if(src == dst)
+		return -FS_EINPUT_PARAMETER;
+	
+	if(fs_dax_enabled(fs_vfs))
 	{
-		struct fs_single_indirect_block * single_indirect = disk_map->single_indirect;
-		
-		single_indirect->pointer_ind -= 1;
-		//printk("FILE_SYSTEM : single_indirect->pointer_ind:%d\n", single_indirect->pointer_ind);
-		destroy_inode_disk_map_single_indirect(fs_vfs, single_indirect);
-		disk_map->single_indirect = NULL;
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Blocks cannot be shared on a DAX device\n");
+		return -FS_EDAX;
 	}
 	
+	//Keeps the writers of src from modifying the blocks while they become shared
+	struct fs_range_lock range;
+	lock_inode_blocks(src, &range, 0, FS_RANGE_LOCK_FULL, false);
 	
-	disk_map->direct_pointer_ind -= 1;
+	//The clone shares the blocks of src, the buffered appends of src need their blocks first
+	ret = flush_inode_delalloc_locked(fs_vfs, src);
+	if(ret)
+	{
+		unlock_inode_blocks(src, &range);
+		return ret;
+	}
 	
-	//printk("FILE_SYSTEM : inode->disk_map->direct_pointer_ind:%d\n", inode->disk_map->direct_pointer_ind);
-	while(disk_map->direct_pointer_ind >= 0)
+	mutex_lock(&src->inode_mutex);
+	mutex_lock_nested(&dst->inode_mutex, SINGLE_DEPTH_NESTING);
+	
+	if(dst->disk_map.num_blocks != 0)
 	{
-		put_free_block(fs_vfs, disk_map->blocks[disk_map->direct_pointer_ind]);
-		disk_map->blocks[disk_map->direct_pointer_ind] = NULL;
-		disk_map->direct_pointer_ind -= 1;
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Clone destination inode %d is not empty\n", dst->inode_num);
+		ret = -FS_EINPUT_PARAMETER;
+		goto out;
 	}
 	
-	inode->disk_map->disk_map_flag = 0x0;
-	disk_map->direct_pointer_ind = 0;
+	for(int i = 0; i < inode_num_blocks(src); i++)
+	{
+		struct fs_block * block = inode_block(fs_vfs, src, i);
+		
+		fs_block_get(fs_vfs, block);
+		ret = append_block_to_inode(fs_vfs, dst, block);
+		if(ret)
+		{
+			fs_block_put(fs_vfs, block);
+			break;
+		}
+	}
+	
+	//A partial clone is undone, the blocks it mapped past the end of dst would hold the data of src
+	if(ret)
+		shrink_inode_disk_map(fs_vfs, dst, 0);
+	else
+		smp_store_release(&dst->file_size, src->file_size);
+	
+out:
+	mutex_unlock(&dst->inode_mutex);
+	mutex_unlock(&src->inode_mutex);
+	unlock_inode_blocks(src, &range);
+	
+	return ret;
+}
+
+/*
+Swaps the disk maps and the file sizes of inode and scratch in O(1), so a map built in scratch replaces the map of inode in one step
+The previous map of inode is left in scratch for the caller to drop with trim_inode_disk_map(), the buffered appends of inode are dropped
+Parameters:-
+struct fs_inode * scratch :- inode which is on neither inode list, no other thread may access it
+Note :- The caller has to hold fs_vfs->snapshot_rwsem (read or write)
+*/
+void exchange_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_inode * scratch)
+{
+	struct fs_range_lock range;
+	struct fs_disk_map old_map, new_map;
+	
+	lock_inode_blocks(inode, &range, 0, FS_RANGE_LOCK_FULL, true);
+	mutex_lock(&inode->inode_mutex);
+	mutex_lock_nested(&scratch->inode_mutex, SINGLE_DEPTH_NESTING);
 	
+	discard_inode_delalloc(fs_vfs, inode);
+	
+	detach_inode_disk_map(inode, &old_map);
+	detach_inode_disk_map(scratch, &new_map);
+	attach_inode_disk_map(inode, &new_map);
+	attach_inode_disk_map(scratch, &old_map);
+	
+	int file_size = inode->file_size;
+	WRITE_ONCE(inode->file_size, scratch->file_size);
+	scratch->file_size = file_size;
+	dax_persist_inode(fs_vfs, inode);
+	
+	mutex_unlock(&scratch->inode_mutex);
 	mutex_unlock(&inode->inode_mutex);
+	unlock_inode_blocks(inode, &range);
+}
+
+/*
+Clones src into a newly allocated inode and returns it, returns NULL on failure
+*/
+struct fs_inode * clone_inode(struct fs_vfs * fs_vfs, struct fs_inode * src)
+{
+	struct fs_inode * dst = get_inode(fs_vfs);
+	if(!dst)
+		return NULL;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	int ret = clone_inode_disk_map(fs_vfs, src, dst);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	if(ret)
+	{
+		trim_inode_disk_map(fs_vfs, dst);
+		put_inode(fs_vfs, dst);
+		return NULL;
+	}
+	
+	return dst;
 }
 
 /*
 void remove_last_disk_block_from_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
 {
-	if(inode->disk_map->disk_map_flag == 0x0)
+	if(inode->disk_map.disk_map_flag == 0x0)
 		return;
 	
 	mutex_lock(&inode->inode_mutex);
 	
-	struct fs_disk_map * disk_map = inode->disk_map;
+	struct fs_disk_map * disk_map = &inode->disk_map;
 	
 	if(disk_map->double_indirect)
 	{
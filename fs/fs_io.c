@@ -0,0 +1,471 @@
+#include <linux/mm.h>
+
+#include "../include/fs_io.h"
+#include "../include/fs_copy.h"
+#include "../include/fs_dax.h"
+#include "../include/fs_delalloc.h"
+
+/*
+Reads from the inode at *pos into the iov_iter, straight from the pool blocks without an intermediate buffer
+The blocks are looked up without the inode mutex (see get_inode_block()) so readers of a file never serialise with each other
+Buffered appends (see fs/fs_delalloc.c) are flushed first
+Returns the number of bytes read and advances *pos, 0 at the end of the file
+*/
+ssize_t read_inode_iter(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct iov_iter * to)
+{
+	ssize_t done = 0;
+	
+	int ret = flush_inode_delalloc(fs_vfs, inode);
+	if(ret)
+		return ret;
+	
+	while(iov_iter_count(to))
+	{
+		//Pairs with the release in the writers, the data below file_size is visible
+		int file_size = smp_load_acquire(&inode->file_size);
+		if(*pos >= file_size)
+			break;
+		
+		int block_ind = *pos / FS_BLOCK_SIZE;
+		int offset = *pos % FS_BLOCK_SIZE;
+		size_t size = min3((size_t)(FS_BLOCK_SIZE - offset), (size_t)(file_size - *pos), iov_iter_count(to));
+		
+		//The file has been truncated since file_size was read
+		struct fs_block * block = get_inode_block(fs_vfs, inode, block_ind);
+		if(!block)
+			break;
+		
+		size_t copied = copy_to_iter((void *)block->block_addr + offset, size, to);
+		
+		fs_block_unpin(fs_vfs, block);
+		
+		*pos += copied;
+		done += copied;
+		
+		if(copied != size)
+			return done ? done : -FS_EADDR;
+	}
+	
+	return done;
+}
+
+/*
+Writes the iov_iter to the inode at *pos, extending the inode when the write goes past its last block
+The data is copied straight into the pool blocks, long sequential streams bypass the cache like write_to_inode_block()
+The blocks written are range locked for the whole write so that it is atomic with respect to other writers of the same blocks,
+the inode mutex is only held while the disk map and the file size are updated, writers of disjoint ranges copy concurrently
+Appends past the last mapped block are buffered while delayed allocation is enabled (see fs/fs_delalloc.c), any other write reaching
+the buffered blocks flushes them first
+Returns the number of bytes written and advances *pos
+*/
+ssize_t write_inode_iter(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct iov_iter * from)
+{
+	struct fs_range_lock range;
+	ssize_t done = 0;
+	int ret = 0;
+	
+	if(!iov_iter_count(from))
+		return 0;
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	bool tail = lock_inode_blocks_tail(fs_vfs, inode, &range, *pos / FS_BLOCK_SIZE, (*pos + iov_iter_count(from) - 1) / FS_BLOCK_SIZE, true);
+	
+	if(tail && !delalloc_can_append(fs_vfs, inode, *pos, iov_iter_count(from)))
+	{
+		ret = flush_inode_delalloc_locked(fs_vfs, inode);
+		if(ret)
+			goto out;
+	}
+	
+	while(iov_iter_count(from))
+	{
+		//The head of the write fills the last mapped block in place, the rest of an append is buffered
+		if(tail && delalloc_can_append(fs_vfs, inode, *pos, iov_iter_count(from)))
+		{
+			ssize_t written = append_delalloc_iter(fs_vfs, inode, pos, from);
+			if(written < 0)
+				ret = written;
+			else
+				done += written;
+			break;
+		}
+		
+		int block_ind = *pos / FS_BLOCK_SIZE;
+		int offset = *pos % FS_BLOCK_SIZE;
+		size_t size = min_t(size_t, FS_BLOCK_SIZE - offset, iov_iter_count(from));
+		
+		mutex_lock(&inode->inode_mutex);
+		ret = extend_inode_disk_map(fs_vfs, inode, block_ind + 1);
+		if(ret)
+		{
+			mutex_unlock(&inode->inode_mutex);
+			break;
+		}
+		
+		struct fs_block * block = get_writable_inode_block(fs_vfs, inode, block_ind, size != FS_BLOCK_SIZE, &ret);
+		int copy_mode = inode_write_copy_mode(fs_vfs, inode, block_ind, size);
+		mutex_unlock(&inode->inode_mutex);
+		if(!block)
+			break;
+		
+		void * dest_addr = (void *)block->block_addr + offset;
+		size_t copied;
+		
+		mutex_lock(&block->diskblock_mutex);
+		if(copy_mode == FS_COPY_NONTEMPORAL)
+			copied = copy_from_iter_flushcache(dest_addr, size, from);
+		else
+			copied = copy_from_iter(dest_addr, size, from);
+		mutex_unlock(&block->diskblock_mutex);
+		
+		dax_persist(fs_vfs, dest_addr, copied);
+		
+		mutex_lock(&inode->inode_mutex);
+		finish_inode_block_write(fs_vfs, inode, block_ind);
+		
+		*pos += copied;
+		done += copied;
+		if(*pos > inode->file_size)
+			smp_store_release(&inode->file_size, *pos);
+		mutex_unlock(&inode->inode_mutex);
+		
+		if(copied != size)
+		{
+			ret = -FS_EADDR;
+			break;
+		}
+	}
+	
+	if(done)
+	{
+		mutex_lock(&inode->inode_mutex);
+		dax_persist_inode(fs_vfs, inode);
+		mutex_unlock(&inode->inode_mutex);
+	}
+	
+out:
+	unlock_inode_blocks(inode, &range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return done ? done : ret;
+}
+
+
+/*
+Pin on a spliced block shared by the pipe buffers referring to it (a buffer duplicated by tee() shares the pin of the original)
+The block can not be freed and reused by another file while a pipe buffer still refers to its pool page
+*/
+typedef struct fs_splice_pin
+{
+	struct fs_vfs * fs_vfs;
+	struct fs_block * block;
+	atomic_t count; //Number of pipe buffers holding the pin
+}fs_splice_pin_t;
+
+static bool fs_pipe_buf_get(struct pipe_inode_info * pipe, struct pipe_buffer * buf)
+{
+	struct fs_splice_pin * pin = (struct fs_splice_pin *)buf->private;
+	
+	if(pin)
+		atomic_inc(&pin->count);
+	
+	get_page(buf->page);
+	return true;
+}
+
+static void fs_pipe_buf_release(struct pipe_inode_info * pipe, struct pipe_buffer * buf)
+{
+	struct fs_splice_pin * pin = (struct fs_splice_pin *)buf->private;
+	
+	put_page(buf->page);
+	
+	if(pin && atomic_dec_and_test(&pin->count))
+	{
+		fs_block_unpin(pin->fs_vfs, pin->block);
+		kfree(pin);
+	}
+}
+
+/*
+Pool pages are never stolen by the pipe, buf->private holds the pin on the block of the page (NULL for pages copied in DAX mode)
+*/
+static const struct pipe_buf_operations fs_pipe_buf_ops = {
+	.release = fs_pipe_buf_release,
+	.get = fs_pipe_buf_get,
+};
+
+/*
+Splices the inode at *pos into the pipe by handing out references to the pool pages, the data is not copied
+The blocks stay pinned until the pipe releases the buffers so they can not be freed and reused by another file meanwhile
+In place writes to the same file while the data sits in the pipe are visible to the reader of the pipe, writes to shared blocks copy the block and are not
+In DAX mode the data is copied into new pages
+Buffered appends (see fs/fs_delalloc.c) are flushed first
+Note :- The caller has to hold the pipe lock
+Returns the number of bytes spliced and advances *pos
+*/
+ssize_t splice_read_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct pipe_inode_info * pipe, size_t len)
+{
+	ssize_t done = 0;
+	ssize_t ret = flush_inode_delalloc(fs_vfs, inode);
+	
+	if(ret)
+		return ret;
+	
+	while(len)
+	{
+		int file_size = smp_load_acquire(&inode->file_size);
+		if(*pos >= file_size)
+			break;
+		
+		int block_ind = *pos / FS_BLOCK_SIZE;
+		int offset = *pos % FS_BLOCK_SIZE;
+		size_t size = min3((size_t)(FS_BLOCK_SIZE - offset), (size_t)(file_size - *pos), len);
+		
+		struct fs_block * block = get_inode_block(fs_vfs, inode, block_ind);
+		if(!block)
+			break;
+		
+		struct pipe_buffer buf = {
+			.offset = offset,
+			.len = size,
+			.ops = &fs_pipe_buf_ops,
+		};
+		
+		//Blocks on a DAX device have no pool page, the data is copied into a new page
+		if(fs_dax_enabled(fs_vfs))
+		{
+			buf.page = alloc_page(GFP_KERNEL);
+			if(buf.page)
+				memcpy(page_address(buf.page) + offset, (void *)block->block_addr + offset, size);
+		}
+		else
+		{
+			struct fs_splice_pin * pin = kmalloc(sizeof(struct fs_splice_pin), GFP_KERNEL);
+			if(pin)
+			{
+				//The pin taken by get_inode_block() is handed over to the pipe buffer
+				pin->fs_vfs = fs_vfs;
+				pin->block = block;
+				atomic_set(&pin->count, 1);
+				
+				buf.page = fs_vfs->pool_pages[block->block_num];
+				buf.private = (unsigned long)pin;
+				get_page(buf.page);
+			}
+		}
+		
+		if(!buf.private)
+			fs_block_unpin(fs_vfs, block);
+		
+		if(!buf.page)
+		{
+			ret = -FS_EMALLOC;
+			break;
+		}
+		
+		//add_to_pipe() releases the buffer itself (page reference and pin) when the pipe is full
+		ret = add_to_pipe(pipe, &buf);
+		if(ret < 0)
+			break;
+		
+		*pos += size;
+		done += size;
+		len -= size;
+	}
+	
+	return done ? done : ret;
+}
+
+
+static void lock_inode_pair(struct fs_inode * a, struct fs_inode * b)
+{
+	if(a == b)
+	{
+		mutex_lock(&a->inode_mutex);
+		return;
+	}
+	
+	if(a->inode_num > b->inode_num)
+		swap(a, b);
+	
+	mutex_lock(&a->inode_mutex);
+	mutex_lock_nested(&b->inode_mutex, SINGLE_DEPTH_NESTING);
+}
+
+static void unlock_inode_pair(struct fs_inode * a, struct fs_inode * b)
+{
+	if(a != b)
+		mutex_unlock(&b->inode_mutex);
+	mutex_unlock(&a->inode_mutex);
+}
+
+/*
+Range locks the blocks of src read by copy_inode_range() and the blocks of dst written by it, in inode number order
+A single write range over both block ranges is taken when src and dst are the same inode, as the ranges may share a block
+The copy works on the disk maps, the buffered appends (see fs/fs_delalloc.c) reached by either range are flushed
+Returns the flush error, the ranges are locked in any case
+*/
+static int lock_copy_ranges(struct fs_vfs * fs_vfs, struct fs_inode * src, struct fs_range_lock * src_range, loff_t src_pos,
+struct fs_inode * dst, struct fs_range_lock * dst_range, loff_t dst_pos, size_t len)
+{
+	u64 src_first = src_pos / FS_BLOCK_SIZE, src_last = (src_pos + len - 1) / FS_BLOCK_SIZE;
+	u64 dst_first = dst_pos / FS_BLOCK_SIZE, dst_last = (dst_pos + len - 1) / FS_BLOCK_SIZE;
+	bool src_tail, dst_tail;
+	
+	if(src == dst)
+	{
+		dst_tail = lock_inode_blocks_tail(fs_vfs, dst, dst_range, min(src_first, dst_first), max(src_last, dst_last), true);
+		return dst_tail ? flush_inode_delalloc_locked(fs_vfs, dst) : 0;
+	}
+	
+	if(src->inode_num < dst->inode_num)
+	{
+		src_tail = lock_inode_blocks_tail(fs_vfs, src, src_range, src_first, src_last, false);
+		dst_tail = lock_inode_blocks_tail(fs_vfs, dst, dst_range, dst_first, dst_last, true);
+	}
+	else
+	{
+		dst_tail = lock_inode_blocks_tail(fs_vfs, dst, dst_range, dst_first, dst_last, true);
+		src_tail = lock_inode_blocks_tail(fs_vfs, src, src_range, src_first, src_last, false);
+	}
+	
+	int ret = src_tail ? flush_inode_delalloc_locked(fs_vfs, src) : 0;
+	if(!ret && dst_tail)
+		ret = flush_inode_delalloc_locked(fs_vfs, dst);
+	
+	return ret;
+}
+
+static void unlock_copy_ranges(struct fs_inode * src, struct fs_range_lock * src_range, struct fs_inode * dst, struct fs_range_lock * dst_range)
+{
+	unlock_inode_blocks(dst, dst_range);
+	if(src != dst)
+		unlock_inode_blocks(src, src_range);
+}
+
+/*
+Copies len bytes of src at src_pos to dst at dst_pos (copy_file_range)
+Whole blocks at block aligned positions in both inodes are remapped, dst takes a reference to the block of src and
+the block is only copied when either inode writes to it (see get_writable_inode_block())
+The unaligned head and tail are copied between the pool blocks, in DAX mode every block is copied as blocks are never shared
+Parameters:-
+struct fs_inode * src, struct fs_inode * dst :- may be the same inode as long as the ranges do not overlap
+Returns the number of bytes copied, the copy stops at the end of src
+*/
+ssize_t copy_inode_range(struct fs_vfs * fs_vfs, struct fs_inode * src, loff_t src_pos, struct fs_inode * dst, loff_t dst_pos, size_t len)
+{
+	struct fs_range_lock src_range, dst_range;
+	ssize_t done = 0;
+	int ret = 0;
+	
+	if(src_pos < 0 || dst_pos < 0)
+		return -FS_EINPUT_PARAMETER;
+	
+	//Bounds the range locks, the size is checked again under the inode mutex
+	loff_t src_size = smp_load_acquire(&src->file_size);
+	if(!len || src_pos >= src_size)
+		return 0;
+	
+	len = min_t(size_t, len, src_size - src_pos);
+	
+	if(src == dst && src_pos < dst_pos + len && dst_pos < src_pos + len)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Overlapping ranges in copy_inode_range()\n");
+		return -FS_EINPUT_PARAMETER;
+	}
+	
+	down_read(&fs_vfs->snapshot_rwsem);
+	ret = lock_copy_ranges(fs_vfs, src, &src_range, src_pos, dst, &dst_range, dst_pos, len);
+	if(ret)
+	{
+		unlock_copy_ranges(src, &src_range, dst, &dst_range);
+		up_read(&fs_vfs->snapshot_rwsem);
+		return ret;
+	}
+	
+	lock_inode_pair(src, dst);
+	
+	if(src_pos >= src->file_size)
+		goto out;
+	
+	len = min_t(size_t, len, src->file_size - src_pos);
+	
+	while(len)
+	{
+		int src_ind = src_pos / FS_BLOCK_SIZE;
+		int src_offset = src_pos % FS_BLOCK_SIZE;
+		int dst_ind = dst_pos / FS_BLOCK_SIZE;
+		int dst_offset = dst_pos % FS_BLOCK_SIZE;
+		size_t size;
+		
+		if(src_offset == 0 && dst_offset == 0 && len >= FS_BLOCK_SIZE && !fs_dax_enabled(fs_vfs))
+		{
+			size = FS_BLOCK_SIZE;
+			
+			ret = extend_inode_disk_map(fs_vfs, dst, dst_ind);
+			if(ret)
+				break;
+			
+			struct fs_block * block = inode_block(fs_vfs, src, src_ind);
+			
+			fs_block_get(fs_vfs, block);
+			if(inode_num_blocks(dst) == dst_ind)
+			{
+				ret = append_block_to_inode(fs_vfs, dst, block);
+				if(ret)
+				{
+					fs_block_put(fs_vfs, block);
+					break;
+				}
+			}
+			else
+			{
+				struct fs_block * old_block = inode_block(fs_vfs, dst, dst_ind);
+				
+				set_inode_block(fs_vfs, dst, dst_ind, block);
+				fs_block_put(fs_vfs, old_block);
+			}
+		}
+		else
+		{
+			size = min3((size_t)(FS_BLOCK_SIZE - src_offset), (size_t)(FS_BLOCK_SIZE - dst_offset), len);
+			
+			ret = extend_inode_disk_map(fs_vfs, dst, dst_ind + 1);
+			if(ret)
+				break;
+			
+			struct fs_block * dst_block = get_writable_inode_block(fs_vfs, dst, dst_ind, size != FS_BLOCK_SIZE, &ret);
+			if(!dst_block)
+				break;
+			
+			//Looked up after the copy on write of dst, which replaces the block when src and dst share it
+			struct fs_block * src_block = inode_block(fs_vfs, src, src_ind);
+			
+			mutex_lock(&dst_block->diskblock_mutex);
+			copy_block_data((void *)dst_block->block_addr + dst_offset, (void *)src_block->block_addr + src_offset, size, inode_write_copy_mode(fs_vfs, dst, dst_ind, size));
+			mutex_unlock(&dst_block->diskblock_mutex);
+			
+			dax_persist(fs_vfs, (void *)dst_block->block_addr + dst_offset, size);
+			
+			finish_inode_block_write(fs_vfs, dst, dst_ind);
+		}
+		
+		src_pos += size;
+		dst_pos += size;
+		done += size;
+		len -= size;
+		
+		if(dst_pos > dst->file_size)
+			smp_store_release(&dst->file_size, dst_pos);
+	}
+	
+	if(done)
+		dax_persist_inode(fs_vfs, dst);
+	
+out:
+	unlock_inode_pair(src, dst);
+	unlock_copy_ranges(src, &src_range, dst, &dst_range);
+	up_read(&fs_vfs->snapshot_rwsem);
+	
+	return done ? done : ret;
+}
@@ -0,0 +1,258 @@
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/shrinker.h>
+
+#include "../include/fs_pool.h"
+#include "../include/fs_dax.h"
+
+/*
+Pool memory
+
+Every disk block is backed by its own page so free blocks can be handed back to the page allocator
+The pages are allocated in physically contiguous segments of 2^FS_POOL_SEGMENT_ORDER pages which are split into order 0 pages
+page->private holds the block number of the page
+
+Under memory pressure the shrinker takes free blocks above fs_vfs->pool_reserve off the super block chain, then off the zero pool (see fs/fs_zero.c), and frees their pages
+get_free_block() allocates new pages for released blocks when the number of free blocks drops below fs_vfs->pool_low_watermark
+
+The pool can instead be placed on a DAX device (see fs/fs_dax.c), it then has no pages and is never shrunk
+*/
+
+static void set_pool_page(struct fs_vfs * fs_vfs, int block_num, struct page * page)
+{
+	fs_vfs->pool_pages[block_num] = page;
+	set_page_private(page, block_num);
+}
+
+int allocate_pool(struct fs_vfs * fs_vfs)
+{
+	BUILD_BUG_ON(FS_BLOCK_SIZE != PAGE_SIZE);
+	
+	int num_blocks = fs_vfs->total_num_disk_blocks;
+	int order = FS_POOL_SEGMENT_ORDER;
+	int block_num = 0;
+	
+	fs_vfs->pool_pages = kvcalloc(num_blocks, sizeof(struct page *), GFP_KERNEL);
+	if(!fs_vfs->pool_pages)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : pool page table kvmalloc error\n");
+		return -FS_EMALLOC;
+	}
+	
+	while(block_num < num_blocks)
+	{
+		order = min(order, ilog2(num_blocks - block_num));
+		
+		gfp_t gfp = order ? (GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY) : GFP_KERNEL;
+		struct page * page = alloc_pages(gfp, order);
+		if(!page)
+		{
+			if(order == 0)
+			{
+				printk(KERN_ERR "FILE_SYSTEM_ERROR : pool page allocation error\n");
+				destroy_pool(fs_vfs);
+				return -FS_EMALLOC;
+			}
+			
+			//Fall back to smaller segments when memory is fragmented
+			order -= 1;
+			continue;
+		}
+		
+		split_page(page, order);
+		
+		for(int i = 0; i < (1 << order); i++)
+		{
+			set_pool_page(fs_vfs, block_num + i, page + i);
+		}
+		block_num += 1 << order;
+	}
+	
+	return 0;
+}
+
+void destroy_pool(struct fs_vfs * fs_vfs)
+{
+	if(!fs_vfs->pool_pages)
+		return;
+	
+	for(int i = 0; i < fs_vfs->total_num_disk_blocks; i++)
+	{
+		if(fs_vfs->pool_pages[i])
+		{
+			set_page_private(fs_vfs->pool_pages[i], 0);
+			__free_page(fs_vfs->pool_pages[i]);
+		}
+	}
+	
+	kvfree(fs_vfs->pool_pages);
+	fs_vfs->pool_pages = NULL;
+}
+
+void * pool_block_addr(struct fs_vfs * fs_vfs, int block_num)
+{
+	if(fs_dax_enabled(fs_vfs))
+		return dax_block_addr(fs_vfs, block_num);
+	
+	if(!fs_vfs->pool_pages[block_num])
+		return NULL;
+	
+	return page_address(fs_vfs->pool_pages[block_num]);
+}
+
+/*
+Returns the block number of the pool page containing addr or -1 if addr is not in the pool
+*/
+int pool_addr_to_block_num(struct fs_vfs * fs_vfs, void * addr)
+{
+	if(fs_dax_enabled(fs_vfs))
+		return dax_addr_to_block_num(fs_vfs, addr);
+	
+	if(!virt_addr_valid(addr))
+		return -1;
+	
+	struct page * page = virt_to_page(addr);
+	int block_num = page_private(page);
+	
+	if(block_num < 0 || block_num >= fs_vfs->total_num_disk_blocks || fs_vfs->pool_pages[block_num] != page)
+		return -1;
+	
+	return block_num;
+}
+
+/*
+Frees the pages of up to nr_blocks free blocks, the free blocks above fs_vfs->pool_reserve are never released
+The free blocks reserved for buffered appends (see fs/fs_delalloc.c) are kept on top of the reserve, every released block is claimed first (see claim_free_blocks())
+Returns the number of blocks released
+Note :- Never waits for the file system locks as it is called from memory reclaim
+*/
+long release_free_blocks(struct fs_vfs * fs_vfs, long nr_blocks)
+{
+	long released = 0;
+	
+	LIST_HEAD(releasing);
+	
+	int group_num = 0;
+	int empty_groups = 0;
+	
+	//The groups are drained round robin so that no group is left without free blocks
+	while(released < nr_blocks && claim_free_blocks(fs_vfs, 1, fs_vfs->pool_reserve))
+	{
+		struct fs_superblock * group = &fs_vfs->groups[group_num];
+		group_num = (group_num + 1) % fs_vfs->num_groups;
+		
+		//The block is only made visible on the released list once its page is gone
+		struct fs_block * block = take_free_block(fs_vfs, group, &releasing, -1, true);
+		if(!block)
+			block = take_zero_pool_block(fs_vfs, group, &releasing, true);
+		if(!block)
+		{
+			percpu_counter_inc(&fs_vfs->unreserved_disk_blocks);
+			if(++empty_groups == fs_vfs->num_groups)
+				break;
+			continue;
+		}
+		empty_groups = 0;
+		
+		struct page * page = fs_vfs->pool_pages[block->block_num];
+		
+		block->block_addr = 0;
+		fs_vfs->pool_pages[block->block_num] = NULL;
+		set_page_private(page, 0);
+		__free_page(page);
+		
+		spin_lock(&fs_vfs->pool_lock);
+		list_move(&block->fs_vfs_list, &fs_vfs->released_disk_block_list);
+		fs_vfs->num_released_disk_blocks += 1;
+		spin_unlock(&fs_vfs->pool_lock);
+		
+		released += 1;
+	}
+	
+	return released;
+}
+
+/*
+Allocates new pages for up to nr_blocks released blocks and puts them back on the super block chain
+Returns the number of blocks taken back
+*/
+int repopulate_pool(struct fs_vfs * fs_vfs, int nr_blocks)
+{
+	int repopulated = 0;
+	
+	while(repopulated < nr_blocks)
+	{
+		struct page * page = alloc_page(GFP_KERNEL | __GFP_NOWARN);
+		if(!page)
+			break;
+		
+		spin_lock(&fs_vfs->pool_lock);
+		struct fs_block * block = list_first_entry_or_null(&fs_vfs->released_disk_block_list, struct fs_block, fs_vfs_list);
+		if(block)
+		{
+			list_del_init(&block->fs_vfs_list);
+			fs_vfs->num_released_disk_blocks -= 1;
+		}
+		spin_unlock(&fs_vfs->pool_lock);
+		
+		if(!block)
+		{
+			__free_page(page);
+			break;
+		}
+		
+		set_pool_page(fs_vfs, block->block_num, page);
+		block->block_addr = (uintptr_t)page_address(page);
+		
+		put_free_block(fs_vfs, block);
+		repopulated += 1;
+	}
+	
+	return repopulated;
+}
+
+static unsigned long fs_pool_count_objects(struct shrinker * shrinker, struct shrink_control * sc)
+{
+	struct fs_vfs * fs_vfs = shrinker->private_data;
+	long releasable = percpu_counter_read_positive(&fs_vfs->unreserved_disk_blocks) - fs_vfs->pool_reserve;
+	
+	return (releasable > 0) ? releasable : SHRINK_EMPTY;
+}
+
+static unsigned long fs_pool_scan_objects(struct shrinker * shrinker, struct shrink_control * sc)
+{
+	struct fs_vfs * fs_vfs = shrinker->private_data;
+	long released = release_free_blocks(fs_vfs, sc->nr_to_scan);
+	
+	return released ? released : SHRINK_STOP;
+}
+
+int initialise_pool_shrinker(struct fs_vfs * fs_vfs)
+{
+	//Blocks on a DAX device cannot be handed to the page allocator
+	if(fs_dax_enabled(fs_vfs))
+		return 0;
+	
+	fs_vfs->pool_shrinker = shrinker_alloc(0, "ramfs-pool");
+	if(!fs_vfs->pool_shrinker)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : pool shrinker allocation error\n");
+		return -FS_EMALLOC;
+	}
+	
+	fs_vfs->pool_shrinker->count_objects = fs_pool_count_objects;
+	fs_vfs->pool_shrinker->scan_objects = fs_pool_scan_objects;
+	fs_vfs->pool_shrinker->private_data = fs_vfs;
+	
+	shrinker_register(fs_vfs->pool_shrinker);
+	
+	return 0;
+}
+
+void destroy_pool_shrinker(struct fs_vfs * fs_vfs)
+{
+	if(fs_vfs->pool_shrinker)
+		shrinker_free(fs_vfs->pool_shrinker);
+	fs_vfs->pool_shrinker = NULL;
+}
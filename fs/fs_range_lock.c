@@ -0,0 +1,106 @@
+#include <linux/interval_tree_generic.h>
+#include <linux/sched.h>
+
+#include "../include/fs_range_lock.h"
+
+/*
+Range locks
+
+Every locked or waiting range is kept in an interval tree
+A new range counts the conflicting ranges already in the tree (blocking_ranges) and sleeps until they have all been unlocked
+Unlocking a range decrements the count of every conflicting range requested after it and wakes the ranges whose count drops to 0
+The tree lock is only held while the tree is updated, never while a range is held
+*/
+
+#define FS_RANGE_START(lock) ((lock)->start)
+#define FS_RANGE_LAST(lock) ((lock)->last)
+
+INTERVAL_TREE_DEFINE(struct fs_range_lock, rb, u64, __subtree_last, FS_RANGE_START, FS_RANGE_LAST, static, fs_range_tree)
+
+void fs_range_lock_tree_init(struct fs_range_lock_tree * tree)
+{
+	tree->root = RB_ROOT_CACHED;
+	tree->seq = 0;
+	spin_lock_init(&tree->lock);
+}
+
+/*
+Initialises a range lock for the inclusive range [start, last]
+*/
+void fs_range_lock_init(struct fs_range_lock * lock, u64 start, u64 last)
+{
+	RB_CLEAR_NODE(&lock->rb);
+	lock->start = start;
+	lock->last = last;
+	lock->write = false;
+	lock->seq = 0;
+	lock->blocking_ranges = 0;
+	lock->task = NULL;
+}
+
+static inline bool ranges_conflict(struct fs_range_lock * a, struct fs_range_lock * b)
+{
+	return a->write || b->write;
+}
+
+static void fs_range_lock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock, bool write)
+{
+	struct fs_range_lock * node;
+	
+	lock->write = write;
+	lock->task = current;
+	lock->blocking_ranges = 0;
+	
+	spin_lock(&tree->lock);
+	
+	lock->seq = tree->seq++;
+	for(node = fs_range_tree_iter_first(&tree->root, lock->start, lock->last); node; node = fs_range_tree_iter_next(node, lock->start, lock->last))
+	{
+		if(ranges_conflict(lock, node))
+			lock->blocking_ranges += 1;
+	}
+	fs_range_tree_insert(lock, &tree->root);
+	
+	spin_unlock(&tree->lock);
+	
+	for(;;)
+	{
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		if(!READ_ONCE(lock->blocking_ranges))
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+void fs_range_read_lock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock)
+{
+	fs_range_lock(tree, lock, false);
+}
+
+void fs_range_write_lock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock)
+{
+	fs_range_lock(tree, lock, true);
+}
+
+void fs_range_unlock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock)
+{
+	struct fs_range_lock * node;
+	
+	spin_lock(&tree->lock);
+	
+	fs_range_tree_remove(lock, &tree->root);
+	
+	//Only the ranges requested after this one have counted it
+	for(node = fs_range_tree_iter_first(&tree->root, lock->start, lock->last); node; node = fs_range_tree_iter_next(node, lock->start, lock->last))
+	{
+		if(node->seq < lock->seq || !ranges_conflict(lock, node))
+			continue;
+		
+		WRITE_ONCE(node->blocking_ranges, node->blocking_ranges - 1);
+		if(!node->blocking_ranges)
+			wake_up_process(node->task);
+	}
+	
+	spin_unlock(&tree->lock);
+}
@@ -0,0 +1,200 @@
+#include <linux/kthread.h>
+#include <linux/sched.h>
+
+#include "../include/fs_reclaim.h"
+#include "../include/fs_dax.h"
+
+/*
+Deferred reclamation
+
+Unlinking or truncating a large file to zero detaches its disk map from the inode in O(1) (see trim_inode_disk_map()),
+walking up to FS_MAX_INODE_BLOCKS blocks and their indirect tables to drop them is left to a low priority kthread worker
+Maps of fewer than FS_RECLAIM_MIN_BLOCKS blocks are dropped by the caller, queueing them would cost more than the walk
+
+The blocks of the queued maps are counted in fs_vfs->reclaim_pending_blocks until they are dropped
+An allocation which finds no free block drops the queued maps itself and waits for the map the worker is dropping before it gives up
+(see reclaim_pending_blocks())
+
+Indirect tables which no disk map points to any more are retired to the worker as well, lockless lookups may still walk them,
+they go back to the pool after an RCU grace period (see retire_table_block())
+
+Disk maps are not deferred in DAX mode, the reverse map on the device has to stop naming the inode as owner of its blocks before the inode can be reused
+*/
+
+static struct fs_reclaim * pop_reclaim(struct fs_vfs * fs_vfs)
+{
+	spin_lock(&fs_vfs->reclaim_lock);
+	struct fs_reclaim * reclaim = list_first_entry_or_null(&fs_vfs->reclaim_list, struct fs_reclaim, reclaim_list);
+	if(reclaim)
+		list_del(&reclaim->reclaim_list);
+	spin_unlock(&fs_vfs->reclaim_lock);
+	
+	return reclaim;
+}
+
+static void release_reclaim(struct fs_vfs * fs_vfs, struct fs_reclaim * reclaim)
+{
+	free_disk_map(fs_vfs, &reclaim->disk_map);
+	
+	atomic64_sub(reclaim->disk_map.num_blocks, &fs_vfs->reclaim_pending_blocks);
+	atomic64_add(reclaim->disk_map.num_blocks, &fs_vfs->reclaimed_blocks);
+	kfree(reclaim);
+}
+
+/*
+Returns the retired indirect tables to the pool, one RCU grace period covers all of them
+*/
+static void release_retired_tables(struct fs_vfs * fs_vfs)
+{
+	struct fs_retired_table * retired, * next;
+	LIST_HEAD(tables);
+	
+	spin_lock(&fs_vfs->reclaim_lock);
+	list_splice_init(&fs_vfs->retired_tables, &tables);
+	spin_unlock(&fs_vfs->reclaim_lock);
+	
+	if(list_empty(&tables))
+		return;
+	
+	synchronize_rcu();
+	
+	list_for_each_entry_safe(retired, next, &tables, retired_list)
+	{
+		fs_block_put(fs_vfs, retired->table);
+		atomic64_dec(&fs_vfs->reclaim_pending_blocks);
+		kfree(retired);
+	}
+}
+
+static void reclaim_work(struct kthread_work * work)
+{
+	struct fs_vfs * fs_vfs = container_of(work, struct fs_vfs, reclaim_work);
+	struct fs_reclaim * reclaim;
+	
+	while((reclaim = pop_reclaim(fs_vfs)))
+	{
+		release_reclaim(fs_vfs, reclaim);
+		cond_resched();
+	}
+	
+	release_retired_tables(fs_vfs);
+}
+
+/*
+Queues a disk map detached with detach_inode_disk_map() for the reclaim worker
+Returns false if the caller has to drop the map itself, the map is small, the worker is not running or the queue entry could not be allocated
+*/
+bool defer_disk_map_release(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map)
+{
+	struct kthread_worker * worker = READ_ONCE(fs_vfs->reclaim_worker);
+	
+	if(!worker || fs_dax_enabled(fs_vfs) || disk_map->num_blocks < FS_RECLAIM_MIN_BLOCKS)
+		return false;
+	
+	struct fs_reclaim * reclaim = kmalloc(sizeof(struct fs_reclaim), GFP_KERNEL);
+	if(!reclaim)
+		return false;
+	
+	reclaim->disk_map = *disk_map;
+	atomic64_add(disk_map->num_blocks, &fs_vfs->reclaim_pending_blocks);
+	
+	spin_lock(&fs_vfs->reclaim_lock);
+	list_add_tail(&reclaim->reclaim_list, &fs_vfs->reclaim_list);
+	spin_unlock(&fs_vfs->reclaim_lock);
+	
+	kthread_queue_work(worker, &fs_vfs->reclaim_work);
+	
+	return true;
+}
+
+/*
+Returns an indirect table which no disk map points to any more to the pool after an RCU grace period
+The table is handed to the reclaim worker, the caller waits for the grace period itself if the worker is not running
+Note :- This function may sleep
+*/
+void retire_table_block(struct fs_vfs * fs_vfs, struct fs_block * table)
+{
+	struct kthread_worker * worker = READ_ONCE(fs_vfs->reclaim_worker);
+	struct fs_retired_table * retired = worker ? kmalloc(sizeof(struct fs_retired_table), GFP_KERNEL) : NULL;
+	
+	if(!retired)
+	{
+		synchronize_rcu();
+		fs_block_put(fs_vfs, table);
+		return;
+	}
+	
+	retired->table = table;
+	atomic64_inc(&fs_vfs->reclaim_pending_blocks);
+	
+	spin_lock(&fs_vfs->reclaim_lock);
+	list_add_tail(&retired->retired_list, &fs_vfs->retired_tables);
+	spin_unlock(&fs_vfs->reclaim_lock);
+	
+	kthread_queue_work(worker, &fs_vfs->reclaim_work);
+}
+
+/*
+Drops the queued disk maps and the retired tables in the caller instead of leaving them to the worker, then waits for the map the worker is dropping
+Returns true if blocks were pending, the caller retries its allocation
+Note :- This function must not be called while holding a superblock mutex or fs_vfs->dedup_lock, dropping blocks takes them
+*/
+bool reclaim_pending_blocks(struct fs_vfs * fs_vfs)
+{
+	struct fs_reclaim * reclaim;
+	
+	if(!atomic64_read(&fs_vfs->reclaim_pending_blocks))
+		return false;
+	
+	while((reclaim = pop_reclaim(fs_vfs)))
+	{
+		release_reclaim(fs_vfs, reclaim);
+		atomic64_inc(&fs_vfs->reclaim_steals);
+	}
+	release_retired_tables(fs_vfs);
+	
+	struct kthread_worker * worker = READ_ONCE(fs_vfs->reclaim_worker);
+	if(worker)
+		kthread_flush_work(&fs_vfs->reclaim_work);
+	
+	return true;
+}
+
+int initialise_reclaim(struct fs_vfs * fs_vfs)
+{
+	struct kthread_worker * worker = kthread_create_worker(0, "ramfs_reclaim");
+	if(IS_ERR(worker))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Error starting the reclaim worker\n");
+		return -FS_EMALLOC;
+	}
+	set_user_nice(worker->task, MAX_NICE);
+	
+	kthread_init_work(&fs_vfs->reclaim_work, reclaim_work);
+	WRITE_ONCE(fs_vfs->reclaim_worker, worker);
+	
+	printk("FILE_SYSTEM : Started the reclaim worker\n");
+	
+	return 0;
+}
+
+/*
+Stops the reclaim worker, the disk maps and tables still queued are dropped here
+Has to be called after destroy_inodes() so that the disk maps of the inodes are dropped by the worker
+*/
+void destroy_reclaim(struct fs_vfs * fs_vfs)
+{
+	struct kthread_worker * worker = fs_vfs->reclaim_worker;
+	struct fs_reclaim * reclaim;
+	
+	if(!worker)
+		return;
+	
+	//trim_inode_disk_map() stops queueing maps, the worker finishes the queued work before it exits
+	WRITE_ONCE(fs_vfs->reclaim_worker, NULL);
+	kthread_destroy_worker(worker);
+	
+	while((reclaim = pop_reclaim(fs_vfs)))
+		release_reclaim(fs_vfs, reclaim);
+	release_retired_tables(fs_vfs);
+}
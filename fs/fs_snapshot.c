@@ -0,0 +1,316 @@
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+
+#include "../include/fs_snapshot.h"
+#include "../include/fs_dax.h"
+
+/*
+File system snapshots
+
+A snapshot clones every allocated inode with clone_inode_disk_map(), so it costs one disk map copy per inode and no data copy
+The snapshot holds fs_vfs->snapshot_rwsem for writing which blocks every disk map modification, this makes the snapshot point in time across all inodes
+Clone inodes are taken from the free inode list and are kept on the snapshot, they never appear in fs_vfs->allocated_inode_list
+Snapshots are created, rolled back and destroyed through /sys/kernel/debug/ramfs/snapshot
+*/
+
+/*
+Returns an inode held by a snapshot (a clone or a scratch inode of a rollback) to the free list
+*/
+static void put_snapshot_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	trim_inode_disk_map(fs_vfs, inode);
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	list_add(&inode->fs_vfs_inode_list, &fs_vfs->free_inode_list);
+	fs_vfs->num_free_inodes += 1;
+	fs_vfs->num_snapshot_inodes -= 1;
+	mutex_unlock(&fs_vfs->vfs_lock);
+}
+
+static void release_snapshot_inodes(struct fs_vfs * fs_vfs, struct fs_snapshot * snapshot)
+{
+	for(int i = 0; i < snapshot->num_entries; i++)
+	{
+		struct fs_inode * clone = snapshot->entries[i].clone;
+		if(clone)
+			put_snapshot_inode(fs_vfs, clone);
+	}
+}
+
+struct fs_snapshot * create_snapshot(struct fs_vfs * fs_vfs)
+{
+	if(fs_dax_enabled(fs_vfs))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Snapshots are not supported on a DAX device\n");
+		return NULL;
+	}
+	
+	struct fs_snapshot * snapshot = kmalloc(sizeof(struct fs_snapshot), GFP_KERNEL);
+	if(!snapshot)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : snapshot kmalloc error\n");
+		return NULL;
+	}
+	
+	snapshot->num_entries = 0;
+	
+	down_write(&fs_vfs->snapshot_rwsem);
+	
+	/*
+	Inodes are only allocated and freed under vfs_lock, so the number of allocated inodes cannot grow between counting them and taking the clones
+	clone_inode_disk_map() allocates the indirect tables of the clones, the allocator and the reclaim worker it may wait for never take vfs_lock
+	*/
+	mutex_lock(&fs_vfs->vfs_lock);
+	
+	struct fs_inode * inode;
+	int num_inodes = 0;
+	list_for_each_entry(inode, &fs_vfs->allocated_inode_list, fs_vfs_inode_list)
+	{
+		num_inodes += 1;
+	}
+	
+	if(num_inodes > fs_vfs->num_free_inodes)
+	{
+		mutex_unlock(&fs_vfs->vfs_lock);
+		up_write(&fs_vfs->snapshot_rwsem);
+		kfree(snapshot);
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Not enough free inodes for a snapshot of %d inodes\n", num_inodes);
+		return NULL;
+	}
+	
+	snapshot->entries = kvmalloc_array(num_inodes, sizeof(struct fs_snapshot_entry), GFP_KERNEL);
+	if(!snapshot->entries)
+	{
+		mutex_unlock(&fs_vfs->vfs_lock);
+		up_write(&fs_vfs->snapshot_rwsem);
+		kfree(snapshot);
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : snapshot entries kvmalloc error\n");
+		return NULL;
+	}
+	
+	list_for_each_entry(inode, &fs_vfs->allocated_inode_list, fs_vfs_inode_list)
+	{
+		struct fs_inode * clone = list_first_entry(&fs_vfs->free_inode_list, struct fs_inode, fs_vfs_inode_list);
+		//The node stays valid while the clone is on no list, destroy_inode() unlinks it again
+		list_del_init(&clone->fs_vfs_inode_list);
+		fs_vfs->num_free_inodes -= 1;
+		
+		snapshot->entries[snapshot->num_entries].inode_num = inode->inode_num;
+		snapshot->entries[snapshot->num_entries].generation = inode->generation;
+		snapshot->entries[snapshot->num_entries].clone = clone;
+		snapshot->num_entries += 1;
+	}
+	
+	fs_vfs->num_snapshot_inodes += snapshot->num_entries;
+	snapshot->snapshot_id = fs_vfs->next_snapshot_id++;
+	list_add_tail(&snapshot->fs_vfs_snapshot_list, &fs_vfs->snapshot_list);
+	
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	int ret = 0;
+	for(int i = 0; i < snapshot->num_entries && !ret; i++)
+	{
+		struct fs_inode * src = fs_vfs->inode_table[snapshot->entries[i].inode_num];
+		ret = clone_inode_disk_map(fs_vfs, src, snapshot->entries[i].clone);
+	}
+	
+	up_write(&fs_vfs->snapshot_rwsem);
+	
+	if(ret)
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Creating snapshot failed:%d\n", ret);
+		destroy_snapshot(fs_vfs, snapshot);
+		return NULL;
+	}
+	
+	printk("FILE_SYSTEM : Created snapshot %d of %d inodes\n", snapshot->snapshot_id, snapshot->num_entries);
+	return snapshot;
+}
+
+void destroy_snapshot(struct fs_vfs * fs_vfs, struct fs_snapshot * snapshot)
+{
+	release_snapshot_inodes(fs_vfs, snapshot);
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	list_del(&snapshot->fs_vfs_snapshot_list);
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	kvfree(snapshot->entries);
+	kfree(snapshot);
+}
+
+/*
+Brings every inode recorded in the snapshot back to its contents at the time of the snapshot
+The snapshot is kept and can be rolled back to again
+
+The rollback holds fs_vfs->snapshot_rwsem for writing throughout, so no writer sees a partially rolled back file system
+The contents of every inode are cloned into a scratch inode first, the scratch maps replace the live maps (see exchange_inode_disk_map())
+only once every clone succeeded, so a failed rollback leaves the file system untouched
+Inodes deleted or reused since the snapshot are skipped, deleting an inode drops its blocks with trim_inode_disk_map() before the inode
+can be allocated again and that waits for snapshot_rwsem, so the generations checked at the start hold until the rollback ends
+*/
+int rollback_snapshot(struct fs_vfs * fs_vfs, struct fs_snapshot * snapshot)
+{
+	struct fs_inode ** scratch = kvcalloc(snapshot->num_entries, sizeof(struct fs_inode *), GFP_KERNEL);
+	if(!scratch)
+		return -FS_EMALLOC;
+	
+	int ret = 0;
+	int num_skipped = 0;
+	
+	down_write(&fs_vfs->snapshot_rwsem);
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	for(int i = 0; i < snapshot->num_entries; i++)
+	{
+		struct fs_inode * inode = fs_vfs->inode_table[snapshot->entries[i].inode_num];
+		if(!inode->allocated || inode->generation != snapshot->entries[i].generation)
+		{
+			num_skipped += 1;
+			continue;
+		}
+		
+		if(fs_vfs->num_free_inodes == 0)
+		{
+			printk(KERN_ERR "FILE_SYSTEM_ERROR : Not enough free inodes to roll back snapshot %d\n", snapshot->snapshot_id);
+			ret = -FS_ENO_FREE_INODE;
+			break;
+		}
+		
+		scratch[i] = list_first_entry(&fs_vfs->free_inode_list, struct fs_inode, fs_vfs_inode_list);
+		list_del_init(&scratch[i]->fs_vfs_inode_list);
+		fs_vfs->num_free_inodes -= 1;
+		fs_vfs->num_snapshot_inodes += 1;
+	}
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	for(int i = 0; i < snapshot->num_entries && !ret; i++)
+	{
+		if(scratch[i])
+			ret = clone_inode_disk_map(fs_vfs, snapshot->entries[i].clone, scratch[i]);
+	}
+	
+	//Nothing fails past this point
+	for(int i = 0; i < snapshot->num_entries && !ret; i++)
+	{
+		if(scratch[i])
+			exchange_inode_disk_map(fs_vfs, fs_vfs->inode_table[snapshot->entries[i].inode_num], scratch[i]);
+	}
+	
+	up_write(&fs_vfs->snapshot_rwsem);
+	
+	//The scratch inodes hold the replaced maps, or the unused clones when the rollback failed
+	for(int i = 0; i < snapshot->num_entries; i++)
+	{
+		if(scratch[i])
+			put_snapshot_inode(fs_vfs, scratch[i]);
+	}
+	kvfree(scratch);
+	
+	if(ret)
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Rolling back snapshot %d failed:%d\n", snapshot->snapshot_id, ret);
+	else
+		printk("FILE_SYSTEM : Rolled back snapshot %d, %d deleted or reused inodes skipped\n", snapshot->snapshot_id, num_skipped);
+	
+	return ret;
+}
+
+/*
+Destroys every snapshot, has to be called before destroy_inodes()
+*/
+void destroy_snapshots(struct fs_vfs * fs_vfs)
+{
+	struct fs_snapshot * snapshot, * next;
+	
+	mutex_lock(&fs_vfs->snapshot_lock);
+	list_for_each_entry_safe(snapshot, next, &fs_vfs->snapshot_list, fs_vfs_snapshot_list)
+	{
+		destroy_snapshot(fs_vfs, snapshot);
+	}
+	mutex_unlock(&fs_vfs->snapshot_lock);
+}
+
+/*
+Returns the snapshot with the given id, NULL if there is none
+Note :- This function has to be called while holding fs_vfs->snapshot_lock
+*/
+static struct fs_snapshot * find_snapshot(struct fs_vfs * fs_vfs, int snapshot_id)
+{
+	struct fs_snapshot * snapshot, * found = NULL;
+	
+	mutex_lock(&fs_vfs->vfs_lock);
+	list_for_each_entry(snapshot, &fs_vfs->snapshot_list, fs_vfs_snapshot_list)
+	{
+		if(snapshot->snapshot_id == snapshot_id)
+		{
+			found = snapshot;
+			break;
+		}
+	}
+	mutex_unlock(&fs_vfs->vfs_lock);
+	
+	return found;
+}
+
+/*
+Writing "create", "rollback <id>" or "destroy <id>" to /sys/kernel/debug/ramfs/snapshot creates, rolls back or destroys a snapshot
+The id of a new snapshot is printed to the kernel log
+*/
+static ssize_t snapshot_control_write(struct file * file, const char __user * ubuf, size_t count, loff_t * ppos)
+{
+	struct fs_vfs * fs_vfs = file->private_data;
+	struct fs_snapshot * snapshot;
+	char buf[32];
+	int snapshot_id;
+	int ret = 0;
+	
+	if(count >= sizeof(buf))
+		return -EINVAL;
+	
+	if(copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	
+	mutex_lock(&fs_vfs->snapshot_lock);
+	
+	if(sysfs_streq(buf, "create"))
+	{
+		ret = create_snapshot(fs_vfs) ? 0 : -EIO;
+	}
+	else if(sscanf(buf, "rollback %d", &snapshot_id) == 1)
+	{
+		snapshot = find_snapshot(fs_vfs, snapshot_id);
+		ret = !snapshot ? -ENOENT : (rollback_snapshot(fs_vfs, snapshot) ? -EIO : 0);
+	}
+	else if(sscanf(buf, "destroy %d", &snapshot_id) == 1)
+	{
+		snapshot = find_snapshot(fs_vfs, snapshot_id);
+		if(snapshot)
+			destroy_snapshot(fs_vfs, snapshot);
+		ret = snapshot ? 0 : -ENOENT;
+	}
+	else
+	{
+		ret = -EINVAL;
+	}
+	
+	mutex_unlock(&fs_vfs->snapshot_lock);
+	
+	return ret ? ret : count;
+}
+
+static const struct file_operations snapshot_control_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = snapshot_control_write,
+	.llseek = noop_llseek,
+};
+
+/*
+Creates the snapshot control file, has to be called after initialise_fs_stats()
+*/
+void initialise_snapshot(struct fs_vfs * fs_vfs)
+{
+	debugfs_create_file("snapshot", 0200, fs_vfs->stats_dentry, fs_vfs, &snapshot_control_fops);
+}
@@ -0,0 +1,90 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "../include/fs_stats.h"
+#include "../include/fs_block.h"
+#include "../include/fs_copy.h"
+#include "../include/fs_defrag.h"
+#include "../include/fs_dax.h"
+
+/*
+File system counters are exported through debugfs in /sys/kernel/debug/ramfs/stats
+*/
+
+static int fs_stats_show(struct seq_file * m, void * v)
+{
+	struct fs_vfs * fs_vfs = m->private;
+	struct fs_frag_stats frag_stats;
+	
+	seq_printf(m, "total_disk_blocks %d\n", fs_vfs->total_num_disk_blocks);
+	seq_printf(m, "free_disk_blocks %lld\n", percpu_counter_sum_positive(&fs_vfs->num_free_disk_blocks));
+	seq_printf(m, "free_inodes %d\n", fs_vfs->num_free_inodes);
+	seq_printf(m, "table_blocks %lld\n", atomic64_read(&fs_vfs->table_blocks));
+	seq_printf(m, "released_disk_blocks %d\n", fs_vfs->num_released_disk_blocks);
+	seq_printf(m, "pool_reserve %d\n", fs_vfs->pool_reserve);
+	seq_printf(m, "pool_low_watermark %d\n", fs_vfs->pool_low_watermark);
+	seq_printf(m, "dax_backend %d\n", fs_dax_enabled(fs_vfs));
+	seq_printf(m, "dax_recovered_inodes %d\n", fs_vfs->dax_recovered_inodes);
+	seq_printf(m, "dax_recovered_blocks %d\n", fs_vfs->dax_recovered_blocks);
+	
+	seq_printf(m, "alloc_groups %d\n", fs_vfs->num_groups);
+	for(int g = 0; g < fs_vfs->num_groups; g++)
+	{
+		seq_printf(m, "group%d_free_disk_blocks %d\n", g, READ_ONCE(fs_vfs->groups[g].num_free_disk_blocks));
+		seq_printf(m, "group%d_zeroed_disk_blocks %d\n", g, READ_ONCE(fs_vfs->groups[g].num_zeroed_blocks));
+		seq_printf(m, "group%d_zero_pending_blocks %d\n", g, READ_ONCE(fs_vfs->groups[g].num_zero_pending));
+	}
+	
+	seq_printf(m, "streaming_copy %s\n", copy_impl_name(copy_nontemporal_impl()));
+	
+	seq_printf(m, "dedup_enabled %d\n", fs_vfs->dedup_enabled);
+	seq_printf(m, "dedup_hits %lld\n", atomic64_read(&fs_vfs->dedup_hits));
+	seq_printf(m, "zero_block_hits %lld\n", atomic64_read(&fs_vfs->zero_block_hits));
+	s64 shared_blocks_saved = percpu_counter_sum_positive(&fs_vfs->shared_blocks_saved);
+	seq_printf(m, "shared_blocks_saved %lld\n", shared_blocks_saved);
+	seq_printf(m, "shared_bytes_saved %lld\n", shared_blocks_saved * FS_BLOCK_SIZE);
+	
+	seq_printf(m, "snapshot_inodes %d\n", fs_vfs->num_snapshot_inodes);
+	seq_printf(m, "checkpoint_seq %d\n", fs_vfs->checkpoint_seq);
+	
+	get_frag_stats(fs_vfs, &frag_stats);
+	seq_printf(m, "mapped_blocks %ld\n", frag_stats.mapped_blocks);
+	seq_printf(m, "extents %ld\n", frag_stats.extents);
+	seq_printf(m, "fragmented_files %d\n", frag_stats.fragmented_files);
+	seq_printf(m, "alloc_goal_hits %lld\n", atomic64_read(&fs_vfs->alloc_goal_hits));
+	seq_printf(m, "defrag_migrated_blocks %lld\n", atomic64_read(&fs_vfs->defrag_migrated_blocks));
+	
+	seq_printf(m, "zero_pool_target %d\n", fs_vfs->zero_worker ? fs_vfs->zero_pool_target : 0);
+	seq_printf(m, "zero_pool_hits %lld\n", atomic64_read(&fs_vfs->zero_pool_hits));
+	seq_printf(m, "zero_pool_misses %lld\n", atomic64_read(&fs_vfs->zero_pool_misses));
+	seq_printf(m, "blocks_prezeroed %lld\n", atomic64_read(&fs_vfs->blocks_prezeroed));
+	
+	seq_printf(m, "delalloc_blocks %d\n", fs_vfs->delalloc_blocks);
+	seq_printf(m, "reserved_disk_blocks %lld\n", atomic64_read(&fs_vfs->reserved_disk_blocks));
+	seq_printf(m, "unreserved_disk_blocks %lld\n", percpu_counter_sum(&fs_vfs->unreserved_disk_blocks));
+	seq_printf(m, "delalloc_buffered_writes %lld\n", atomic64_read(&fs_vfs->delalloc_buffered_writes));
+	seq_printf(m, "delalloc_flushes %lld\n", atomic64_read(&fs_vfs->delalloc_flushes));
+	seq_printf(m, "delalloc_flushed_blocks %lld\n", atomic64_read(&fs_vfs->delalloc_flushed_blocks));
+	
+	seq_printf(m, "reclaim_pending_blocks %lld\n", atomic64_read(&fs_vfs->reclaim_pending_blocks));
+	seq_printf(m, "reclaimed_blocks %lld\n", atomic64_read(&fs_vfs->reclaimed_blocks));
+	seq_printf(m, "reclaim_steals %lld\n", atomic64_read(&fs_vfs->reclaim_steals));
+	
+	seq_printf(m, "batch_calls %lld\n", atomic64_read(&fs_vfs->batch_calls));
+	seq_printf(m, "batch_ops %lld\n", atomic64_read(&fs_vfs->batch_ops));
+	
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fs_stats);
+
+void initialise_fs_stats(struct fs_vfs * fs_vfs)
+{
+	fs_vfs->stats_dentry = debugfs_create_dir("ramfs", NULL);
+	debugfs_create_file("stats", 0444, fs_vfs->stats_dentry, fs_vfs, &fs_stats_fops);
+}
+
+void destroy_fs_stats(struct fs_vfs * fs_vfs)
+{
+	debugfs_remove_recursive(fs_vfs->stats_dentry);
+	fs_vfs->stats_dentry = NULL;
+}
@@ -1,20 +1,103 @@
 #include "../include/fs_vfs.h"
 
-void intialise_file_system(struct fs_vfs * fs_vfs)
+int intialise_file_system(struct fs_vfs * fs_vfs)
 {
 	printk("FILE_SYSTEM : Initializing file system\n");
 	
-	INIT_LIST_HEAD(&fs_vfs->super_block_disk_list);
-	INIT_LIST_HEAD(&fs_vfs->free_disk_block_list);
-	INIT_LIST_HEAD(&fs_vfs->allocated_disk_block_list);
+	INIT_LIST_HEAD(&fs_vfs->released_disk_block_list);
 	
 	INIT_LIST_HEAD(&fs_vfs->free_inode_list);
 	INIT_LIST_HEAD(&fs_vfs->allocated_inode_list);
 	
 	mutex_init(&fs_vfs->vfs_lock);
 	
+	init_rwsem(&fs_vfs->snapshot_rwsem);
+	INIT_LIST_HEAD(&fs_vfs->snapshot_list);
+	fs_vfs->next_snapshot_id = 0;
+	fs_vfs->num_snapshot_inodes = 0;
+	mutex_init(&fs_vfs->snapshot_lock);
+	fs_vfs->inode_table = NULL;
+	fs_vfs->inode_cache = NULL;
+	atomic64_set(&fs_vfs->table_blocks, 0);
+	
+	fs_vfs->groups = NULL;
+	fs_vfs->num_groups = FS_NUM_ALLOC_GROUPS;
+	fs_vfs->blocks_per_group = 0;
 	fs_vfs->total_num_disk_blocks = FILE_SYSTEM_SIZE/FS_BLOCK_SIZE;
-	fs_vfs->num_free_disk_blocks = FILE_SYSTEM_SIZE/FS_BLOCK_SIZE;
 	fs_vfs->num_free_inodes = 0;
+	
+	fs_vfs->pool_pages = NULL;
+	spin_lock_init(&fs_vfs->pool_lock);
+	fs_vfs->num_released_disk_blocks = 0;
+	fs_vfs->pool_reserve = FS_POOL_RESERVE_BLOCKS;
+	fs_vfs->pool_low_watermark = FS_POOL_LOW_WATERMARK;
+	fs_vfs->pool_shrinker = NULL;
+	
+	fs_vfs->dax_bdev_file = NULL;
+	fs_vfs->dax_dev = NULL;
+	fs_vfs->dax_base = NULL;
+	fs_vfs->dax_super = NULL;
+	fs_vfs->dax_inodes = NULL;
+	fs_vfs->dax_rmap = NULL;
+	fs_vfs->dax_data = NULL;
+	fs_vfs->dax_recovered_inodes = 0;
+	fs_vfs->dax_recovered_blocks = 0;
+	
+	fs_vfs->dedup_enabled = false;
+	fs_vfs->zero_block = NULL;
+	hash_init(fs_vfs->dedup_table);
+	mutex_init(&fs_vfs->dedup_lock);
+	atomic64_set(&fs_vfs->dedup_hits, 0);
+	atomic64_set(&fs_vfs->zero_block_hits, 0);
+	
+	fs_vfs->block_table = NULL;
+	fs_vfs->dirty_bitmap = NULL;
+	
+	fs_vfs->checkpoint_path = NULL;
+	fs_vfs->checkpoint_seq = 0;
+	fs_vfs->checkpoint_chain = 0;
+	mutex_init(&fs_vfs->checkpoint_lock);
+	
+	atomic64_set(&fs_vfs->alloc_goal_hits, 0);
+	fs_vfs->defrag_task = NULL;
+	atomic64_set(&fs_vfs->defrag_migrated_blocks, 0);
+	mutex_init(&fs_vfs->frag_stats_lock);
+	fs_vfs->frag_stats_time = 0;
+	
+	fs_vfs->zero_worker = NULL;
+	fs_vfs->zero_pool_target = 0;
+	atomic64_set(&fs_vfs->zero_pool_hits, 0);
+	atomic64_set(&fs_vfs->zero_pool_misses, 0);
+	atomic64_set(&fs_vfs->blocks_prezeroed, 0);
+	
+	fs_vfs->delalloc_blocks = 0;
+	atomic64_set(&fs_vfs->reserved_disk_blocks, 0);
+	fs_vfs->delalloc_worker = NULL;
+	atomic64_set(&fs_vfs->delalloc_buffered_writes, 0);
+	atomic64_set(&fs_vfs->delalloc_flushes, 0);
+	atomic64_set(&fs_vfs->delalloc_flushed_blocks, 0);
+	
+	fs_vfs->reclaim_worker = NULL;
+	spin_lock_init(&fs_vfs->reclaim_lock);
+	INIT_LIST_HEAD(&fs_vfs->reclaim_list);
+	INIT_LIST_HEAD(&fs_vfs->retired_tables);
+	atomic64_set(&fs_vfs->reclaim_pending_blocks, 0);
+	atomic64_set(&fs_vfs->reclaimed_blocks, 0);
+	atomic64_set(&fs_vfs->reclaim_steals, 0);
+	
+	atomic64_set(&fs_vfs->batch_calls, 0);
+	atomic64_set(&fs_vfs->batch_ops, 0);
+	
+	fs_vfs->stats_dentry = NULL;
+	
+	if(percpu_counter_init(&fs_vfs->shared_blocks_saved, 0, GFP_KERNEL))
+		return -FS_EMALLOC;
+	
+	return 0;
+}
+
+void destroy_file_system(struct fs_vfs * fs_vfs)
+{
+	percpu_counter_destroy(&fs_vfs->shared_blocks_saved);
 }
 
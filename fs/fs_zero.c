@@ -0,0 +1,150 @@
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+
+#include "../include/fs_zero.h"
+#include "../include/fs_dax.h"
+
+/*
+Pre-zeroing
+
+Blocks which are handed to files as holes or partially written blocks have to read back as zeros
+Instead of clearing them on the allocation path, put_free_block() queues freed blocks on the zero_pending_list of their group
+A kthread worker running at the lowest priority clears them and moves them to the zeroed pool of the group (zeroed_disk_block_list)
+When nothing is pending the worker tops up the zeroed pool from the free chain
+get_zeroed_block() takes zeroed blocks first and clears a block from the free chain itself only when the zeroed pool is empty
+
+Every group keeps at most fs_vfs->zero_pool_target zeroed plus pending blocks, the rest of the freed blocks go straight back to the free chain
+The zeroed and pending blocks are free blocks, they are counted in fs_vfs->num_free_disk_blocks and can be reserved or released by the pool shrinker
+Topping up the zeroed pool does not take blocks away from the reservations, get_reserved_blocks() falls back to the zero pool of a group
+get_free_block() only falls back to them when the free chain of a group is empty
+*/
+
+/*
+Moves the next block to clear off the group to the zeroing list, a pending block if there is one else a free block when the zeroed pool is below its target
+*/
+static struct fs_block * next_block_to_zero(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * zeroing)
+{
+	mutex_lock(&group->superblock_mutex);
+	
+	struct fs_block * block = list_first_entry_or_null(&group->zero_pending_list, struct fs_block, fs_vfs_list);
+	if(block)
+	{
+		list_move(&block->fs_vfs_list, zeroing);
+		group->num_zero_pending -= 1;
+	}
+	
+	bool top_up = !block && group->num_zeroed_blocks < fs_vfs->zero_pool_target && group->num_free_disk_blocks > fs_vfs->zero_pool_target;
+	
+	mutex_unlock(&group->superblock_mutex);
+	
+	if(top_up)
+	{
+		//The block stays free while it is cleared
+		block = take_free_block(fs_vfs, group, zeroing, -1, false);
+		if(block)
+			percpu_counter_inc(&fs_vfs->num_free_disk_blocks);
+	}
+	
+	return block;
+}
+
+static void zero_work(struct kthread_work * work)
+{
+	struct fs_vfs * fs_vfs = container_of(work, struct fs_vfs, zero_work);
+	LIST_HEAD(zeroing);
+	
+	for(int g = 0; g < fs_vfs->num_groups; g++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[g];
+		struct fs_block * block;
+		
+		while((block = next_block_to_zero(fs_vfs, group, &zeroing)))
+		{
+			clear_page((void *)block->block_addr);
+			dax_persist(fs_vfs, (void *)block->block_addr, FS_BLOCK_SIZE);
+			
+			mutex_lock(&group->superblock_mutex);
+			list_move_tail(&block->fs_vfs_list, &group->zeroed_disk_block_list);
+			group->num_zeroed_blocks += 1;
+			mutex_unlock(&group->superblock_mutex);
+			
+			atomic64_inc(&fs_vfs->blocks_prezeroed);
+			cond_resched();
+		}
+	}
+}
+
+/*
+Wakes up the zeroing worker, it is a no-op when the worker is already queued or pre-zeroing is disabled
+*/
+void queue_zeroing(struct fs_vfs * fs_vfs)
+{
+	struct kthread_worker * worker = READ_ONCE(fs_vfs->zero_worker);
+	
+	if(worker)
+		kthread_queue_work(worker, &fs_vfs->zero_work);
+}
+
+/*
+Starts the zeroing worker and fills the zeroed pools
+Parameters:-
+int num_blocks :- number of zeroed blocks kept over all the groups, 0 disables pre-zeroing
+*/
+int initialise_zero_pool(struct fs_vfs * fs_vfs, int num_blocks)
+{
+	if(num_blocks <= 0)
+		return 0;
+	
+	struct kthread_worker * worker = kthread_create_worker(0, "ramfs_zero");
+	if(IS_ERR(worker))
+	{
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Error starting the zeroing worker\n");
+		return -FS_EMALLOC;
+	}
+	set_user_nice(worker->task, MAX_NICE);
+	
+	kthread_init_work(&fs_vfs->zero_work, zero_work);
+	fs_vfs->zero_pool_target = max(num_blocks / fs_vfs->num_groups, 1);
+	WRITE_ONCE(fs_vfs->zero_worker, worker);
+	
+	queue_zeroing(fs_vfs);
+	printk("FILE_SYSTEM : Started the zeroing worker, %d zeroed blocks per group\n", fs_vfs->zero_pool_target);
+	
+	return 0;
+}
+
+/*
+Stops the zeroing worker and returns the zeroed and pending blocks to the free chains
+*/
+void destroy_zero_pool(struct fs_vfs * fs_vfs)
+{
+	struct kthread_worker * worker = fs_vfs->zero_worker;
+	if(!worker)
+		return;
+	
+	//put_free_block() stops queueing blocks, the worker finishes the queued work before it exits
+	WRITE_ONCE(fs_vfs->zero_worker, NULL);
+	kthread_destroy_worker(worker);
+	
+	for(int g = 0; g < fs_vfs->num_groups; g++)
+	{
+		struct fs_superblock * group = &fs_vfs->groups[g];
+		struct fs_block * block, * next;
+		LIST_HEAD(blocks);
+		
+		mutex_lock(&group->superblock_mutex);
+		list_splice_init(&group->zero_pending_list, &blocks);
+		list_splice_init(&group->zeroed_disk_block_list, &blocks);
+		percpu_counter_sub(&fs_vfs->num_free_disk_blocks, group->num_zero_pending + group->num_zeroed_blocks);
+		percpu_counter_sub(&fs_vfs->unreserved_disk_blocks, group->num_zero_pending + group->num_zeroed_blocks);
+		group->num_zero_pending = 0;
+		group->num_zeroed_blocks = 0;
+		mutex_unlock(&group->superblock_mutex);
+		
+		list_for_each_entry_safe(block, next, &blocks, fs_vfs_list)
+		{
+			put_free_block(fs_vfs, block);
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef _FS_BATCH_H
+#define _FS_BATCH_H
+
+#include <linux/ioctl.h>
+
+#include "fs_inode.h"
+
+#define FS_BATCH_CREATE 1
+#define FS_BATCH_UNLINK 2
+#define FS_BATCH_TRUNCATE 3
+#define FS_BATCH_PREALLOCATE 4
+
+/*
+One operation of a batch, the results are written back into the same structure
+FS_BATCH_CREATE :- allocates an inode, its number is returned in inode_num
+FS_BATCH_UNLINK :- drops the blocks of inode inode_num and frees it
+FS_BATCH_TRUNCATE :- sets the file size of inode inode_num to size bytes (see truncate_inode())
+FS_BATCH_PREALLOCATE :- maps blocks to inode inode_num up to size bytes without changing its file size (see preallocate_inode())
+*/
+typedef struct fs_batch_op
+{
+	u32 op;
+	s32 inode_num;
+	s64 size;
+	s32 result; //0 or a negative error code from error.h
+	u32 reserved;
+}fs_batch_op_t;
+
+typedef struct fs_batch
+{
+	u64 ops; //User address of num_ops struct fs_batch_op
+	u32 num_ops; //At most FS_BATCH_MAX_OPS
+	u32 num_failed; //Number of operations with a non zero result, set by the ioctl
+}fs_batch_t;
+
+#define FS_IOC_BATCH _IOWR('r', 1, struct fs_batch)
+
+void initialise_batch(struct fs_vfs * fs_vfs);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _FS_BENCH_H
+#define _FS_BENCH_H
+
+#include "fs_inode.h"
+
+#define FS_BENCH_COPY 0x01
+#define FS_BENCH_INODE 0x02
+#define FS_BENCH_RANGE 0x04
+
+void run_benchmarks(struct fs_vfs * fs_vfs, int benchmarks);
+
+#endif
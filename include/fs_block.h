@@ -1,3 +1,6 @@
+#ifndef _FS_BLOCK_H
+#define _FS_BLOCK_H
+
 #include <linux/list.h>
 #include "fs_vfs.h"
 
@@ -7,29 +10,104 @@
 typedef struct fs_block
 {
 	uintptr_t block_addr;
+	int block_num; //Position of the block in the pool, index into fs_vfs->block_table
 	struct list_head fs_vfs_list;
 	
+	atomic64_t ref_count; //Disk map entries pointing to this block in the low 32 bits, reader pins (FS_BLOCK_PIN) above, 0 while the block is free
+	u32 hash; //Hash of the block contents, valid only while dedup_node is hashed
+	struct hlist_node dedup_node;
+	
 	struct mutex diskblock_mutex;
 }fs_block_t;
 
+/*
+Allocation group
+The pool is split into fs_vfs->num_groups groups of contiguous blocks, every group chains its free blocks through its own super blocks
+so that allocations from different groups never contend on the same lock
+*/
 typedef struct fs_superblock
 {
 	struct fs_block *blocks[100];
 	int fs_block_ind;
+	
+	int group_num;
+	int first_block; //The group holds the blocks [first_block, first_block + num_blocks)
+	int num_blocks;
+	int num_free_disk_blocks;
+	unsigned long * free_map; //Blocks on the super block chain, bit i is block first_block + i, keeps the free blocks in block order for the defrag thread
+	
+	struct list_head free_disk_block_list;
+	struct list_head super_block_disk_list;
+	struct list_head allocated_disk_block_list;
+	
+	//Pre-zeroed blocks (see fs/fs_zero.c), they are neither on the free chain nor allocated
+	struct list_head zero_pending_list; //Freed blocks waiting to be cleared by the zeroing worker
+	int num_zero_pending;
+	struct list_head zeroed_disk_block_list;
+	int num_zeroed_blocks;
+	
+	struct mutex superblock_mutex; //Protects the super block chain, the lists and the free and zeroed counts of the group
+}____cacheline_aligned_in_smp fs_superblock_t;
 
-	struct mutex superblock_mutex;
-}fs_superblock_t;
-
-void initialise_super_block(struct fs_vfs *);
-inline void deallocate_super_block(struct fs_vfs * fs_vfs);
+int initialise_alloc_groups(struct fs_vfs * fs_vfs);
+void destroy_alloc_groups(struct fs_vfs * fs_vfs);
 
-struct fs_block * initialise_block(struct fs_vfs * fs_vfs, void * start_memory, int flag);
+struct fs_block * initialise_block(struct fs_vfs * fs_vfs, int block_num, int flag);
 inline void destroy_block(struct fs_vfs * fs_vfs, struct fs_block * block);
 
+int copy_to_block(struct fs_block * block, int offset, void * src, int size, int copy_mode);
 int write_to_block(struct fs_block * block, int offset, void * src, int size);
-void initialise_disk_blocks(struct fs_vfs * fs_vfs, void * start_memory);
+int initialise_disk_blocks(struct fs_vfs * fs_vfs);
+void destroy_disk_blocks(struct fs_vfs * fs_vfs);
+
+//Reader pin in fs_block.ref_count, see fs_block_pin()
+#define FS_BLOCK_PIN (1LL << 32)
+
+//Returns the number of disk map entries pointing to the block from a value of fs_block.ref_count
+static inline u32 fs_block_refs(s64 ref_count)
+{
+	return (u32)ref_count;
+}
+
+//Returns the number of disk map entries pointing to the block, writers copy the block first when it is above 1
+static inline u32 fs_block_sharers(struct fs_block * block)
+{
+	return fs_block_refs(atomic64_read(&block->ref_count));
+}
+
+static inline struct fs_block * num_to_disk_block(struct fs_vfs * fs_vfs, int block_num)
+{
+	if(block_num < 0 || block_num >= fs_vfs->total_num_disk_blocks)
+		return NULL;
+	return fs_vfs->block_table[block_num];
+}
+
+//Returns the allocation group holding the block
+static inline struct fs_superblock * block_group(struct fs_vfs * fs_vfs, int block_num)
+{
+	return &fs_vfs->groups[min(block_num / fs_vfs->blocks_per_group, fs_vfs->num_groups - 1)];
+}
 
 struct fs_block * mem_to_disk_block(struct fs_vfs * fs_vfs, void * mem_addr);
+struct fs_block * take_free_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest, int goal, bool nonblock);
+struct fs_block * take_zero_pool_block(struct fs_vfs * fs_vfs, struct fs_superblock * group, struct list_head * dest, bool nonblock);
+struct fs_block * get_free_block_near(struct fs_vfs * fs_vfs, int group_num, int goal);
 struct fs_block * get_free_block(struct fs_vfs * fs_vfs);
+struct fs_block * get_zeroed_block(struct fs_vfs * fs_vfs, int group_num, int goal);
 void put_free_block(struct fs_vfs * fs_vfs, struct fs_block * block);
+bool claim_free_blocks(struct fs_vfs * fs_vfs, s64 nr_blocks, s64 floor);
+void rebuild_free_chain(struct fs_vfs * fs_vfs);
+int get_free_run(struct fs_vfs * fs_vfs, int group_num, int nr_blocks, struct fs_block ** blocks);
+
+int reserve_disk_blocks(struct fs_vfs * fs_vfs, int nr_blocks);
+void unreserve_disk_blocks(struct fs_vfs * fs_vfs, int nr_blocks);
+int get_reserved_blocks(struct fs_vfs * fs_vfs, int group_num, int goal, int nr_blocks, struct fs_block ** blocks);
+void put_reserved_blocks(struct fs_vfs * fs_vfs, struct fs_block ** blocks, int nr_blocks);
+
+void fs_block_get(struct fs_vfs * fs_vfs, struct fs_block * block);
+bool fs_block_tryget(struct fs_vfs * fs_vfs, struct fs_block * block);
+void fs_block_put(struct fs_vfs * fs_vfs, struct fs_block * block);
+bool fs_block_pin(struct fs_block * block);
+void fs_block_unpin(struct fs_vfs * fs_vfs, struct fs_block * block);
 
+#endif
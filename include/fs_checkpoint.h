@@ -0,0 +1,46 @@
+#ifndef _FS_CHECKPOINT_H
+#define _FS_CHECKPOINT_H
+
+#include "fs_inode.h"
+
+#define FS_CHECKPOINT_MAGIC 0x52414d46 //"RAMF"
+#define FS_CHECKPOINT_VERSION 2
+
+#define FS_CHECKPOINT_FULL 0x01
+#define FS_CHECKPOINT_INCREMENTAL 0x02
+
+/*
+Checkpoint file layout
+struct fs_checkpoint_header
+Block section :- header.num_blocks times a block number (u32) followed by the contents of the disk block
+Inode section :- header.num_inodes times struct fs_checkpoint_inode followed by inode.num_blocks block numbers (u32)
+
+Block numbers are the fs_block.block_num of the checkpointed file system, an incremental checkpoint holds only the blocks written since the previous checkpoint
+Every checkpoint carries the chain_id of the full checkpoint it extends, incremental checkpoints left over from an older chain are not restored
+*/
+typedef struct fs_checkpoint_header
+{
+	u32 magic;
+	u32 version;
+	u32 flags;
+	u32 block_size;
+	u32 sequence; //0 for a full checkpoint, n for the nth incremental checkpoint after it
+	u32 num_blocks;
+	u32 num_inodes;
+	u32 reserved;
+	u64 chain_id; //Random id of the full checkpoint, copied into every incremental checkpoint written after it
+}fs_checkpoint_header_t;
+
+typedef struct fs_checkpoint_inode
+{
+	u32 inode_num;
+	s32 file_size;
+	u32 num_blocks;
+	u32 reserved;
+}fs_checkpoint_inode_t;
+
+void initialise_checkpoint(struct fs_vfs * fs_vfs, char * path);
+int checkpoint_file_system(struct fs_vfs * fs_vfs, bool incremental);
+int restore_file_system(struct fs_vfs * fs_vfs, char * path);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _FS_COPY_H
+#define _FS_COPY_H
+
+#include <linux/types.h>
+
+#define FS_COPY_CACHED 0
+#define FS_COPY_NONTEMPORAL 1
+
+//Copy implementations, FS_COPY_IMPL_MOVNTI and above bypass the cache
+#define FS_COPY_IMPL_MEMCPY 0
+#define FS_COPY_IMPL_MOVNTI 1
+#define FS_COPY_IMPL_AVX2 2
+#define FS_COPY_IMPL_AVX512 3
+#define FS_COPY_NUM_IMPL 4
+
+void initialise_copy(bool nontemporal);
+
+void copy_block_data(void * dest, void * src, int size, int copy_mode);
+
+bool copy_impl_available(int impl);
+const char * copy_impl_name(int impl);
+void copy_block_data_impl(void * dest, void * src, int size, int impl);
+int copy_nontemporal_impl(void);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _FS_DAX_H
+#define _FS_DAX_H
+
+#include "fs_block.h"
+
+#define FS_DAX_MAGIC 0x52414d4644415831ULL //"RAMFDAX1"
+#define FS_DAX_VERSION 1
+
+#define FS_DAX_INODE_ALLOCATED 0x01
+
+/*
+DAX device layout, every section starts on a block boundary
+Block 0 :- struct fs_dax_super
+Inode table :- FS_NUM_INODES times struct fs_dax_inode, indexed by inode number
+Reverse map :- super.num_blocks times struct fs_dax_rmap, indexed by block number
+Data blocks :- super.num_blocks pool blocks, block_num n lives at data_offset + n * FS_BLOCK_SIZE
+
+The disk maps are not stored on the device, they are rebuilt from the reverse map on mount
+*/
+typedef struct fs_dax_super
+{
+	u64 magic;
+	u32 version;
+	u32 block_size;
+	u32 num_blocks;
+	u32 num_inodes;
+	u64 inode_table_offset;
+	u64 rmap_offset;
+	u64 data_offset;
+}fs_dax_super_t;
+
+typedef struct fs_dax_inode
+{
+	u32 flags;
+	s32 file_size;
+}fs_dax_inode_t;
+
+typedef struct fs_dax_rmap
+{
+	u32 owner; //Inode number + 1 of the inode mapping the block, 0 while the block is free
+	u32 block_ind; //Logical block of the owner mapped to the block
+}fs_dax_rmap_t;
+
+static inline bool fs_dax_enabled(struct fs_vfs * fs_vfs)
+{
+	return fs_vfs->dax_base != NULL;
+}
+
+//Returns true if the block is mapped by an inode on the DAX device
+static inline bool dax_block_mapped(struct fs_vfs * fs_vfs, int block_num)
+{
+	return fs_dax_enabled(fs_vfs) && fs_vfs->dax_rmap[block_num].owner != 0;
+}
+
+int allocate_dax_pool(struct fs_vfs * fs_vfs, char * path, bool format);
+void destroy_dax_pool(struct fs_vfs * fs_vfs);
+int recover_dax_inodes(struct fs_vfs * fs_vfs);
+
+void * dax_block_addr(struct fs_vfs * fs_vfs, int block_num);
+int dax_addr_to_block_num(struct fs_vfs * fs_vfs, void * addr);
+
+void dax_persist(struct fs_vfs * fs_vfs, void * addr, size_t size);
+void dax_persist_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+void dax_map_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, struct fs_block * block);
+void dax_unmap_block(struct fs_vfs * fs_vfs, struct fs_block * block);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _FS_DEDUP_H
+#define _FS_DEDUP_H
+
+#include "fs_block.h"
+
+int initialise_dedup(struct fs_vfs * fs_vfs);
+void destroy_dedup(struct fs_vfs * fs_vfs);
+
+struct fs_block * dedup_block(struct fs_vfs * fs_vfs, struct fs_block * block);
+void dedup_unhash_block(struct fs_vfs * fs_vfs, struct fs_block * block);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _FS_DEFRAG_H
+#define _FS_DEFRAG_H
+
+#include "fs_inode.h"
+
+typedef struct fs_frag_stats
+{
+	long mapped_blocks; //Blocks mapped by allocated inodes
+	long extents; //Runs of physically contiguous blocks
+	int fragmented_files; //Inodes with more than 1 extent
+}fs_frag_stats_t;
+
+int inode_extents(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+void get_frag_stats(struct fs_vfs * fs_vfs, struct fs_frag_stats * stats);
+
+int defrag_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+
+int initialise_defrag(struct fs_vfs * fs_vfs);
+void destroy_defrag(struct fs_vfs * fs_vfs);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _FS_DELALLOC_H
+#define _FS_DELALLOC_H
+
+#include <linux/uio.h>
+
+#include "fs_inode.h"
+
+int initialise_delalloc(struct fs_vfs * fs_vfs, int num_blocks);
+void destroy_delalloc(struct fs_vfs * fs_vfs);
+
+bool delalloc_can_append(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t pos, size_t count);
+ssize_t append_delalloc_iter(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct iov_iter * from);
+
+int flush_inode_delalloc_locked(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+int flush_inode_delalloc(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+int flush_delalloc_inodes_locked(struct fs_vfs * fs_vfs);
+void discard_inode_delalloc(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+
+#endif
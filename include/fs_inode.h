@@ -1,24 +1,47 @@
+#ifndef _FS_INODE_H
+#define _FS_INODE_H
+
+#include <linux/rcupdate.h>
+
 #include "fs_block.h"
+#include "fs_range_lock.h"
 
 /*
 This structure represent the 12 disk pointers
 0-9 pointers directly point to the disk blocks
-10 is an 1 level indirection with the 1st level indirection pointing to 256 disk pointer
-11 is an 2 level indirection
+10 is an 1 level indirection, a table of FS_INDIRECT_ENTRIES disk block numbers
+11 is an 2 level indirection, a table of FS_INDIRECT_ENTRIES block numbers of 1 level tables
 */
 
 #define DIRECT_BLOCK_COMPLETE 0x001
 #define SINGLE_INDIRECT_BLOCK_COMPLETE 0x010
 #define DOUBLE_INDIRECT_BLOCK_COMPLETE 0x100
 
+//Number of block numbers (u32, see fs_block.block_num) held by an indirect table, a table fills one pool block
+#define FS_INDIRECT_ENTRIES ((int)(FS_BLOCK_SIZE / sizeof(u32)))
+
+//Table entry of an unmapped logical block, num_to_disk_block() rejects it
+#define FS_NO_BLOCK U32_MAX
+
+//Largest number of logical blocks a disk map can hold, bounded by the reach of the tables and by the int file size
+#define FS_MAX_INODE_BLOCKS min_t(int, 10 + FS_INDIRECT_ENTRIES + FS_INDIRECT_ENTRIES * FS_INDIRECT_ENTRIES, INT_MAX / FS_BLOCK_SIZE)
+
+/*
+The indirect tables are pool blocks, they are counted in the pool like data blocks and are not recorded in the DAX reverse map
+The number of entries used in every table follows from num_blocks, the tables are filled in order and only the last one is partial
+Block lookups run under RCU without the inode mutex (see get_inode_block()), writers publish new tables and entries before num_blocks,
+unused entries hold FS_NO_BLOCK and unused tables are returned to the pool after an RCU grace period (see retire_table_block())
+*/
 typedef struct fs_disk_map
 {
-	struct fs_block *blocks[12];
-	uintptr_t disk_map_flag;
-
+	//The counters and the direct pointers come first, they share the first cacheline of the inode (see struct fs_inode)
+	int num_blocks; //Number of logical blocks mapped, published with smp_store_release() after the new entry
 	uint8_t direct_pointer_ind;
-	uint16_t single_indirect_pointer_ind;
-	uint16_t double_indirect_pointer_ind;
+	uint8_t disk_map_flag;
+	
+	struct fs_block *blocks[10];
+	struct fs_block * single_indirect; //Pool block holding the 1 level table
+	struct fs_block * double_indirect; //Pool block holding the 2 level table
 }fs_disk_map_t;
 
 
@@ -35,30 +58,92 @@ typedef struct fs_disk_map
 }fs_inode_ops_t;
 */
 
+/*
+The fields read by every block lookup are grouped at the start of the inode, followed by the mutex and the rarely used fields
+Inodes are allocated from fs_vfs->inode_cache which is hardware cacheline aligned, so the inode number, the file size, the disk map counters
+and the first direct pointers share one cacheline
+*/
 typedef struct fs_inode
 {
-	int device;
 	int inode_num; //inode number
+	int file_size; //File size
+	struct fs_disk_map disk_map;
+	
+	/*
+	Writers lock the logical blocks they write in range_locks and hold inode_mutex only while they update the disk map or the file size
+	so writers of disjoint blocks copy their data concurrently, range locks are taken after fs_vfs->snapshot_rwsem and before inode_mutex
+	*/
+	struct mutex inode_mutex; //Protects the disk map and the file size
+	struct fs_range_lock_tree range_locks; //Logical blocks, see lock_inode_blocks()
+	
+	/*
+	Delayed allocation (see fs/fs_delalloc.c)
+	delalloc_len bytes appended after the last mapped block are held in delalloc_buf until they are flushed to newly allocated blocks,
+	they are protected like the blocks they will be written to (a range lock reaching the end of the file, see lock_inode_blocks_tail())
+	*/
+	void * delalloc_buf; //fs_vfs->delalloc_blocks blocks, allocated on the first buffered append
+	int delalloc_len; //Updated under inode_mutex
+	int delalloc_reserved; //Free blocks reserved for the buffered data and the indirect tables it needs
+	unsigned long delalloc_time; //jiffies of the first append buffered since the last flush
+	
+	int table_reserved; //Reserved free blocks the next indirect tables are taken from, set by the caller of append_block_to_inode() under inode_mutex
+	
+	bool allocated; //Set while the inode is on fs_vfs->allocated_inode_list
+	u32 generation; //Incremented under fs_vfs->vfs_lock every time the inode is allocated, tells apart the files which held the inode number
+	int last_written_block; //Used to detect sequential write streams
+	int sequential_writes;
+	
+	int device;
 	int mode; //Mode in which file is opened
 	int ref_count; //File refcount
-	int file_size; //File size
 	int file_offset;
-		
-	struct list_head fs_vfs_inode_list;
-	
-	struct fs_disk_map * disk_map;
 	
-	struct mutex inode_mutex;
+	struct list_head fs_vfs_inode_list;
 }fs_inode_t;
 
 
+//Inodes are spread over the allocation groups, an inode allocates its blocks from its home group first
+static inline int inode_home_group(struct fs_vfs * fs_vfs, struct fs_inode * inode)
+{
+	return inode->inode_num % fs_vfs->num_groups;
+}
+
 int alloc_inode(struct fs_vfs * fs_vfs);
-void destroy_inode(struct fs_inode * inode);
+void destroy_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode);
 
 int allocate_inodes(struct fs_vfs * fs_vfs);
+void destroy_inodes(struct fs_vfs * fs_vfs);
 struct fs_inode * get_inode(struct fs_vfs * fs_vfs);
+struct fs_inode * get_inode_locked(struct fs_vfs * fs_vfs);
+struct fs_inode * get_inode_num(struct fs_vfs * fs_vfs, int inode_num);
 void put_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+void put_inode_locked(struct fs_vfs * fs_vfs, struct fs_inode * inode);
 int alloc_disk_to_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+int attach_block_to_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_block * block);
+void trim_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode);
+void free_disk_map(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map);
+int truncate_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t size);
+int preallocate_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t size);
+
+void lock_inode_blocks(struct fs_inode * inode, struct fs_range_lock * lock, u64 first_block, u64 last_block, bool write);
+void unlock_inode_blocks(struct fs_inode * inode, struct fs_range_lock * lock);
+bool lock_inode_blocks_tail(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_range_lock * lock, u64 first_block, u64 last_block, bool write);
 
+struct fs_block * inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind);
+void set_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, struct fs_block * block);
+struct fs_block * get_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind);
+int inode_num_blocks(struct fs_inode * inode);
+int clone_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * src, struct fs_inode * dst);
+void exchange_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_inode * scratch);
+struct fs_inode * clone_inode(struct fs_vfs * fs_vfs, struct fs_inode * src);
 
+int inode_goal_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind);
+int extend_inode_disk_map(struct fs_vfs * fs_vfs, struct fs_inode * inode, int num_blocks);
+int disk_map_tables(int num_blocks);
+int append_block_to_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, struct fs_block * block);
+struct fs_block * get_writable_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, bool keep_data, int * err);
+int inode_write_copy_mode(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, int size);
+void finish_inode_block_write(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind);
+int write_to_inode_block(struct fs_vfs * fs_vfs, struct fs_inode * inode, int block_ind, int offset, void * src, int size);
 
+#endif
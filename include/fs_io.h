@@ -0,0 +1,14 @@
+#ifndef _FS_IO_H
+#define _FS_IO_H
+
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+
+#include "fs_inode.h"
+
+ssize_t read_inode_iter(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct iov_iter * to);
+ssize_t write_inode_iter(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct iov_iter * from);
+ssize_t splice_read_inode(struct fs_vfs * fs_vfs, struct fs_inode * inode, loff_t * pos, struct pipe_inode_info * pipe, size_t len);
+ssize_t copy_inode_range(struct fs_vfs * fs_vfs, struct fs_inode * src, loff_t src_pos, struct fs_inode * dst, loff_t dst_pos, size_t len);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _FS_POOL_H
+#define _FS_POOL_H
+
+#include "fs_block.h"
+
+int allocate_pool(struct fs_vfs * fs_vfs);
+void destroy_pool(struct fs_vfs * fs_vfs);
+
+void * pool_block_addr(struct fs_vfs * fs_vfs, int block_num);
+int pool_addr_to_block_num(struct fs_vfs * fs_vfs, void * addr);
+
+long release_free_blocks(struct fs_vfs * fs_vfs, long nr_blocks);
+int repopulate_pool(struct fs_vfs * fs_vfs, int nr_blocks);
+
+int initialise_pool_shrinker(struct fs_vfs * fs_vfs);
+void destroy_pool_shrinker(struct fs_vfs * fs_vfs);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _FS_RANGE_LOCK_H
+#define _FS_RANGE_LOCK_H
+
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct task_struct;
+
+/*
+Range locks (see fs/fs_range_lock.c)
+A range lock locks the inclusive range [start, last] of a tree, readers share overlapping ranges with each other, writers exclude every overlapping range
+Ranges are granted in the order they are requested, so a writer is not starved by a stream of overlapping readers
+*/
+typedef struct fs_range_lock
+{
+	struct rb_node rb;
+	u64 start;
+	u64 last;
+	u64 __subtree_last; //Maintained by the interval tree
+	
+	bool write;
+	u64 seq; //Order in which the range was requested
+	int blocking_ranges; //Conflicting ranges requested earlier which are still in the tree, the range is granted when it drops to 0
+	struct task_struct * task;
+}fs_range_lock_t;
+
+typedef struct fs_range_lock_tree
+{
+	struct rb_root_cached root;
+	u64 seq;
+	spinlock_t lock; //Protects the tree and the blocking counts of its ranges
+}fs_range_lock_tree_t;
+
+#define FS_RANGE_LOCK_FULL U64_MAX
+
+void fs_range_lock_tree_init(struct fs_range_lock_tree * tree);
+void fs_range_lock_init(struct fs_range_lock * lock, u64 start, u64 last);
+
+void fs_range_read_lock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock);
+void fs_range_write_lock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock);
+void fs_range_unlock(struct fs_range_lock_tree * tree, struct fs_range_lock * lock);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _FS_RECLAIM_H
+#define _FS_RECLAIM_H
+
+#include "fs_inode.h"
+
+typedef struct fs_reclaim
+{
+	struct fs_disk_map disk_map; //Disk map detached from its inode, see detach_inode_disk_map()
+	struct list_head reclaim_list;
+}fs_reclaim_t;
+
+typedef struct fs_retired_table
+{
+	struct fs_block * table; //Indirect table no disk map points to any more, see retire_table_block()
+	struct list_head retired_list;
+}fs_retired_table_t;
+
+int initialise_reclaim(struct fs_vfs * fs_vfs);
+void destroy_reclaim(struct fs_vfs * fs_vfs);
+
+bool defer_disk_map_release(struct fs_vfs * fs_vfs, struct fs_disk_map * disk_map);
+bool reclaim_pending_blocks(struct fs_vfs * fs_vfs);
+void retire_table_block(struct fs_vfs * fs_vfs, struct fs_block * table);
+
+#endif
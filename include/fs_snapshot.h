@@ -0,0 +1,28 @@
+#ifndef _FS_SNAPSHOT_H
+#define _FS_SNAPSHOT_H
+
+#include "fs_inode.h"
+
+typedef struct fs_snapshot_entry
+{
+	int inode_num; //Inode which was cloned
+	u32 generation; //Generation of the inode at the time of the snapshot, a rollback skips the inode once it holds another file
+	struct fs_inode * clone; //Clone holding the contents of the inode at the time of the snapshot
+}fs_snapshot_entry_t;
+
+typedef struct fs_snapshot
+{
+	int snapshot_id;
+	struct list_head fs_vfs_snapshot_list;
+	
+	int num_entries;
+	struct fs_snapshot_entry * entries;
+}fs_snapshot_t;
+
+struct fs_snapshot * create_snapshot(struct fs_vfs * fs_vfs);
+void destroy_snapshot(struct fs_vfs * fs_vfs, struct fs_snapshot * snapshot);
+int rollback_snapshot(struct fs_vfs * fs_vfs, struct fs_snapshot * snapshot);
+void initialise_snapshot(struct fs_vfs * fs_vfs);
+void destroy_snapshots(struct fs_vfs * fs_vfs);
+
+#endif
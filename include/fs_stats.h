@@ -0,0 +1,9 @@
+#ifndef _FS_STATS_H
+#define _FS_STATS_H
+
+#include "fs_vfs.h"
+
+void initialise_fs_stats(struct fs_vfs * fs_vfs);
+void destroy_fs_stats(struct fs_vfs * fs_vfs);
+
+#endif
@@ -1,35 +1,185 @@
+#ifndef _FS_VFS_H
+#define _FS_VFS_H
+
 #include <linux/list.h>
 #include <linux/types.h>
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/hashtable.h>
+#include <linux/percpu_counter.h>
+#include <linux/kthread.h>
 
 #include "../error.h"
 #include "../config.h"
 
 #define FS_DISK_BLOCK_SUPER_BLOCK 1
 #define FS_DISK_BLOCK_FREE_LIST 2
+#define FS_DISK_BLOCK_ALLOCATED 3
 
 struct fs_superblock;
+struct fs_block;
+struct fs_inode;
+struct dentry;
+struct page;
+struct shrinker;
+struct task_struct;
+struct kmem_cache;
+struct file;
+struct dax_device;
+struct fs_dax_super;
+struct fs_dax_inode;
+struct fs_dax_rmap;
 
 typedef struct fs_vfs
 {
-	struct fs_superblock * super_block;
+	/*
+	Allocation groups (see fs/fs_block.c)
+	Every group has its own free chain and lock, inodes allocate from their home group first
+	*/
+	struct fs_superblock * groups;
+	int num_groups;
+	int blocks_per_group;
+	
+	struct fs_block ** block_table; //Indexed by fs_block.block_num
+	unsigned long * dirty_bitmap; //Blocks written or newly mapped since the last checkpoint
 	
-	struct list_head super_block_disk_list;
+	int total_num_disk_blocks;
+	struct percpu_counter num_free_disk_blocks; //Sum of the free blocks of all the groups, their zeroed and pending blocks included
+	struct percpu_counter unreserved_disk_blocks; //Free blocks neither reserved nor claimed by an allocation in progress, see claim_free_blocks()
 	
-	struct list_head free_disk_block_list;
-	int num_free_disk_blocks;
+	/*
+	Pool memory (see fs/fs_pool.c)
+	Free blocks above pool_reserve can be released to the kernel under memory pressure, they are kept on released_disk_block_list and are neither free nor allocated
+	*/
+	struct page ** pool_pages; //Indexed by fs_block.block_num, NULL while the block is released
+	spinlock_t pool_lock; //Protects released_disk_block_list
+	struct list_head released_disk_block_list;
+	int num_released_disk_blocks;
+	int pool_reserve;
+	int pool_low_watermark;
+	struct shrinker * pool_shrinker;
 	
-	struct list_head allocated_disk_block_list;
+	/*
+	Persistent memory backend (see fs/fs_dax.c)
+	While dax_base is set the pool, the inode records and the reverse block map live on a DAX device and survive a module reload
+	*/
+	struct file * dax_bdev_file;
+	struct dax_device * dax_dev;
+	void * dax_base; //Kernel mapping of the whole device, NULL for the page backed pool
+	struct fs_dax_super * dax_super;
+	struct fs_dax_inode * dax_inodes; //Indexed by inode number
+	struct fs_dax_rmap * dax_rmap; //Indexed by fs_block.block_num
+	void * dax_data; //Address of block 0
+	int dax_recovered_inodes;
+	int dax_recovered_blocks;
 	
 	struct list_head free_inode_list;
 	int num_free_inodes;
 	
 	struct list_head allocated_inode_list;
+	struct fs_inode ** inode_table; //Indexed by inode number
+	struct kmem_cache * inode_cache;
+	atomic64_t table_blocks; //Pool blocks holding the indirect tables of the disk maps
+	
+	struct mutex vfs_lock; //Protects the inode lists
+	
+	/*
+	Snapshots (see fs/fs_snapshot.c)
+	Every disk map modification holds snapshot_rwsem for reading, a snapshot holds it for writing
+	*/
+	struct rw_semaphore snapshot_rwsem;
+	struct list_head snapshot_list;
+	int next_snapshot_id;
+	int num_snapshot_inodes; //Inodes held by snapshots, they are neither free nor allocated
+	struct mutex snapshot_lock; //Serialises the snapshot control file, a snapshot is only destroyed under it
+	
+	/*
+	Content deduplication (see fs/fs_dedup.c)
+	dedup_table holds every exclusively written block keyed by the hash of its contents
+	zero_block is a pool block which is never written and is shared by every all-zero logical block
+	*/
+	bool dedup_enabled;
+	struct fs_block * zero_block;
+	DECLARE_HASHTABLE(dedup_table, FS_DEDUP_HASH_BITS);
+	struct mutex dedup_lock;
+	
+	atomic64_t dedup_hits;
+	atomic64_t zero_block_hits;
+	struct percpu_counter shared_blocks_saved; //Number of pool blocks saved because of block sharing, per cpu as lockless readers take block references
+	
+	/*
+	Checkpoints (see fs/fs_checkpoint.c)
+	checkpoint_path holds the last full checkpoint, incremental checkpoints are written to checkpoint_path.<checkpoint_seq>
+	checkpoint_chain is 0 until a full checkpoint has been written or restored, dirty_bitmap is only a valid delta after that
+	*/
+	char * checkpoint_path;
+	int checkpoint_seq;
+	u64 checkpoint_chain; //chain_id of the full checkpoint the next incremental checkpoint extends
+	struct mutex checkpoint_lock;
+	
+	/*
+	Allocation locality and defragmentation (see fs/fs_defrag.c)
+	New blocks of a file are allocated next to its previous block when possible, the defrag thread migrates fragmented files into contiguous runs
+	*/
+	atomic64_t alloc_goal_hits; //Allocations which got the goal block
+	struct task_struct * defrag_task;
+	atomic64_t defrag_migrated_blocks;
+	struct mutex frag_stats_lock; //Protects the cached fragmentation counts below, see get_frag_stats()
+	unsigned long frag_stats_time; //jiffies of the last computation, 0 before the first one
+	long frag_mapped_blocks;
+	long frag_extents;
+	int frag_fragmented_files;
+	
+	/*
+	Pre-zeroing (see fs/fs_zero.c)
+	Freed blocks are cleared by a low priority worker into the zeroed pool of their group, allocations which need zeroed blocks take them from there first
+	*/
+	struct kthread_worker * zero_worker; //NULL while pre-zeroing is disabled
+	struct kthread_work zero_work;
+	int zero_pool_target; //Zeroed plus pending blocks kept per group
+	atomic64_t zero_pool_hits; //Zeroed allocations served from the zeroed pool
+	atomic64_t zero_pool_misses; //Zeroed allocations which had to clear the block themselves
+	atomic64_t blocks_prezeroed;
+	
+	/*
+	Delayed allocation (see fs/fs_delalloc.c)
+	Appends are buffered per inode with only a reservation of free blocks, the blocks are allocated in one batch when the buffer is flushed
+	*/
+	int delalloc_blocks; //Size of the per inode buffers, 0 while delayed allocation is disabled
+	atomic64_t reserved_disk_blocks; //Free blocks reserved for buffered data and not allocated yet, they are not counted in unreserved_disk_blocks
+	struct kthread_worker * delalloc_worker;
+	struct kthread_delayed_work delalloc_work; //Flushes the buffers older than FS_DELALLOC_FLUSH_MS
+	atomic64_t delalloc_buffered_writes;
+	atomic64_t delalloc_flushes;
+	atomic64_t delalloc_flushed_blocks;
+	
+	/*
+	Deferred reclamation (see fs/fs_reclaim.c)
+	The disk maps of large unlinked or truncated files are dropped by a worker, allocations drop them themselves when they run out of free blocks
+	*/
+	struct kthread_worker * reclaim_worker; //NULL while the blocks are dropped synchronously
+	struct kthread_work reclaim_work;
+	spinlock_t reclaim_lock; //Protects reclaim_list and retired_tables
+	struct list_head reclaim_list; //Detached disk maps, struct fs_reclaim
+	struct list_head retired_tables; //Indirect tables waiting for an RCU grace period, struct fs_retired_table
+	atomic64_t reclaim_pending_blocks; //Blocks of the detached disk maps not dropped yet
+	atomic64_t reclaimed_blocks;
+	atomic64_t reclaim_steals; //Detached disk maps dropped by an allocation
+	
+	/*
+	Batched metadata operations (see fs/fs_batch.c)
+	*/
+	atomic64_t batch_calls;
+	atomic64_t batch_ops;
 	
-	struct mutex vfs_lock;
+	struct dentry * stats_dentry;
 }fs_vfs_t;
 
-void intialise_file_system(struct fs_vfs * fs_vfs);
+int intialise_file_system(struct fs_vfs * fs_vfs);
+void destroy_file_system(struct fs_vfs * fs_vfs);
 
+#endif
@@ -0,0 +1,11 @@
+#ifndef _FS_ZERO_H
+#define _FS_ZERO_H
+
+#include "fs_block.h"
+
+int initialise_zero_pool(struct fs_vfs * fs_vfs, int num_blocks);
+void destroy_zero_pool(struct fs_vfs * fs_vfs);
+
+void queue_zeroing(struct fs_vfs * fs_vfs);
+
+#endif
@@ -7,12 +7,76 @@
 
 #include "config.h"
 #include "include/fs_inode.h"
+#include "include/fs_dedup.h"
+#include "include/fs_stats.h"
+#include "include/fs_checkpoint.h"
+#include "include/fs_pool.h"
+#include "include/fs_copy.h"
+#include "include/fs_bench.h"
+#include "include/fs_defrag.h"
+#include "include/fs_zero.h"
+#include "include/fs_dax.h"
+#include "include/fs_delalloc.h"
+#include "include/fs_batch.h"
+#include "include/fs_reclaim.h"
+#include "include/fs_snapshot.h"
 
 MODULE_LICENSE("GPL");
 
-void * fs_memory;
 struct fs_vfs * fs_vfs;
 
+static bool dedup = false;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "Share identical and all-zero disk blocks between files");
+
+static char * checkpoint_path = NULL;
+module_param(checkpoint_path, charp, 0444);
+MODULE_PARM_DESC(checkpoint_path, "File to which the file system is checkpointed on unload");
+
+static bool restore = false;
+module_param(restore, bool, 0444);
+MODULE_PARM_DESC(restore, "Restore the file system from checkpoint_path on load");
+
+static int pool_reserve = FS_POOL_RESERVE_BLOCKS;
+module_param(pool_reserve, int, 0444);
+MODULE_PARM_DESC(pool_reserve, "Free blocks which are never released to the kernel under memory pressure");
+
+static int pool_low_watermark = FS_POOL_LOW_WATERMARK;
+module_param(pool_low_watermark, int, 0444);
+MODULE_PARM_DESC(pool_low_watermark, "Released blocks are taken back from the kernel when the free blocks drop below this");
+
+static int alloc_groups = FS_NUM_ALLOC_GROUPS;
+module_param(alloc_groups, int, 0444);
+MODULE_PARM_DESC(alloc_groups, "Number of independently locked allocation groups the pool is split into");
+
+static bool nt_copy = true;
+module_param(nt_copy, bool, 0444);
+MODULE_PARM_DESC(nt_copy, "Use non-temporal stores for large sequential writes");
+
+static bool defrag = false;
+module_param(defrag, bool, 0444);
+MODULE_PARM_DESC(defrag, "Run a low priority thread which migrates fragmented files into contiguous blocks");
+
+static int zero_pool = FS_ZERO_POOL_BLOCKS;
+module_param(zero_pool, int, 0444);
+MODULE_PARM_DESC(zero_pool, "Freed blocks kept pre-zeroed by a low priority worker for holes and partial writes, 0 disables pre-zeroing");
+
+static int delalloc = FS_DELALLOC_BLOCKS;
+module_param(delalloc, int, 0444);
+MODULE_PARM_DESC(delalloc, "Blocks of appended data buffered per file before pool blocks are allocated for them, 0 disables delayed allocation");
+
+static char * dax_path = NULL;
+module_param(dax_path, charp, 0444);
+MODULE_PARM_DESC(dax_path, "pmem/DAX block device holding the pool and the file system metadata, the file system survives a module reload");
+
+static bool dax_format = false;
+module_param(dax_format, bool, 0444);
+MODULE_PARM_DESC(dax_format, "Create an empty file system on dax_path instead of mounting the one on it");
+
+static int bench = 0;
+module_param(bench, int, 0444);
+MODULE_PARM_DESC(bench, "Benchmarks to run on load instead of the self test, see include/fs_bench.h");
+
 static int alloc_mem_fs(void)
 {
 	fs_vfs = kmalloc(sizeof(struct fs_vfs), GFP_KERNEL);
@@ -22,34 +86,42 @@ static int alloc_mem_fs(void)
 		return -FS_EMALLOC;
 	}
 	
-	fs_memory = kvmalloc(FILE_SYSTEM_SIZE, GFP_KERNEL);
-	if(!fs_memory)
+	if(intialise_file_system(fs_vfs))
 	{
-		printk(KERN_ERR "FILE_SYSTEM : mem kmalloc error\n");
+		printk(KERN_ERR "FILE_SYSTEM : fs_vfs initialisation error\n");
+		kfree(fs_vfs);
+		fs_vfs = NULL;
 		return -FS_EMALLOC;
 	}
-	return 0;
-}
-
-static void print_superblock(void)
-{
-	printk("FILE_SYSTEM : Super Block\n");
-	for(int i = 0; i < 100; i++)
+	fs_vfs->pool_reserve = pool_reserve;
+	fs_vfs->pool_low_watermark = pool_low_watermark;
+	fs_vfs->num_groups = alloc_groups;
+	
+	int ret = dax_path ? allocate_dax_pool(fs_vfs, dax_path, dax_format) : allocate_pool(fs_vfs);
+	if(ret)
 	{
-		printk("FILE_SYSTEM : Super Block addr:%lx, %d\n", fs_vfs->super_block->blocks[i]->block_addr, i);
+		printk(KERN_ERR "FILE_SYSTEM : mem alloc error\n");
+		destroy_file_system(fs_vfs);
+		kfree(fs_vfs);
+		fs_vfs = NULL;
+		return -FS_EMALLOC;
 	}
+	return 0;
 }
 
 static void print_inode_disk_map(struct fs_inode * inode)
 {
-	printk("FILE_SYSTEM : Inode flag:%lx\n", inode->disk_map->disk_map_flag);
-	printk("FILE_SYSTEM : Inode single_indirect_pointer_ind:%d\n", inode->disk_map->single_indirect_pointer_ind);
-	printk("FILE_SYSTEM : Inode double_indirect_pointer_ind:%d\n", inode->disk_map->double_indirect_pointer_ind);
+	printk("FILE_SYSTEM : Inode flag:%x\n", inode->disk_map.disk_map_flag);
+	printk("FILE_SYSTEM : Inode num_blocks:%d\n", inode->disk_map.num_blocks);
+	if(inode->disk_map.single_indirect)
+		printk("FILE_SYSTEM : Inode single_indirect_table:%d\n", inode->disk_map.single_indirect->block_num);
+	if(inode->disk_map.double_indirect)
+		printk("FILE_SYSTEM : Inode double_indirect_table:%d\n", inode->disk_map.double_indirect->block_num);
 	/*for(int i = 0; i < 12; i++)
 	{
-		if(inode->disk_map->blocks[i])
+		if(inode->disk_map.blocks[i])
 		{
-			printk("FILE_SYSTEM : Disk addr : %lx\n", inode->disk_map->blocks[i]->block_addr);
+			printk("FILE_SYSTEM : Disk addr : %lx\n", inode->disk_map.blocks[i]->block_addr);
 		}
 		else
 		{
@@ -58,32 +130,25 @@ static void print_inode_disk_map(struct fs_inode * inode)
 	}*/
 }
 
-static int fs_init(void)
+static void fs_selftest(void)
 {
-	printk("FILE_SYSTEM : Mounting file system----------------\n");
-	alloc_mem_fs();
-	printk("FILE_SYSTEM : Starting addr:%lx\n", (uintptr_t)fs_memory);
-	
-	intialise_file_system(fs_vfs);	
-	initialise_disk_blocks(fs_vfs, fs_memory);
-	allocate_inodes(fs_vfs);
 	struct fs_inode * inode = get_inode(fs_vfs);
 	int ret = 0;
-	//printk("FILE_SYSTEM : remainng blocks:%d\n", fs_vfs->num_free_disk_blocks);
+	//printk("FILE_SYSTEM : remainng blocks:%lld\n", percpu_counter_sum(&fs_vfs->num_free_disk_blocks));
 	
 	/*while(!ret)
 	{
 		ret = alloc_disk_to_inode(fs_vfs, inode);
 		printk("FILE_SYSTEM : ------------------\n");
-		printk("FILE_SYSTEM : remainng blocks:%d\n", fs_vfs->num_free_disk_blocks);
+		printk("FILE_SYSTEM : remainng blocks:%lld\n", percpu_counter_sum(&fs_vfs->num_free_disk_blocks));
 		print_inode_disk_map(inode);
 	}*/
 	
-	for(int i = 0; i < 10 + 256 + 256*256 + 1; i++)
+	for(int i = 0; i < FS_MAX_INODE_BLOCKS + 1; i++)
 	{
 		ret = alloc_disk_to_inode(fs_vfs, inode);
 		printk("FILE_SYSTEM : ------------------\n");
-		printk("FILE_SYSTEM : remainng blocks:%d\n", fs_vfs->num_free_disk_blocks);
+		printk("FILE_SYSTEM : remainng blocks:%lld\n", percpu_counter_sum(&fs_vfs->num_free_disk_blocks));
 		print_inode_disk_map(inode);
 		if(ret)
 		{
@@ -94,12 +159,105 @@ static int fs_init(void)
 	
 	if(ret)
 		printk("FILE_SYSTEM : ret:%d\n", ret);
+}
+
+static int fs_init(void)
+{
+	printk("FILE_SYSTEM : Mounting file system----------------\n");
+	if(alloc_mem_fs())
+		return -ENOMEM;
+	
+	if(initialise_disk_blocks(fs_vfs))
+		goto err_blocks;
+	if(allocate_inodes(fs_vfs))
+		goto err_inodes;
+	if(recover_dax_inodes(fs_vfs))
+		goto err_inodes;
+	if(initialise_pool_shrinker(fs_vfs))
+		goto err_inodes;
+	if(initialise_zero_pool(fs_vfs, zero_pool))
+		goto err_shrinker;
+	if(initialise_reclaim(fs_vfs))
+		goto err_zero_pool;
+	initialise_copy(nt_copy);
+	
+	if(delalloc && fs_dax_enabled(fs_vfs))
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Delayed allocation is not supported on a DAX device\n");
+	else if(initialise_delalloc(fs_vfs, delalloc))
+		goto err_reclaim;
+	
+	if(dedup && fs_dax_enabled(fs_vfs))
+		printk(KERN_ERR "FILE_SYSTEM_ERROR : Dedup is not supported on a DAX device\n");
+	else if(dedup && initialise_dedup(fs_vfs) == 0)
+		fs_vfs->dedup_enabled = true;
+	initialise_fs_stats(fs_vfs);
+	initialise_batch(fs_vfs);
+	initialise_snapshot(fs_vfs);
+	
+	if(checkpoint_path)
+		initialise_checkpoint(fs_vfs, checkpoint_path);
+	
+	if(defrag && initialise_defrag(fs_vfs))
+		goto err_stats;
+	
+	if(restore && checkpoint_path)
+	{
+		int ret = restore_file_system(fs_vfs, checkpoint_path);
+		if(ret)
+			printk(KERN_ERR "FILE_SYSTEM_ERROR : Restoring %s failed:%d\n", checkpoint_path, ret);
+	}
+	else if(bench)
+	{
+		run_benchmarks(fs_vfs, bench);
+	}
+	else if(!fs_dax_enabled(fs_vfs))
+	{
+		//The self test would leave its inode on the DAX device
+		fs_selftest();
+	}
+	
 	return 0;
+	
+err_stats:
+	destroy_fs_stats(fs_vfs);
+	destroy_delalloc(fs_vfs);
+err_reclaim:
+	destroy_reclaim(fs_vfs);
+err_zero_pool:
+	destroy_zero_pool(fs_vfs);
+err_shrinker:
+	destroy_pool_shrinker(fs_vfs);
+err_inodes:
+	destroy_inodes(fs_vfs);
+err_blocks:
+	destroy_disk_blocks(fs_vfs);
+	destroy_pool(fs_vfs);
+	destroy_dax_pool(fs_vfs);
+	destroy_file_system(fs_vfs);
+	kfree(fs_vfs);
+	fs_vfs = NULL;
+	return -ENOMEM;
 }
 
 static void fs_exit(void)
 {
 	printk("FILE_SYSTEM : Unmounting file system\n");
+	destroy_defrag(fs_vfs);
+	destroy_delalloc(fs_vfs);
+	destroy_zero_pool(fs_vfs);
+	if(checkpoint_path)
+		checkpoint_file_system(fs_vfs, false);
+	destroy_pool_shrinker(fs_vfs);
+	destroy_fs_stats(fs_vfs);
+	destroy_snapshots(fs_vfs);
+	destroy_inodes(fs_vfs);
+	destroy_reclaim(fs_vfs);
+	destroy_pool(fs_vfs);
+	destroy_dax_pool(fs_vfs);
+	destroy_disk_blocks(fs_vfs);
+	destroy_file_system(fs_vfs);
+	kfree(fs_vfs);
+	fs_vfs = NULL;
 }
 
 module_init(fs_init);